@@ -0,0 +1,314 @@
+/*
+ * cpus.c : CPU lists, topology placement and pinning shared by ftq and fwq.
+ *
+ * Licensed under the terms of the GNU Public Licence.  See LICENCE_GPL
+ * for details.
+ */
+#define _GNU_SOURCE
+#include <assert.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "cpus.h"
+
+/* highest CPU number a list may name, plus one */
+#define CPULIST_MAX   65536
+
+#define SYSFS_CPU     "/sys/devices/system/cpu"
+
+/**
+ * sysfs_read() : read the first line of a sysfs or procfs file into buf,
+ * without the newline.  returns 0 on success, -1 otherwise.
+ */
+int sysfs_read(const char *path, char *buf, size_t len) {
+  FILE *fp = fopen(path, "r");
+  char *nl;
+
+  if (fp == NULL)
+    return -1;
+  if (fgets(buf, len, fp) == NULL) {
+    fclose(fp);
+    return -1;
+  }
+  fclose(fp);
+  if ((nl = strchr(buf, '\n')) != NULL)
+    *nl = '\0';
+  return 0;
+}
+
+/* mark the online CPUs in set, falling back to 0..N-1 without sysfs */
+static void online_cpus(unsigned char *set) {
+  char buf[4096];
+  char *p, *end;
+  long a, b, i;
+
+  if (sysfs_read(SYSFS_CPU "/online", buf, sizeof(buf)) != 0) {
+    b = sysconf(_SC_NPROCESSORS_ONLN);
+    for (i = 0; i < b && i < CPULIST_MAX; i++)
+      set[i] = 1;
+    return;
+  }
+  for (p = buf; *p != '\0'; p = (*end == ',') ? end + 1 : end) {
+    a = b = strtol(p, &end, 10);
+    if (end == p)
+      break;
+    if (*end == '-')
+      b = strtol(end + 1, &end, 10);
+    for (i = a; i <= b && i < CPULIST_MAX; i++)
+      set[i] = 1;
+  }
+}
+
+/* the CPUs marked in set as a sorted array in *cpus; returns the count */
+static int set_to_list(const unsigned char *set, uint32_t **cpus) {
+  int i, n = 0;
+
+  for (i = 0; i < CPULIST_MAX; i++)
+    n += set[i];
+  *cpus = malloc(sizeof(uint32_t) * (n ? n : 1));
+  assert(*cpus != NULL);
+  for (i = 0, n = 0; i < CPULIST_MAX; i++)
+    if (set[i])
+      (*cpus)[n++] = i;
+  return n;
+}
+
+/* the lowest CPU of a sysfs cpulist file, -1 if it cannot be read */
+static long sysfs_first_cpu(const char *path) {
+  char buf[4096];
+  char *end;
+  long cpu;
+
+  if (sysfs_read(path, buf, sizeof(buf)) != 0)
+    return -1;
+  cpu = strtol(buf, &end, 10);
+  return (end == buf) ? -1 : cpu;
+}
+
+/**
+ * parse_placement() : map a placement policy name to PLACE_*, or -1.
+ */
+int parse_placement(const char *name) {
+  if (strcmp(name, "core") == 0)
+    return PLACE_CORE;
+  if (strcmp(name, "smt") == 0)
+    return PLACE_SMT;
+  if (strcmp(name, "l3") == 0)
+    return PLACE_L3;
+  if (strcmp(name, "node") == 0)
+    return PLACE_NODE;
+  return -1;
+}
+
+/**
+ * cpulist_parse() : parse a cpulist with "!" exclusions into a sorted
+ * array of distinct CPU numbers in *cpus.  returns the count, or -1 if
+ * the list is malformed.  the caller frees *cpus.
+ */
+int cpulist_parse(const char *str, uint32_t **cpus) {
+  unsigned char *set;
+  const char *p = str;
+  char *end;
+  long a, b, i;
+  int n, neg, first = 1;
+
+  set = calloc(CPULIST_MAX, 1);
+  assert(set != NULL);
+
+  while (*p != '\0') {
+    neg = (*p == '!');
+    if (neg)
+      p++;
+    /* a list that opens with an exclusion excludes from everything */
+    if (first && neg)
+      online_cpus(set);
+    first = 0;
+    if (!isdigit((unsigned char)*p))
+      goto bad;
+    a = b = strtol(p, &end, 10);
+    if (*end == '-') {
+      p = end + 1;
+      if (!isdigit((unsigned char)*p))
+	goto bad;
+      b = strtol(p, &end, 10);
+    }
+    if (a > b || b >= CPULIST_MAX)
+      goto bad;
+    for (i = a; i <= b; i++)
+      set[i] = !neg;
+    if (*end == ',')
+      end++;
+    else if (*end != '\0')
+      goto bad;
+    p = end;
+  }
+
+  n = set_to_list(set, cpus);
+  free(set);
+  return n;
+
+ bad:
+  free(set);
+  return -1;
+}
+
+/* the topology key a CPU is grouped by under a policy, -1 if unknown */
+static long place_key(uint32_t cpu, int policy) {
+  char path[256], buf[64], *end;
+  struct dirent *de;
+  DIR *dir;
+  long level, node;
+  int k;
+
+  switch (policy) {
+  case PLACE_CORE:
+  case PLACE_SMT:
+    snprintf(path, sizeof(path),
+	     SYSFS_CPU "/cpu%u/topology/thread_siblings_list", cpu);
+    return sysfs_first_cpu(path);
+  case PLACE_L3:
+    for (k = 0; ; k++) {
+      snprintf(path, sizeof(path), SYSFS_CPU "/cpu%u/cache/index%d/level",
+	       cpu, k);
+      if (sysfs_read(path, buf, sizeof(buf)) != 0)
+	return -1;
+      level = strtol(buf, NULL, 10);
+      if (level == 3) {
+	snprintf(path, sizeof(path),
+		 SYSFS_CPU "/cpu%u/cache/index%d/shared_cpu_list", cpu, k);
+	return sysfs_first_cpu(path);
+      }
+    }
+  case PLACE_NODE:
+    /* the CPU's directory links to its node as nodeK; node ids need
+       not be contiguous, so look for the link rather than count up */
+    snprintf(path, sizeof(path), SYSFS_CPU "/cpu%u", cpu);
+    dir = opendir(path);
+    if (dir == NULL)
+      return -1;
+    node = -1;
+    while (node < 0 && (de = readdir(dir)) != NULL) {
+      if (strncmp(de->d_name, "node", 4) != 0 ||
+	  !isdigit((unsigned char)de->d_name[4]))
+	continue;
+      node = strtol(de->d_name + 4, &end, 10);
+      if (*end != '\0')
+	node = -1;
+    }
+    closedir(dir);
+    return node;
+  }
+  return -1;
+}
+
+struct placed {
+  long key;
+  uint32_t cpu;
+};
+
+static int placed_cmp(const void *a, const void *b) {
+  const struct placed *x = a, *y = b;
+
+  if (x->key != y->key)
+    return (x->key < y->key) ? -1 : 1;
+  return (x->cpu < y->cpu) ? -1 : (x->cpu > y->cpu);
+}
+
+/**
+ * cpus_select() : the CPUs to measure, from a cpulist (NULL for every
+ * online CPU) filtered or ordered by a PLACE_* policy.  returns the
+ * count, or -1 if the list is malformed or topology is unavailable.
+ */
+int cpus_select(const char *list, int policy, uint32_t **cpus) {
+  struct placed *pl;
+  int n, i, m;
+
+  if (list != NULL) {
+    n = cpulist_parse(list, cpus);
+  } else {
+    unsigned char *set = calloc(CPULIST_MAX, 1);
+
+    assert(set != NULL);
+    online_cpus(set);
+    n = set_to_list(set, cpus);
+    free(set);
+  }
+  if (n <= 0 || policy == PLACE_NONE)
+    return n;
+
+  pl = malloc(sizeof(*pl) * n);
+  assert(pl != NULL);
+  for (i = 0; i < n; i++) {
+    pl[i].cpu = (*cpus)[i];
+    pl[i].key = place_key(pl[i].cpu, policy);
+    if (pl[i].key < 0) {
+      fprintf(stderr, "ERROR: no topology for cpu %u in " SYSFS_CPU ".\n",
+	      pl[i].cpu);
+      free(pl);
+      return -1;
+    }
+  }
+  qsort(pl, n, sizeof(*pl), placed_cmp);
+  /* every policy but smt keeps the first CPU of each group */
+  for (i = 0, m = 0; i < n; i++)
+    if (policy == PLACE_SMT || i == 0 || pl[i].key != pl[i-1].key)
+      (*cpus)[m++] = pl[i].cpu;
+  free(pl);
+  return m;
+}
+
+/**
+ * cpu_housekeeping() : the lowest online CPU not among the n measured
+ * cpus, or -1 if every online CPU is measured.
+ */
+int cpu_housekeeping(const uint32_t *cpus, int n) {
+  unsigned char *set = calloc(CPULIST_MAX, 1);
+  int i, hk = -1;
+
+  assert(set != NULL);
+  online_cpus(set);
+  for (i = 0; i < n; i++)
+    if (cpus[i] < CPULIST_MAX)
+      set[cpus[i]] = 0;
+  for (i = 0; i < CPULIST_MAX && hk < 0; i++)
+    if (set[i])
+      hk = i;
+  free(set);
+  return hk;
+}
+
+/**
+ * cpu_pin() : bind the calling thread to one cpu, of any number.
+ * returns 0 on success, -1 with errno set otherwise.
+ */
+int cpu_pin(uint32_t cpu) {
+  cpu_set_t *set;
+  size_t size;
+  int rc;
+
+  set = CPU_ALLOC(cpu + 1);
+  assert(set != NULL);
+  size = CPU_ALLOC_SIZE(cpu + 1);
+  CPU_ZERO_S(size, set);
+  CPU_SET_S(cpu, size, set);
+  rc = sched_setaffinity(0, size, set);
+  CPU_FREE(set);
+  return rc;
+}
+
+/**
+ * housekeeping_thread() : move the calling helper thread, named what in
+ * warnings, to the housekeeping cpu, unless that is -1, and drop its
+ * priority so it only runs when the cpu is otherwise idle.
+ */
+void housekeeping_thread(int cpu, const char *what) {
+  if (cpu >= 0 && cpu_pin(cpu) < 0)
+    fprintf(stderr, "WARNING: failed to pin %s to CPU %d: %m\n", what, cpu);
+  setpriority(PRIO_PROCESS, syscall(SYS_gettid), HOUSEKEEPING_NICE);
+}
@@ -0,0 +1,41 @@
+/*
+ * cpus.h : choosing and pinning to the CPUs that ftq and fwq measure.
+ *
+ * CPU lists use the kernel's cpulist syntax ("0-3,8,10-11", as in
+ * isolcpus= and /sys/devices/system/cpu/online), plus "!cpu" or
+ * "!first-last" to take CPUs out again: "8-63,!32".  A list of nothing
+ * but exclusions starts from all online CPUs.
+ *
+ * A placement policy then thins out or orders the list using the sysfs
+ * topology: one CPU per physical core, all CPUs with SMT siblings next
+ * to each other, one CPU per L3 cache, or one CPU per NUMA node.  The
+ * lowest numbered CPU of each core, cache or node is the one kept.
+ *
+ * Licensed under the terms of the GNU Public Licence.  See LICENCE_GPL
+ * for details.
+ */
+#ifndef __CPUS_H__
+#define __CPUS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* placement policies */
+#define PLACE_NONE   0
+#define PLACE_CORE   1    /* one per physical core */
+#define PLACE_SMT    2    /* every CPU, SMT siblings adjacent */
+#define PLACE_L3     3    /* one per L3 cache */
+#define PLACE_NODE   4    /* one per NUMA node */
+
+/* nice value of helper threads on the housekeeping CPU */
+#define HOUSEKEEPING_NICE  19
+
+extern int sysfs_read(const char *path, char *buf, size_t len);
+extern int parse_placement(const char *name);
+extern int cpulist_parse(const char *str, uint32_t **cpus);
+extern int cpus_select(const char *list, int policy, uint32_t **cpus);
+extern int cpu_housekeeping(const uint32_t *cpus, int n);
+extern int cpu_pin(uint32_t cpu);
+extern void housekeeping_thread(int cpu, const char *what);
+
+#endif /* __CPUS_H__ */
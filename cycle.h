@@ -256,12 +256,17 @@ INLINE_ELAPSED(__inline__)
 #if defined(__GNUC__) && defined(__aarch64__) && !defined(HAVE_TICK_COUNTER)
 typedef unsigned long long ticks;
 
-static inline ticks getticks(void) {
-    struct timespec ts;
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-    return (ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+/* the virtual count of the architected generic timer, cntfrq_el0 Hz */
+static __inline__ ticks getticks(void)
+{
+     ticks ret;
+
+     __asm__ __volatile__ ("isb; mrs %0, cntvct_el0" : "=r"(ret) : : "memory");
+     return ret;
 }
 
+INLINE_ELAPSED(__inline__)
+
 #define HAVE_TICK_COUNTER
 #endif
 
@@ -0,0 +1,151 @@
+/*
+ * events.c : online noise event detection for fwq sample series.
+ *
+ * Licensed under the terms of the GNU Public Licence.  See LICENCE_GPL
+ * for details.
+ */
+#include <string.h>
+#include "events.h"
+
+/**
+ * events_open() : start detection, writing each event as a
+ * "start samples excess" line to fname (NULL for no list).  the
+ * baseline must be set before samples are added.  returns 0, or -1
+ * with errno set if the list could not be created.
+ */
+int events_open(struct events *ev, const char *fname) {
+  memset(ev, 0, sizeof(*ev));
+  ev->limit = ~0ULL;
+  if (fname != NULL) {
+    ev->list = fopen(fname, "w");
+    if (ev->list == NULL)
+      return -1;
+  }
+  return 0;
+}
+
+/**
+ * events_set_baseline() : samples longer than baseline + threshold
+ * ticks are noise.  a threshold of 0 means 10% of the baseline.
+ */
+void events_set_baseline(struct events *ev, unsigned long long baseline,
+			 unsigned long long threshold) {
+  if (threshold == 0)
+    threshold = baseline / 10 > 0 ? baseline / 10 : 1;
+  ev->baseline = baseline;
+  ev->limit = baseline + threshold;
+}
+
+static void close_event(struct events *ev) {
+
+  if (ev->list != NULL)
+    fprintf(ev->list, "%llu %llu %llu\n", ev->start, ev->len, ev->excess);
+  if (ev->count > 0)
+    ev->interval_sum += ev->start - ev->last_start;
+  ev->last_start = ev->start;
+  ev->count++;
+  ev->noisy += ev->len;
+  ev->total_excess += ev->excess;
+  ev->hist[EVENTS_LEN][63 - __builtin_clzll(ev->len)]++;
+  ev->hist[EVENTS_EXCESS][63 - __builtin_clzll(ev->excess | 1)]++;
+  ev->open = 0;
+}
+
+/**
+ * events_add() : classify count samples, taken every stride words from
+ * v, continuing from wherever the previous call left off.
+ */
+void events_add(struct events *ev, const unsigned long long *v,
+		unsigned long count, unsigned long stride) {
+  unsigned long i;
+  unsigned long long x;
+
+  for (i = 0; i < count; i++, v += stride, ev->index++) {
+    x = *v;
+    if (x > ev->limit) {
+      if (!ev->open) {
+	ev->open = 1;
+	ev->start = ev->index;
+	ev->len = 0;
+	ev->excess = 0;
+      }
+      ev->len++;
+      ev->excess += x - ev->baseline;
+    } else if (ev->open) {
+      close_event(ev);
+    }
+  }
+}
+
+/**
+ * events_close() : end of the series; record any event still in
+ * progress and close the list.  returns 0, or -1 with errno set if the
+ * list could not be written.
+ */
+int events_close(struct events *ev) {
+  if (ev->open)
+    close_event(ev);
+  if (ev->list != NULL) {
+    if (fclose(ev->list) != 0) {
+      ev->list = NULL;
+      return -1;
+    }
+    ev->list = NULL;
+  }
+  return 0;
+}
+
+/**
+ * events_print_header() / events_print() : one line per thread, same
+ * layout as the stats table.  interval is the mean number of samples
+ * from the start of one event to the start of the next.  times are
+ * multiplied by scale (e.g. ns per tick) on the way out.
+ */
+void events_print_header(FILE *fp) {
+  fprintf(fp, "# %-6s %12s %12s %12s %12s %14s %12s %12s\n",
+	  "thread", "baseline", "limit", "events", "noisy", "excess",
+	  "per_Msample", "interval");
+}
+
+void events_print(FILE *fp, const char *label, const struct events *ev,
+		  double scale) {
+  fprintf(fp, "  %-6s %12.0f %12.0f %12llu %12llu %14.0f %12.1f %12.1f\n",
+	  label, ev->baseline * scale, ev->limit * scale, ev->count, ev->noisy,
+	  ev->total_excess * scale,
+	  ev->index ? ev->count * 1e6 / ev->index : 0.0,
+	  ev->count > 1 ? (double)ev->interval_sum / (ev->count - 1) : 0.0);
+}
+
+/* one histogram for n threads, one row per power of two that any
+   thread hit: the bucket's lower bound times scale, then a count per
+   thread */
+static void print_hist(FILE *fp, const struct events *ev, int n, int which,
+		       const char *head, double scale) {
+  int b, j, used;
+
+  fprintf(fp, "# %-18s %s\n", head, "events per thread");
+  for (b = 0; b < EVENTS_HIST; b++) {
+    for (used = 0, j = 0; j < n; j++)
+      used |= ev[j].hist[which][b] != 0;
+    if (!used)
+      continue;
+    fprintf(fp, "  %-18.0f", (1ULL << b) * scale);
+    for (j = 0; j < n; j++)
+      fprintf(fp, " %llu", ev[j].hist[which][b]);
+    fprintf(fp, "\n");
+  }
+}
+
+/**
+ * events_print_hist() : log2 histograms of event duration (samples)
+ * and of event size (excess ticks, multiplied by scale and labelled in
+ * unit) for n threads.
+ */
+void events_print_hist(FILE *fp, const struct events *ev, int n,
+		       double scale, const char *unit) {
+  char head[32];
+
+  print_hist(fp, ev, n, EVENTS_LEN, "samples>=", 1.0);
+  snprintf(head, sizeof(head), "excess_%s>=", unit);
+  print_hist(fp, ev, n, EVENTS_EXCESS, head, scale);
+}
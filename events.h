@@ -0,0 +1,53 @@
+/*
+ * events.h : online noise event detection for fwq sample series.
+ *
+ * A sample is noisy when it takes more than limit ticks, limit being a
+ * per-thread baseline plus a threshold.  Consecutive noisy samples form
+ * one event.  Events are found in a single pass with constant memory,
+ * so the same code serves the in-memory sample arrays and the streaming
+ * drain thread.
+ *
+ * Licensed under the terms of the GNU Public Licence.  See LICENCE_GPL
+ * for details.
+ */
+#ifndef __EVENTS_H__
+#define __EVENTS_H__
+
+#include <stdio.h>
+
+/* log2 buckets of event length (samples) and of event excess (ticks) */
+#define EVENTS_HIST    64
+#define EVENTS_LEN     0
+#define EVENTS_EXCESS  1
+
+struct events {
+  unsigned long long baseline;  /* expected sample time, ticks */
+  unsigned long long limit;     /* samples above this are noisy */
+  unsigned long long index;     /* samples seen so far */
+  FILE *list;                   /* event list, or NULL */
+
+  /* event in progress */
+  int open;
+  unsigned long long start, len, excess;
+
+  /* totals */
+  unsigned long long count;
+  unsigned long long noisy;     /* samples that were part of an event */
+  unsigned long long total_excess;
+  unsigned long long last_start, interval_sum;
+  unsigned long long hist[2][EVENTS_HIST];  /* EVENTS_LEN, EVENTS_EXCESS */
+};
+
+extern int events_open(struct events *ev, const char *fname);
+extern void events_set_baseline(struct events *ev, unsigned long long baseline,
+				unsigned long long threshold);
+extern void events_add(struct events *ev, const unsigned long long *v,
+		       unsigned long count, unsigned long stride);
+extern int events_close(struct events *ev);
+extern void events_print_header(FILE *fp);
+extern void events_print(FILE *fp, const char *label,
+			 const struct events *ev, double scale);
+extern void events_print_hist(FILE *fp, const struct events *ev, int n,
+			      double scale, const char *unit);
+
+#endif /* __EVENTS_H__ */
@@ -0,0 +1,322 @@
+/**
+ * ftq-check.c : self checks of the support code shared by ftq and fwq,
+ * run by "make check".  Downstream tools depend on the binary sample
+ * format, so it is written here with the benchmarks' own routines and
+ * read back field by field, and on the summary table's quantiles, which
+ * are compared with exact ones from sorted samples.
+ *
+ * Licensed under the terms of the GNU Public Licence.  See LICENCE_GPL
+ * for details.
+ */
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "events.h"
+#include "output.h"
+#include "stats.h"
+
+static int checks, failures;
+
+#define CHECK(cond)							\
+  do {									\
+    checks++;								\
+    if (!(cond)) {							\
+      fprintf(stderr,"FAIL: %s:%d: %s\n", __FILE__, __LINE__, #cond);	\
+      failures++;							\
+    }									\
+  } while (0)
+
+/* read all of a file into memory */
+static char *slurp(const char *path, size_t *len) {
+  struct stat st;
+  char *buf;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) < 0)
+    return NULL;
+  buf = malloc(st.st_size);
+  if (buf != NULL && read(fd, buf, st.st_size) != st.st_size) {
+    free(buf);
+    buf = NULL;
+  }
+  close(fd);
+  *len = st.st_size;
+  return buf;
+}
+
+/**
+ * check_bin() : a two thread file through ftq_write_bin() and back.
+ */
+static void check_bin(void) {
+  enum { THREADS = 2, SAMPLES = 1000, WORDS = 2 };
+  unsigned long long *bufs[THREADS], starts[THREADS] = { 1000, 2000 };
+  unsigned long long quanta[THREADS] = { 4096, 8192 };
+  const unsigned long long *data, *rstarts, *rquanta;
+  uint32_t cpus[THREADS] = { 3, FTQ_CPU_NONE }, *sides[THREADS];
+  const uint32_t *rcpus, *rsides;
+  struct ftq_bin_header h;
+  const struct ftq_bin_header *rh;
+  char path[] = "/tmp/ftq-check.XXXXXX";
+  char *file;
+  size_t len;
+  int fd, j, i, bad;
+
+  for (j = 0; j < THREADS; j++) {
+    bufs[j] = malloc(sizeof(unsigned long long) * SAMPLES * WORDS);
+    for (i = 0; i < SAMPLES * WORDS; i++)
+      bufs[j][i] = (unsigned long long)j << 32 | i;
+    sides[j] = malloc(sizeof(uint32_t) * SAMPLES);
+    for (i = 0; i < SAMPLES; i++)
+      sides[j][i] = j * SAMPLES + i;
+  }
+  ftq_bin_init(&h, FTQ_BIN_FTQ, THREADS, SAMPLES, WORDS);
+  h.bits = 20;
+  h.quantum = 1 << 20;
+  h.ns_per_tick = 0.25;
+  h.tick_err_ppm = 12.5;
+  strcpy(h.timer, "rdtscp");
+  h.counters = 0x1f;
+  h.counters_fast = 0x7;
+  ftq_bin_set_side(&h, 1);
+  h.flags |= FTQ_FLAG_GAPS;
+
+  fd = mkstemp(path);
+  CHECK(fd >= 0);
+  if (fd < 0)
+    return;
+  CHECK(ftq_write_bin(fd, &h, cpus, starts, quanta, bufs, sides) == 0);
+  close(fd);
+  file = slurp(path, &len);
+  unlink(path);
+  CHECK(file != NULL);
+  if (file == NULL)
+    return;
+
+  rh = (const struct ftq_bin_header *)file;
+  CHECK(len >= sizeof(*rh));
+  CHECK(memcmp(rh->magic, FTQ_BIN_MAGIC, sizeof(rh->magic)) == 0);
+  CHECK(rh->version == FTQ_BIN_VERSION);
+  CHECK(rh->header_size == sizeof(*rh));
+  CHECK(rh->kind == FTQ_BIN_FTQ);
+  CHECK(rh->tick_unit == FTQ_TICK_CYCLES);
+  CHECK(rh->bits == 20 && rh->quantum == 1 << 20);
+  CHECK(rh->ns_per_tick == 0.25 && rh->tick_err_ppm == 12.5);
+  CHECK(strcmp(rh->timer, "rdtscp") == 0);
+  CHECK(rh->counters == 0x1f && rh->counters_fast == 0x7);
+  CHECK(rh->numthreads == THREADS && rh->numsamples == SAMPLES);
+  CHECK(rh->sample_words == WORDS);
+  CHECK(rh->cpu_offset >= rh->header_size);
+  CHECK(rh->data_offset % FTQ_BIN_ALIGN == 0);
+  CHECK(rh->start_offset >= rh->cpu_offset + THREADS * sizeof(uint32_t));
+  CHECK(rh->start_offset % sizeof(uint64_t) == 0);
+  CHECK(rh->quantum_offset >= rh->start_offset + THREADS * sizeof(uint64_t));
+  CHECK(rh->quantum_offset % sizeof(uint64_t) == 0);
+  CHECK(rh->data_offset >= rh->quantum_offset + THREADS * sizeof(uint64_t));
+  CHECK(rh->side_words == 1 && rh->flags == FTQ_FLAG_GAPS);
+  CHECK(rh->side_offset >= rh->data_offset +
+	THREADS * SAMPLES * WORDS * sizeof(unsigned long long));
+  CHECK(len == rh->side_offset + THREADS * SAMPLES * sizeof(uint32_t));
+  if (len != rh->side_offset + THREADS * SAMPLES * sizeof(uint32_t)) {
+    free(file);
+    return;
+  }
+
+  rcpus = (const uint32_t *)(file + rh->cpu_offset);
+  CHECK(rcpus[0] == 3 && rcpus[1] == FTQ_CPU_NONE);
+  rstarts = (const unsigned long long *)(file + rh->start_offset);
+  CHECK(rstarts[0] == 1000 && rstarts[1] == 2000);
+  rquanta = (const unsigned long long *)(file + rh->quantum_offset);
+  CHECK(rquanta[0] == 4096 && rquanta[1] == 8192);
+  data = (const unsigned long long *)(file + rh->data_offset);
+  for (j = 0, bad = 0; j < THREADS; j++)
+    for (i = 0; i < SAMPLES * WORDS; i++)
+      bad += data[j * SAMPLES * WORDS + i] != bufs[j][i];
+  CHECK(bad == 0);
+  rsides = (const uint32_t *)(file + rh->side_offset);
+  for (j = 0, bad = 0; j < THREADS * SAMPLES; j++)
+    bad += rsides[j] != (uint32_t)j;
+  CHECK(bad == 0);
+
+  free(file);
+  for (j = 0; j < THREADS; j++) {
+    free(bufs[j]);
+    free(sides[j]);
+  }
+}
+
+/**
+ * check_text() : the text columns must match printf() byte for byte.
+ */
+static void check_text(void) {
+  static const unsigned long long v[] = {
+    0, 9, 10, 99, 100, 12345, -1ULL, -1234567ULL, 1ULL << 63,
+    18446744073709551615ULL / 3,
+  };
+  static const uint32_t v32[] = { 0, 7, 4294967295U, 1000000 };
+  enum { N = sizeof(v) / sizeof(v[0]), N32 = sizeof(v32) / sizeof(v32[0]) };
+  char path[] = "/tmp/ftq-check.XXXXXX";
+  char want[1024], *buf, *file;
+  size_t len, n;
+  int fd, i;
+
+  buf = malloc(TEXT_BUFSIZE);
+  for (i = 0, n = 0; i < N; i += 2)
+    n += snprintf(want + n, sizeof(want) - n, "%lld\n", (long long)v[i]);
+  for (i = 0; i < N32; i++)
+    n += snprintf(want + n, sizeof(want) - n, "%u\n", v32[i]);
+
+  fd = mkstemp(path);
+  CHECK(fd >= 0);
+  if (fd < 0)
+    return;
+  CHECK(write_text_column(fd, v, (N + 1) / 2, 2, buf) == 0);
+  CHECK(write_text_column32(fd, v32, N32, 1, buf) == 0);
+  close(fd);
+  file = slurp(path, &len);
+  unlink(path);
+  CHECK(file != NULL && len == n && memcmp(file, want, n) == 0);
+  free(file);
+  free(buf);
+}
+
+static int cmp_ull(const void *a, const void *b) {
+  unsigned long long x = *(const unsigned long long *)a;
+  unsigned long long y = *(const unsigned long long *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* the exact q quantile of n sorted values, by the same rank rule */
+static unsigned long long exact_quantile(const unsigned long long *v,
+					 unsigned long n, double q) {
+  unsigned long rank = ceil(q * n);
+
+  return v[rank < 1 ? 0 : rank - 1];
+}
+
+/**
+ * check_stats() : quantiles are exact below 2^STATS_SUB_BITS and within
+ * one bucket, 1/2^STATS_SUB_BITS, above; merging equals adding.
+ */
+static void check_stats(void) {
+  static const double qs[] = { 0.0, 0.01, 0.5, 0.9, 0.99, 0.999, 0.9999, 1.0 };
+  enum { N = 100000, NQ = sizeof(qs) / sizeof(qs[0]) };
+  struct stats st, a, b;
+  unsigned long long small[100], *v, seed = 1, got, want;
+  double sum = 0.0, ss = 0.0, mean, err;
+  int i, bad;
+
+  /* 1..100: every quantile is exact */
+  for (i = 0; i < 100; i++)
+    small[i] = i + 1;
+  CHECK(stats_init(&st) == 0);
+  stats_add(&st, small, 100, 1);
+  CHECK(st.n == 100 && st.min == 1 && st.max == 100 && st.sum == 5050);
+  CHECK(stats_quantile(&st, 0.0) == 1);
+  CHECK(stats_quantile(&st, 0.5) == 50);
+  CHECK(stats_quantile(&st, 0.9) == 90);
+  CHECK(stats_quantile(&st, 0.99) == 99);
+  CHECK(stats_quantile(&st, 1.0) == 100);
+  CHECK(fabs(st.mean - 50.5) < 1e-9);
+  CHECK(fabs(stats_stddev(&st) - sqrt(841.6666666666666)) < 1e-6);
+  CHECK(fabs(stats_noise(&st) - (5050.0 - 100) / 5050) < 1e-12);
+  stats_free(&st);
+
+  /* a long tailed series spanning many powers of two, added every
+     other word to exercise the stride */
+  v = malloc(sizeof(*v) * N * 2);
+  for (i = 0; i < N; i++) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    v[2*i] = 1000 + ((seed >> 33) % 1000) * (i % 97 == 0 ? 10000 : 1);
+    v[2*i+1] = ~0ULL;
+    sum += v[2*i];
+  }
+  CHECK(stats_init(&st) == 0 && stats_init(&a) == 0 && stats_init(&b) == 0);
+  stats_add(&st, v, N, 2);
+  stats_add(&a, v, N / 3, 2);
+  stats_add(&b, v + N / 3 * 2, N - N / 3, 2);
+  stats_merge(&a, &b);
+
+  mean = sum / N;
+  for (i = 0; i < N; i++)
+    ss += (v[2*i] - mean) * (v[2*i] - mean);
+  CHECK(st.n == N && fabs(st.mean - mean) < 1e-6 * mean);
+  CHECK(fabs(stats_stddev(&st) - sqrt(ss / (N - 1))) <
+	1e-6 * sqrt(ss / (N - 1)));
+  CHECK(a.n == st.n && a.sum == st.sum && a.min == st.min &&
+	a.max == st.max);
+  CHECK(fabs(a.mean - st.mean) < 1e-9 * st.mean);
+  CHECK(fabs(a.m2 - st.m2) < 1e-9 * st.m2);
+
+  for (i = 0; i < N; i++)
+    v[i] = v[2*i];
+  qsort(v, N, sizeof(*v), cmp_ull);
+  for (i = 0, bad = 0; i < NQ; i++) {
+    got = stats_quantile(&st, qs[i]);
+    want = exact_quantile(v, N, qs[i]);
+    err = fabs((double)got - want) / want;
+    bad += err > 1.0 / (1 << STATS_SUB_BITS);
+    bad += stats_quantile(&a, qs[i]) != got;
+  }
+  CHECK(bad == 0);
+
+  free(v);
+  stats_free(&st);
+  stats_free(&a);
+  stats_free(&b);
+}
+
+/**
+ * check_events() : runs of samples over the limit are single events,
+ * whether the series arrives in one piece or split across calls.
+ */
+static void check_events(void) {
+  /* baseline 100, limit 110: events at 2-3, 6 and 9-12 (still open at
+     the end) */
+  static const unsigned long long v[] = {
+    100, 105, 200, 150, 110, 100, 111, 100, 100, 300, 300, 300, 300,
+  };
+  enum { N = sizeof(v) / sizeof(v[0]) };
+  struct events ev;
+
+  CHECK(events_open(&ev, NULL) == 0);
+  events_set_baseline(&ev, 100, 10);
+  events_add(&ev, v, 3, 1);
+  events_add(&ev, v + 3, N - 3, 1);
+  CHECK(events_close(&ev) == 0);
+  CHECK(ev.count == 3 && ev.noisy == 7 && ev.index == N);
+  CHECK(ev.total_excess == 100 + 50 + 11 + 4 * 200);
+  CHECK(ev.interval_sum == 9 - 2);
+  CHECK(ev.hist[EVENTS_LEN][0] == 1 && ev.hist[EVENTS_LEN][1] == 1 &&
+	ev.hist[EVENTS_LEN][2] == 1);
+  CHECK(ev.hist[EVENTS_EXCESS][3] == 1 && ev.hist[EVENTS_EXCESS][7] == 1 &&
+	ev.hist[EVENTS_EXCESS][9] == 1);
+
+  /* a threshold of 0 is 10% of the baseline */
+  CHECK(events_open(&ev, NULL) == 0);
+  events_set_baseline(&ev, 1000, 0);
+  CHECK(ev.limit == 1100);
+  events_close(&ev);
+}
+
+/**
+ * main()
+ */
+int main(void) {
+  check_bin();
+  check_text();
+  check_stats();
+  check_events();
+
+  if (failures) {
+    fprintf(stderr,"%d of %d checks failed.\n", failures, checks);
+    exit(EXIT_FAILURE);
+  }
+  printf("all %d checks passed.\n", checks);
+  exit(EXIT_SUCCESS);
+}
@@ -15,13 +15,23 @@
  * Licensed under the terms of the GNU Public Licence.  See LICENCE_GPL 
  * for details.
  */
+#define _GNU_SOURCE
 #include "ftq.h"
+#include "output.h"
+#include "mem.h"
+#include "timer.h"
+#include "irqstat.h"
+#include "spectrum.h"
+#include <sys/mman.h>
 
 /* affinity */
 #ifdef _WITH_PTHREADS_
 #include <sys/syscall.h>
 #include <sys/types.h>
 #include <sched.h>
+#include "cpus.h"
+#include "rt.h"
+#include "stream.h"
 #endif
 
 /**
@@ -34,6 +44,23 @@
 #define DEFAULT_BITS   20
 #define MAX_BITS       30
 #define MIN_BITS       3
+#define DEFAULT_PEAKS  8
+
+/* long options without a short form */
+enum {
+  OPT_STREAM = 256,
+  OPT_HOUSEKEEPING,
+  OPT_HUGEPAGES,
+  OPT_MLOCK,
+  OPT_MLOCKALL,
+  OPT_SPECTRUM,
+  OPT_CPUS,
+  OPT_PLACEMENT,
+  OPT_SCHED,
+  OPT_PRIORITY,
+  OPT_DEADLINE,
+  OPT_PREFLIGHT,
+};
 
 /**
  * set up for coarser work grains than default
@@ -55,21 +82,55 @@
  * global variables
  */
 
-/* samples: each sample has a timestamp and a work count. */
-static unsigned long long *samples;
+/* samples: each sample has a timestamp and a work count.  one buffer
+   of numsamples such pairs per thread, allocated by the thread itself. */
+static unsigned long long **samples;
 static unsigned long long interval_length;
 static int interval_bits = DEFAULT_BITS;
 static unsigned long numsamples = DEFAULT_COUNT;
+static int memflags = 0;
+/* the CPU each thread measures (FTQ_CPU_NONE when unpinned), and the
+   same array when --cpus or --placement put the CPUs in file names */
+static uint32_t *cpus;
+static const uint32_t *name_cpus;
+
+/* threads that have finished warming up and started sampling */
+static int sampling_threads = 0;
+
+/* tick counter calibration, for reporting in real time units */
+static struct timer_cal timer;
+
+/* streaming mode: samples go through per-thread rings to disk */
+static int use_stream = 0;
+#ifdef _WITH_PTHREADS_
+static struct stream stream;
+/* --sched: scheduling policy of the measuring threads */
+static struct rt_sched rt_sched = {
+  SCHED_OTHER, RT_DEFAULT_PRIO, RT_DEFAULT_RUNTIME, RT_DEFAULT_PERIOD
+};
+#endif
+
+/* spectral analysis of the work counts: number of peaks to report,
+   and one spectrum per thread */
+static int spectrum_peaks_wanted = 0;
+static struct spectrum *thread_spectrum;
 
 /**
  * usage()
  */
 void usage(char *av0) {
 #ifdef _WITH_PTHREADS_
-  fprintf(stderr,"usage: %s [-t threads] [-n samples] [-i bits] [-h] [-o outname] [-s]\n",
+  fprintf(stderr,"usage: %s [-t threads] [-n samples] [-i bits] [-h] [-o outname] [-s]\n"
+	  "       [--format=text|bin] [--stream] [--housekeeping=cpu]\n"
+	  "       [--hugepages] [--mlock] [--mlockall] [--spectrum[=peaks]]\n"
+	  "       [--cpus=list] [--placement=core|smt|l3|node]\n"
+	  "       [--sched=other|fifo|rr|deadline] [--priority=prio]\n"
+	  "       [--deadline=runtime_us,period_us] [--preflight]\n",
 	  av0);
 #else
-  fprintf(stderr,"usage: %s [-n samples] [-i bits] [-h] [-o outname] [-s]\n",
+  fprintf(stderr,"usage: %s [-n samples] [-i bits] [-h] [-o outname] [-s]\n"
+	  "       [--format=text|bin] [--hugepages] [--mlock]\n"
+	  "       [--mlockall] [--spectrum[=peaks]]\n",
 	  av0);
 #endif
   exit(EXIT_FAILURE);
@@ -81,7 +142,12 @@ void usage(char *av0) {
 void *ftq_core(void *arg) {
   /* thread number, zero based. */
   int thread_num = (int)(intptr_t)arg;
-  int i,offset;
+  int i;
+  unsigned long long *buf;
+  unsigned long pos, cap;
+#ifdef _WITH_PTHREADS_
+  struct stream_ring *ring = NULL;
+#endif
 #ifdef MULTIITER
   int k;
 #endif
@@ -93,17 +159,43 @@ void *ftq_core(void *arg) {
 #ifdef _WITH_PTHREADS_ 
 
   /* affinity stuff */
-  unsigned long mask = 0x1;
-
-  mask = mask<<thread_num;
-  printf("thread number = %d with affinity mask = %d\n", thread_num, mask);
-  if (pthread_setaffinity_np( pthread_self(), sizeof ( mask ), &mask ) < 0 ) {
-    perror("pthread_setaffinity_np");
+  printf("thread number = %d on cpu %u\n", thread_num, cpus[thread_num]);
+  if (cpu_pin(cpus[thread_num]) < 0) {
+    perror("sched_setaffinity");
+  }
+  if (rt_apply(&rt_sched) < 0) {
+    fprintf(stderr, "failed to set %s scheduling: thread: %d, %m\n",
+	    rt_name(rt_sched.policy), thread_num);
+    exit(1);
   }
 
 #endif
 
-  offset = thread_num * numsamples * 2;
+  /* where the samples go: straight into this thread's own buffer, or
+     a chunk at a time through the stream ring.  either way the memory
+     is allocated and faulted in here, now that we are on our CPU. */
+#ifdef _WITH_PTHREADS_
+  if (use_stream) {
+    if (stream_ring_init(&stream, thread_num) < 0) {
+      fprintf(stderr, "failed to allocate samples: thread: %d, %m\n",
+	      thread_num);
+      exit(1);
+    }
+    ring = &stream.rings[thread_num];
+    buf = ring->chunk[ring->cur];
+    cap = STREAM_CHUNK_WORDS;
+  } else
+#endif
+  {
+    buf = sample_alloc(sizeof(unsigned long long)*numsamples*2, memflags);
+    if (buf == NULL) {
+      fprintf(stderr, "failed to allocate samples: thread: %d, %m\n",
+	      thread_num);
+      exit(1);
+    }
+    samples[thread_num] = buf;
+    cap = numsamples * 2;
+  }
   done = 0;
   count = 0;
 
@@ -129,8 +221,8 @@ void *ftq_core(void *arg) {
       now = getticks();
     }
     
-    samples[(done*2)+offset] = last;
-    samples[(done*2)+1+offset] = count;
+    buf[done*2] = last;
+    buf[(done*2)+1] = count;
     
     done++;
     
@@ -145,7 +237,9 @@ void *ftq_core(void *arg) {
   /****************************/
   /* now do the real sampling */
   /****************************/
+  __sync_add_and_fetch(&sampling_threads, 1);
   done = 0;
+  pos = 0;
 
   while (1) {
     count = 0;
@@ -163,8 +257,16 @@ void *ftq_core(void *arg) {
       now = getticks();
     }
     
-    samples[(done*2)+offset] = last;
-    samples[(done*2)+1+offset] = count;
+    buf[pos] = last;
+    buf[pos+1] = count;
+    pos += 2;
+    if (pos == cap) {
+#ifdef _WITH_PTHREADS_
+      if (ring != NULL)
+	buf = stream_hand_off(ring, pos);
+#endif
+      pos = 0;
+    }
     
     done++;
     
@@ -176,23 +278,58 @@ void *ftq_core(void *arg) {
     endinterval = (last + interval_length) & (~(interval_length - 1));
   }
 
+#ifdef _WITH_PTHREADS_
+  if (ring != NULL)
+    stream_done(ring, pos);
+#endif
+
   return NULL;
 }
 
+#ifdef _WITH_PTHREADS_
+/*
+ * streaming mode: runs on the drain thread for every chunk written, so
+ * the spectra (arg) are built as the run goes.
+ */
+static void ftq_consume(int thread, const unsigned long long *v,
+			const uint32_t *side, unsigned long words,
+			void *arg) {
+  struct spectrum *spectra = arg;
+
+  spectrum_add(&spectra[thread], v + 1, words / 2, 2);
+}
+#endif
+
 /**
  * main()
  */
 int main(int argc, char **argv) {
   /* local variables */
-  char fname_times[1024], fname_counts[1024], buf[32], outname[255];
+  char fname_times[1024], outname[255];
   int i,j;
   int numthreads = 1, use_threads = 0;
   int fp;
   int use_stdout = 0;
+  int format = FORMAT_TEXT;
+  int use_mlockall = 0;
+  /* interrupt snapshots around the sampling, see irqstat.h */
+  struct irqstat irq_before, irq_after;
+  struct timespec irq_t0, irq_t1;
+  int use_irqstat;
+  unsigned long spectrum_len = 0;
+  double sample_hz;
+  char label[32];
+  struct ftq_bin_header hdr;
+  uint32_t *cpu_list = NULL;
 #ifdef _WITH_PTHREADS_
   int rc;
   pthread_t *threads;
-  unsigned long mask = 1;
+  struct timespec poll = { 0, 1000000 };
+  char *cpus_arg = NULL;
+  int use_preflight = 0;
+  int placement = PLACE_NONE;
+  int ncpus;
+  int housekeeping = -1;
 #endif
 
   /* default output name prefix */
@@ -234,10 +371,23 @@ int main(int argc, char **argv) {
 	 {"outname",0,0,'o'},
 	 {"stdout",0,0,'s'},
 	 {"threads",0,0,'t'},
+	 {"format",1,0,'f'},
+	 {"stream",0,0,OPT_STREAM},
+	 {"housekeeping",1,0,OPT_HOUSEKEEPING},
+	 {"hugepages",0,0,OPT_HUGEPAGES},
+	 {"mlock",0,0,OPT_MLOCK},
+	 {"mlockall",0,0,OPT_MLOCKALL},
+	 {"spectrum",2,0,OPT_SPECTRUM},
+	 {"cpus",1,0,OPT_CPUS},
+	 {"placement",1,0,OPT_PLACEMENT},
+	 {"sched",1,0,OPT_SCHED},
+	 {"priority",1,0,OPT_PRIORITY},
+	 {"deadline",1,0,OPT_DEADLINE},
+	 {"preflight",0,0,OPT_PREFLIGHT},
 	 {0,0,0,0}
        };
     
-       c = getopt_long(argc, argv, "n:hsi:o:t:",
+       c = getopt_long(argc, argv, "n:hsi:o:t:f:",
 		       long_options, &option_index);
        if (c == -1) 
 	 break;
@@ -254,6 +404,13 @@ int main(int argc, char **argv) {
        case 's':
 	 use_stdout = 1;
 	 break;
+       case 'f':
+	 format = parse_format(optarg);
+	 if (format < 0) {
+	   fprintf(stderr,"ERROR: unknown output format '%s'.\n", optarg);
+	   usage(argv[0]);
+	 }
+	 break;
        case 'o':
 	 sprintf(outname,"%s",optarg);
 	 break;
@@ -261,7 +418,90 @@ int main(int argc, char **argv) {
 	 interval_bits = atoi(optarg);
 	 break;
        case 'n':
-	 numsamples = atoi(optarg);
+	 numsamples = strtoul(optarg, NULL, 0);
+	 break;
+       case OPT_STREAM:
+#ifndef _WITH_PTHREADS_
+	 fprintf(stderr,"ERROR: streaming requires pthreads support.\n");
+	 exit(EXIT_FAILURE);
+#endif
+	 use_stream = 1;
+	 break;
+       case OPT_HOUSEKEEPING:
+#ifndef _WITH_PTHREADS_
+	 fprintf(stderr,"ERROR: --housekeeping requires pthreads support.\n");
+	 exit(EXIT_FAILURE);
+#else
+	 housekeeping = atoi(optarg);
+#endif
+	 break;
+       case OPT_HUGEPAGES:
+	 memflags |= MEM_HUGE;
+	 break;
+       case OPT_MLOCK:
+	 memflags |= MEM_LOCK;
+	 break;
+       case OPT_MLOCKALL:
+	 use_mlockall = 1;
+	 break;
+       case OPT_SPECTRUM:
+	 spectrum_peaks_wanted = optarg ? atoi(optarg) : DEFAULT_PEAKS;
+	 if (spectrum_peaks_wanted < 1) {
+	   fprintf(stderr,"ERROR: invalid spectrum peak count '%s'.\n",
+		   optarg);
+	   exit(EXIT_FAILURE);
+	 }
+	 break;
+       case OPT_CPUS:
+#ifndef _WITH_PTHREADS_
+	 fprintf(stderr,"ERROR: --cpus requires pthreads support.\n");
+	 exit(EXIT_FAILURE);
+#else
+	 cpus_arg = optarg;
+#endif
+	 break;
+       case OPT_PLACEMENT:
+#ifndef _WITH_PTHREADS_
+	 fprintf(stderr,"ERROR: --placement requires pthreads support.\n");
+	 exit(EXIT_FAILURE);
+#else
+	 placement = parse_placement(optarg);
+	 if (placement < 0) {
+	   fprintf(stderr,"ERROR: unknown placement '%s'.\n", optarg);
+	   usage(argv[0]);
+	 }
+#endif
+	 break;
+       case OPT_SCHED:
+       case OPT_PRIORITY:
+       case OPT_DEADLINE:
+       case OPT_PREFLIGHT:
+#ifndef _WITH_PTHREADS_
+	 fprintf(stderr,"ERROR: scheduling options require pthreads "
+		 "support.\n");
+	 exit(EXIT_FAILURE);
+#else
+	 if (c == OPT_SCHED) {
+	   rt_sched.policy = parse_sched(optarg);
+	   if (rt_sched.policy < 0) {
+	     fprintf(stderr,"ERROR: unknown scheduling policy '%s'.\n", optarg);
+	     usage(argv[0]);
+	   }
+	 } else if (c == OPT_PRIORITY) {
+	   rt_sched.prio = atoi(optarg);
+	 } else if (c == OPT_DEADLINE) {
+	   char *end;
+
+	   rt_sched.runtime = strtod(optarg, &end) * 1000;
+	   rt_sched.period = (*end == ',') ? strtod(end + 1, NULL) * 1000 : 0;
+	   if (rt_sched.runtime == 0 || rt_sched.period < rt_sched.runtime) {
+	     fprintf(stderr,"ERROR: invalid deadline '%s'.\n", optarg);
+	     exit(EXIT_FAILURE);
+	   }
+	 } else {
+	   use_preflight = 1;
+	 }
+#endif
 	 break;
        case 'h':
        default:
@@ -271,15 +511,52 @@ int main(int argc, char **argv) {
      }
 #endif /* Plan9 */
 
-  /* sanity check */
-  if (numsamples > MAX_SAMPLES) {
+  /* sanity check.  streamed runs only ever hold two chunks per thread
+     in memory, so they are not limited. */
+  if (numsamples > MAX_SAMPLES && !use_stream) {
     fprintf(stderr,"WARNING: sample count exceeds maximum.\n");
     fprintf(stderr,"         setting count to maximum.\n");
     numsamples = MAX_SAMPLES;
   }
   
-  /* allocate sample storage */
-  samples = malloc(sizeof(unsigned long long)*numsamples*2*numthreads);
+#ifdef _WITH_PTHREADS_
+  /* --cpus and --placement pick the CPUs; one thread each, or the first
+     -t of them */
+  if (cpus_arg != NULL || placement != PLACE_NONE) {
+    ncpus = cpus_select(cpus_arg, placement, &cpu_list);
+    if (ncpus <= 0) {
+      fprintf(stderr,"ERROR: no CPUs to measure in '%s'.\n",
+	      cpus_arg ? cpus_arg : "online");
+      exit(EXIT_FAILURE);
+    }
+    if (use_threads == 0)
+      numthreads = ncpus;
+    else if (numthreads > ncpus) {
+      fprintf(stderr,"ERROR: %d threads but only %d CPUs selected.\n",
+	      numthreads, ncpus);
+      exit(EXIT_FAILURE);
+    }
+    use_threads = 1;
+  }
+#endif
+
+  /* the CPU each thread measures, as recorded in binary output and,
+     with an explicit CPU selection, in the file names */
+  cpus = malloc(sizeof(*cpus)*numthreads);
+  assert(cpus != NULL);
+  for (j=0;j<numthreads;j++) {
+#ifdef _WITH_PTHREADS_
+    cpus[j] = cpu_list ? cpu_list[j] : (uint32_t)j;
+#else
+    cpus[j] = FTQ_CPU_NONE;
+#endif
+  }
+  if (cpu_list != NULL)
+    name_cpus = cpus;
+  free(cpu_list);
+
+  /* sample storage itself is allocated by each thread in ftq_core() */
+  samples = calloc(numthreads, sizeof(*samples));
   assert(samples != NULL);
 
   if (interval_bits > MAX_BITS || interval_bits < MIN_BITS) {
@@ -288,8 +565,8 @@ int main(int argc, char **argv) {
     interval_bits = MAX_BITS;
   }
 
-  if (use_threads == 1 && numthreads < 2) {
-    fprintf(stderr,"ERROR: >1 threads required for multithread mode.\n");
+  if (use_threads == 1 && numthreads < 1) {
+    fprintf(stderr,"ERROR: at least 1 thread required for multithread mode.\n");
     exit(EXIT_FAILURE);
   }
 
@@ -298,20 +575,130 @@ int main(int argc, char **argv) {
     exit(EXIT_FAILURE);
   }
 
+  if (format == FORMAT_BIN && use_stdout == 1) {
+    fprintf(stderr,"ERROR: cannot write binary format to stdout.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (use_stream == 1 && use_stdout == 1) {
+    fprintf(stderr,"ERROR: cannot stream to stdout.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /* the spectrum is averaged over segments of a power of two samples,
+     as long as the run allows */
+  if (spectrum_peaks_wanted > 0) {
+    spectrum_len = spectrum_size(numsamples);
+    if (spectrum_len == 0) {
+      fprintf(stderr,"ERROR: spectrum needs at least %d samples.\n",
+	      SPECTRUM_MIN_SIZE);
+      exit(EXIT_FAILURE);
+    }
+    thread_spectrum = calloc(numthreads, sizeof(*thread_spectrum));
+    assert(thread_spectrum != NULL);
+    for (j=0;j<numthreads;j++)
+      assert(spectrum_init(&thread_spectrum[j], spectrum_len) == 0);
+  }
+
+#ifdef _WITH_PTHREADS_
+  /* the controlling thread, and the drain thread with it, get a CPU
+     of their own: by default the lowest one that is not measured */
+  if (use_threads == 1 || use_stream == 1 || use_preflight == 1) {
+    if (housekeeping < 0) {
+      housekeeping = cpu_housekeeping(cpus, numthreads);
+      if (housekeeping < 0)
+	fprintf(stderr,"WARNING: no spare CPU for housekeeping, "
+		"leaving the controller unpinned.\n");
+    } else {
+      for (j=0;j<numthreads;j++)
+	if (cpus[j] == (uint32_t)housekeeping) {
+	  fprintf(stderr,"ERROR: housekeeping CPU %d is also measured.\n",
+		  housekeeping);
+	  exit(EXIT_FAILURE);
+	}
+    }
+    if (use_threads == 1 && housekeeping >= 0 && cpu_pin(housekeeping) < 0) {
+      perror("sched_setaffinity");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  /* check the measured CPUs are set up for this before spending a long
+     run on them.  --preflight only reports, on stdout; a real run keeps
+     the report on stderr, out of the way of the samples (-s) */
+  if (use_preflight == 1) {
+    if (rt_preflight(stdout, cpus, numthreads, housekeeping, &rt_sched) > 0)
+      exit(EXIT_FAILURE);
+    exit(EXIT_SUCCESS);
+  }
+  if (use_threads == 1)
+    rt_preflight(stderr, cpus, numthreads, housekeeping, &rt_sched);
+#endif
+
   /* set up sampling.  first, take a few bogus samples to warm up the
      cache and pipeline */
   interval_length = 1 << interval_bits;  
 
-  if (use_threads == 1) {
+  /* intervals are measured in ticks; work out how long a tick is */
+  timer_calibrate(&timer);
+  timer_print(stdout, &timer);
+  if (!timer.invariant)
+    fprintf(stderr,"WARNING: the tick counter may not run at a constant "
+	    "rate; times are approximate.\n");
+
+  /* lock everything the process has and will map (stacks, sample
+     buffers, stream chunks) before any thread starts warming up */
+  if (use_mlockall == 1 && mlockall(MCL_CURRENT|MCL_FUTURE) < 0) {
+    perror("mlockall");
+    exit(EXIT_FAILURE);
+  }
+
+  ftq_bin_init(&hdr, FTQ_BIN_FTQ, numthreads, numsamples, 2);
+  hdr.bits = interval_bits;
+  hdr.quantum = interval_length;
+  hdr.ns_per_tick = timer.ns_per_tick;
+  hdr.tick_err_ppm = timer.err_ppm;
+  clock_pair(CLOCK_MONOTONIC, &hdr.clock_ticks[0], &hdr.clock_ns[0]);
+
 #ifdef _WITH_PTHREADS_
-    if (sched_setaffinity(0, sizeof(mask), &mask) < 0 ) {
-      perror("sched_setaffinity");
+  if (use_stream == 1) {
+    static const char *const suffixes[] = { "times", "counts" };
+
+    stream.numthreads = numthreads;
+    stream.sample_words = 2;
+    stream.side_words = 0;
+    stream.format = format;
+    stream.cpu = housekeeping;
+    stream.memflags = memflags;
+    stream.name_cpus = name_cpus;
+    stream.consume = spectrum_peaks_wanted > 0 ? ftq_consume : NULL;
+    stream.consume_arg = thread_spectrum;
+    if (stream_open(&stream, outname, suffixes, &hdr, cpus, NULL, NULL) < 0) {
+      perror("can not create stream output");
+      exit(EXIT_FAILURE);
+    }
+    if (stream_start(&stream)) {
+      fprintf(stderr,"ERROR: pthread_create() failed.\n");
+      exit(EXIT_FAILURE);
     }
+  }
+#endif
+
+  /* unpinned threads could be anywhere, so only pinned runs count
+     interrupts */
+  memset(&irq_before, 0, sizeof(irq_before));
+  memset(&irq_after, 0, sizeof(irq_after));
+  use_irqstat = cpus[0] != FTQ_CPU_NONE;
+
+  if (use_threads == 1) {
+#ifdef _WITH_PTHREADS_
+    /* this thread only controls: every measured CPU gets a worker of
+       its own, started and joined from the housekeeping CPU */
     threads = malloc(sizeof(pthread_t)*numthreads);
     assert(threads != NULL);
 
     printf("numthreads = %d\n", numthreads);
-    for (i=1;i<numthreads;i++) {
+    for (i=0;i<numthreads;i++) {
       printf("thread number %d being created.\n",i);
       rc = pthread_create(&threads[i], NULL, ftq_core, (void *)(intptr_t)i);
       if (rc) {
@@ -319,9 +706,15 @@ int main(int argc, char **argv) {
         exit(EXIT_FAILURE);
       }
     }
-    ftq_core(0);
 
-    for (i=1;i<numthreads;i++) {
+    /* interrupt counts from when every thread is about to sample */
+    while (__atomic_load_n(&sampling_threads, __ATOMIC_ACQUIRE) < numthreads)
+      nanosleep(&poll, NULL);
+    if (use_irqstat && irqstat_take(&irq_before, cpus, numthreads) < 0)
+      use_irqstat = 0;
+    clock_gettime(CLOCK_MONOTONIC, &irq_t0);
+
+    for (i=0;i<numthreads;i++) {
       rc = pthread_join(threads[i],NULL);
       if (rc) {
 	fprintf(stderr,"ERROR: pthread_join() failed.\n");
@@ -332,52 +725,95 @@ int main(int argc, char **argv) {
     free(threads);
 #endif /* _WITH_PTHREADS_ */
   } else {
+    if (use_irqstat && irqstat_take(&irq_before, cpus, numthreads) < 0)
+      use_irqstat = 0;
+    clock_gettime(CLOCK_MONOTONIC, &irq_t0);
     ftq_core(0);
   }
+  if (use_irqstat && irqstat_take(&irq_after, cpus, numthreads) < 0)
+    use_irqstat = 0;
+  clock_gettime(CLOCK_MONOTONIC, &irq_t1);
+
+  clock_pair(CLOCK_MONOTONIC, &hdr.clock_ticks[1], &hdr.clock_ns[1]);
 
-  if (use_stdout == 1) {
+  if (use_stream == 1) {
+#ifdef _WITH_PTHREADS_
+    if (stream_finish(&stream) < 0) {
+      perror("can not write samples");
+      exit(EXIT_FAILURE);
+    }
+#endif
+  } else if (format == FORMAT_BIN) {
+    sprintf(fname_times,"%s.bin",outname);
+    fp = open(fname_times, O_CREAT|O_TRUNC|O_WRONLY, 0644);
+    if(fp < 0) {
+      perror("can not create file");
+      exit(EXIT_FAILURE);
+    }
+    if (ftq_write_bin(fp, &hdr, cpus, NULL, NULL, samples, NULL) < 0) {
+      perror("can not write samples");
+      exit(EXIT_FAILURE);
+    }
+    close(fp);
+  } else if (use_stdout == 1) {
     for (i=0;i<numsamples;i++) {
-      fprintf(stdout,"%lld %lld\n",samples[i*2],samples[i*2 + 1]);
+      fprintf(stdout,"%lld %lld\n",samples[0][i*2],samples[0][i*2 + 1]);
     }
   } else {
 
-    for (j=0;j<numthreads;j++) {
-      sprintf(fname_times,"%s_%d_times.dat",outname,j);
-      sprintf(fname_counts,"%s_%d_counts.dat",outname,j);
+    struct text_job *jobs;
 
-#ifdef Plan9
-      fp = create(fname_times, OWRITE, 700);
-#else
-      fp = open(fname_times, O_CREAT|O_TRUNC|O_WRONLY, 0644);
-#endif 
-      if(fp < 0) {
-	perror("can not create file");
-	exit(EXIT_FAILURE);
-      }
-      for (i=0;i<numsamples;i++) {
-	sprintf(buf, "%lld\n", samples[(i*2)+(numsamples*j)]);
-	write(fp, buf, strlen(buf));
-      }
-      close(fp);
-      
-#ifdef Plan9
-      fp = create(fname_counts, OWRITE, 700);
-#else
-      fp = open(fname_counts, O_CREAT|O_TRUNC|O_WRONLY, 0644);
-#endif 
-      if(fp < 0) {
-	perror("can not create file");
-	exit(EXIT_FAILURE);
-      }
-      for (i=0;i<numsamples;i++) {
-	sprintf(buf, "%lld\n", samples[i*2 + 1 + (numsamples*j)]);
-	write(fp, buf, strlen(buf));
-      }
-      close(fp);
+    /* times and counts for each thread, formatted in parallel */
+    jobs = calloc(numthreads*2, sizeof(*jobs));
+    assert(jobs != NULL);
+    for (j=0;j<numthreads;j++) {
+      sample_fname(jobs[j*2].fname, sizeof(jobs[j*2].fname), outname, j,
+		   name_cpus, "times");
+      jobs[j*2].base = samples[j];
+      jobs[j*2].count = numsamples;
+      jobs[j*2].stride = 2;
+
+      sample_fname(jobs[j*2+1].fname, sizeof(jobs[j*2+1].fname), outname, j,
+		   name_cpus, "counts");
+      jobs[j*2+1].base = samples[j] + 1;
+      jobs[j*2+1].count = numsamples;
+      jobs[j*2+1].stride = 2;
     }
+    if (ftq_write_text(jobs, numthreads*2) < 0) {
+      perror("can not write samples");
+      exit(EXIT_FAILURE);
+    }
+    free(jobs);
   }
   
+  /* periodic interference in the work counts, one sample per interval.
+     streamed runs have already been analysed by the drain thread. */
+  if (spectrum_peaks_wanted > 0) {
+    sample_hz = 1e9 / ticks_to_ns(&timer, interval_length);
+    for (j=0;j<numthreads;j++) {
+      if (!use_stream)
+	spectrum_add(&thread_spectrum[j], samples[j] + 1, numsamples, 2);
+      sprintf(label,"thread %d",j);
+      spectrum_print(stdout, label, &thread_spectrum[j], sample_hz,
+		     spectrum_peaks_wanted);
+      spectrum_free(&thread_spectrum[j]);
+    }
+    free(thread_spectrum);
+  }
+
+  /* what interrupted the measured CPUs meanwhile */
+  if (use_irqstat)
+    irqstat_print(stdout, &irq_before, &irq_after,
+		  (irq_t1.tv_sec - irq_t0.tv_sec) +
+		  (irq_t1.tv_nsec - irq_t0.tv_nsec) / 1e9);
+  irqstat_free(&irq_before);
+  irqstat_free(&irq_after);
+
+  for (j=0;j<numthreads;j++)
+    sample_free(samples[j], sizeof(unsigned long long)*numsamples*2,
+		memflags);
   free(samples);
+  free(cpus);
   
 #ifdef _WITH_PTHREADS_
   pthread_exit(NULL);
@@ -0,0 +1,182 @@
+/**
+ * fwq-top.c : live view of a t_fwq run started with --telemetry.
+ *
+ * Attaches to the run's shared memory segment (see telemetry.h), the
+ * newest /dev/shm/fwq.* unless one is named, and redraws a table of
+ * every measuring thread's progress and noise once a second until the
+ * run ends.  Threads whose last second p99 is over their outlier limit
+ * are flagged.
+ *
+ * Licensed under the terms of the GNU Public Licence.  See LICENCE_GPL
+ * for details.
+ */
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "telemetry.h"
+
+#define DEFAULT_INTERVAL_MS  1000
+
+/**
+ * usage()
+ */
+static void usage(char *av0) {
+  fprintf(stderr,"usage: %s [-i interval_ms] [-1] [name]\n", av0);
+  exit(EXIT_FAILURE);
+}
+
+/**
+ * find_segment() : the newest fwq segment in /dev/shm, as a shm_open()
+ * name.  returns 0, or -1 if there is none.
+ */
+static int find_segment(char *name, size_t len) {
+  DIR *dir = opendir("/dev/shm");
+  struct dirent *d;
+  struct stat st;
+  char path[512];
+  time_t newest = 0;
+  int found = -1;
+
+  if (dir == NULL)
+    return -1;
+  while ((d = readdir(dir)) != NULL) {
+    if (strncmp(d->d_name, "fwq.", 4) != 0)
+      continue;
+    snprintf(path, sizeof(path), "/dev/shm/%s", d->d_name);
+    if (stat(path, &st) < 0 || (found == 0 && st.st_mtime < newest))
+      continue;
+    newest = st.st_mtime;
+    snprintf(name, len, "/%s", d->d_name);
+    found = 0;
+  }
+  closedir(dir);
+  return found;
+}
+
+/**
+ * main()
+ */
+int main(int argc, char **argv) {
+  char name[512] = "";
+  struct telem_header *hdr;
+  struct telem_thread *cur, *prev;
+  struct timespec interval;
+  struct stat st;
+  int interval_ms = DEFAULT_INTERVAL_MS, once = 0;
+  int c, fd, j, n, worst, flagged, first = 1;
+  double rate;
+
+  while ((c = getopt(argc, argv, "i:1h")) != -1) {
+    switch (c) {
+    case 'i':
+      interval_ms = atoi(optarg);
+      if (interval_ms <= 0)
+	usage(argv[0]);
+      break;
+    case '1':
+      once = 1;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind < argc)
+    snprintf(name, sizeof(name), "%s%s", argv[optind][0] == '/' ? "" : "/",
+	     argv[optind]);
+  else if (find_segment(name, sizeof(name)) < 0) {
+    fprintf(stderr,"ERROR: no fwq run with --telemetry found in /dev/shm.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    fprintf(stderr,"ERROR: can not open %s: %s\n", name, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (hdr == MAP_FAILED || (size_t)st.st_size < sizeof(*hdr) ||
+      memcmp(hdr->magic, TELEM_MAGIC, sizeof(hdr->magic)) != 0 ||
+      hdr->version != TELEM_VERSION ||
+      (size_t)st.st_size < sizeof(*hdr) +
+      sizeof(struct telem_thread) * hdr->numthreads) {
+    fprintf(stderr,"ERROR: %s is not an fwq telemetry segment.\n", name);
+    exit(EXIT_FAILURE);
+  }
+  n = hdr->numthreads;
+  cur = calloc(n, sizeof(*cur));
+  prev = calloc(n, sizeof(*prev));
+  if (cur == NULL || prev == NULL) {
+    fprintf(stderr,"ERROR: out of memory.\n");
+    exit(EXIT_FAILURE);
+  }
+  interval.tv_sec = interval_ms / 1000;
+  interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+
+  for (;;) {
+    /* a block left locked by a dead fwq keeps its last good copy;
+       the pid check below then ends the loop */
+    for (j = 0; j < n; j++)
+      if (telem_read(telem_thread(hdr, j), &cur[j]) < 0)
+	cur[j] = prev[j];
+
+    if (!once)
+      printf("\033[H\033[J");
+    printf("fwq pid %d (%s): %d threads x %llu samples, %s\n", hdr->pid,
+	   name, n, (unsigned long long)hdr->numsamples,
+	   hdr->state == TELEM_DONE ? "done" : "running");
+    printf("%6s %5s %7s %10s %10s %10s %10s %10s %10s %8s\n", "thread",
+	   "cpu", "done%", "samples/s", "min_us", "max_us", "p99_us",
+	   "limit_us", "outliers", "lost");
+    worst = 0;
+    flagged = 0;
+    for (j = 0; j < n; j++) {
+      rate = 0.0;
+      if (!first && cur[j].updated_ns > prev[j].updated_ns)
+	rate = (cur[j].done - prev[j].done) * 1e9 /
+	  (cur[j].updated_ns - prev[j].updated_ns);
+      if (cur[j].p99_ns > cur[worst].p99_ns)
+	worst = j;
+      flagged += cur[j].p99_ns > cur[j].limit_ns;
+      printf("%6d %5u %7.1f %10.0f %10.1f %10.1f %10.1f %10.1f %10llu %8llu"
+	     "%s\n", j, cur[j].cpu,
+	     hdr->numsamples ? 100.0 * cur[j].done / hdr->numsamples : 0.0,
+	     rate, cur[j].min_ns / 1e3, cur[j].max_ns / 1e3,
+	     cur[j].p99_ns / 1e3, cur[j].limit_ns / 1e3,
+	     (unsigned long long)cur[j].outliers,
+	     (unsigned long long)cur[j].lost,
+	     cur[j].p99_ns > cur[j].limit_ns ? " *" : "");
+    }
+    printf("# worst p99: thread %d cpu %u, %.1f us; %d threads with p99 "
+	   "over their limit (*)\n", worst, cur[worst].cpu,
+	   cur[worst].p99_ns / 1e3, flagged);
+    fflush(stdout);
+
+    if (once || __atomic_load_n(&hdr->state, __ATOMIC_ACQUIRE) == TELEM_DONE)
+      break;
+    /* killed runs never get to remove their segment */
+    if (kill(hdr->pid, 0) < 0 && errno == ESRCH) {
+      fprintf(stderr,"fwq pid %d exited without finishing; removing %s.\n",
+	      hdr->pid, name);
+      shm_unlink(name);
+      exit(EXIT_FAILURE);
+    }
+    memcpy(prev, cur, sizeof(*cur) * n);
+    first = 0;
+    nanosleep(&interval, NULL);
+  }
+
+  munmap(hdr, st.st_size);
+  free(cur);
+  free(prev);
+  exit(EXIT_SUCCESS);
+}
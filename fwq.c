@@ -18,12 +18,28 @@
  */
 #define _GNU_SOURCE
 #include "ftq.h"
+#include "output.h"
+#include "mem.h"
+#include "timer.h"
+#include "irqstat.h"
+#include "stats.h"
+#include "events.h"
+#include "kernels.h"
+#include "pmc.h"
+#include "trace.h"
+#include <errno.h>
+#include <sys/mman.h>
 
 /* affinity */
 #ifdef _WITH_PTHREADS_
 #include <sys/syscall.h>
 #include <sys/types.h>
 #include <sched.h>
+#include "cpus.h"
+#include "rt.h"
+#include "stream.h"
+#include "telemetry.h"
+#include "metrics.h"
 #endif
 
 /**
@@ -37,316 +53,829 @@
 #define DEFAULT_BITS   20
 #define MAX_BITS       30
 #define MIN_BITS       3
-#define MULTIITER
-#define ITERCOUNT      32
-#define VECLEN         1024
+#define WARMUP_COUNT   1000
+/* ticks between the last thread reaching the start barrier and the
+   start of sampling, enough for every spinner to see the start tick */
+#define BARRIER_LEAD   100000
+/* --target-us calibration: samples per timing, and the shortest sample
+   that is timed rather than extrapolated from */
+#define CAL_REPS       5
+#define CAL_MIN_NS     20000
+/* back to back reads per timer in --timer-test */
+#define TIMER_TEST_COUNT  1000000
+/* --daemon: percentage of the time the measured CPUs are busy */
+#define DEFAULT_DUTY   1.0
+
+/* long options without a short form */
+enum {
+  OPT_STREAM = 256,
+  OPT_HOUSEKEEPING,
+  OPT_HUGEPAGES,
+  OPT_MLOCK,
+  OPT_MLOCKALL,
+  OPT_TIMESTAMPS,
+  OPT_EVENTS,
+  OPT_EVENT_THRESHOLD,
+  OPT_KERNEL,
+  OPT_WSS,
+  OPT_TARGET_US,
+  OPT_TIMER,
+  OPT_TIMER_TEST,
+  OPT_CPUS,
+  OPT_PLACEMENT,
+  OPT_SCHED,
+  OPT_PRIORITY,
+  OPT_DEADLINE,
+  OPT_PREFLIGHT,
+  OPT_COUNTERS,
+  OPT_TRACE_MARKER,
+  OPT_TRACE_REPORT,
+  OPT_TELEMETRY,
+  OPT_DAEMON,
+  OPT_DUTY,
+  OPT_BURSTS,
+};
 
 /**
  * global variables
  */
 
-/* samples: each sample has a timestamp and a work count. */
-static unsigned long long *samples;
+/* samples: one buffer of numsamples elapsed tick counts per thread,
+   allocated by the thread itself. */
+static unsigned long long **samples;
 static long long work_length;
 static int work_bits = DEFAULT_BITS;
 static unsigned long numsamples = DEFAULT_COUNT;
+static int numthreads = 1;
+static int memflags = 0;
+/* the CPU each thread measures (FTQ_CPU_NONE when unpinned), and the
+   same array when --cpus or --placement put the CPUs in file names */
+static uint32_t *cpus;
+static const uint32_t *name_cpus;
+/* working set of the memory kernels */
+static size_t wss = DEFAULT_WSS;
+
+/* start barrier, see start_barrier() */
+static int barrier_arrived = 0;
+static ticks barrier_start = 0;
+/* tick at which each thread took its first real sample */
+static unsigned long long *start_ticks;
+
+/* --target-us: sample duration each thread calibrates its work quantum
+   to, and the quantum (iterations) each thread ended up using */
+static unsigned long long target_ns = 0;
+static unsigned long long *quanta;
+
+/* tick counter calibration, for reporting in ns */
+static struct timer_cal timer;
+/* --timer: how samples are timed, index into timers[] */
+static int timer_id;
+
+/* per-thread summary statistics */
+static struct stats *thread_stats;
+
+/* --events: per-thread noise event detection, baselined on the fastest
+   warm-up sample.  the threshold is given in ns and used in ticks */
+static int use_events = 0;
+static double event_threshold_ns = 0;
+static unsigned long long event_threshold = 0;
+static struct events *thread_events;
+
+/* per-thread side words, side_words of them per sample: the gap before
+   each sample with --timestamps (see output.h), then with --counters
+   the counter deltas (see pmc.h) */
+static int use_timestamps = 0;
+static int use_counters = 0;
+static int side_words = 0;
+static uint32_t **sides;
+
+/* --counters: per-thread counter summary, and the counters each thread
+   could open and read with rdpmc */
+static struct pmc_stats *thread_pmc;
+static unsigned int *pmc_mask, *pmc_fast;
+
+/* --trace-marker: slow samples are queued for the trace helper, which
+   marks them in the ftrace buffer (see trace.h) */
+static int use_trace = 0;
+static struct trace trace;
+
+/* streaming mode: samples go through per-thread rings to disk */
+static int use_stream = 0;
+/* --telemetry: live progress for fwq-top, see telemetry.h */
+static int use_telemetry = 0;
+/* --daemon: bursts of samples, duty percent of the time, folded into
+   the metrics served on daemon_addr; daemon_bursts of them, or forever
+   if 0 */
+static int use_daemon = 0;
+#ifdef _WITH_PTHREADS_
+static struct stream stream;
+static struct telemetry telemetry;
+static const char *daemon_addr;
+static double duty = DEFAULT_DUTY;
+static unsigned long daemon_bursts = 0;
+static struct metrics metrics;
+/* daemon workers stay set up between bursts and take one each time
+   burst_gen goes up; burst_left counts those not done with it yet, see
+   burst_next() */
+static pthread_mutex_t burst_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t burst_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long burst_gen = 0;
+static int burst_left = 0;
+/* tick at which each thread finished its last burst */
+static unsigned long long *end_ticks;
+/* --sched: scheduling policy of the measuring threads */
+static struct rt_sched rt_sched = {
+  SCHED_OTHER, RT_DEFAULT_PRIO, RT_DEFAULT_RUNTIME, RT_DEFAULT_PERIOD
+};
+#endif
 
 /**
  * usage()
  */
 void usage(char *av0) {
 #ifdef _WITH_PTHREADS_
-  fprintf(stderr,"usage: %s [-t threads] [-n samples] [-w bits] [-h] [-o outname] [-s]\n",
+  fprintf(stderr,"usage: %s [-t threads] [-n samples] [-w bits] [-h] [-o outname] [-s]\n"
+	  "       [--format=text|bin] [--stream] [--housekeeping=cpu]\n"
+	  "       [--hugepages] [--mlock] [--mlockall] [--timestamps]\n"
+	  "       [--events] [--event-threshold=ns]\n"
+	  "       [--kernel=name[,name...]|list] [--wss=bytes[K|M|G]]\n"
+	  "       [--target-us=us] [--timer=name|list] [--timer-test]\n"
+	  "       [--cpus=list] [--placement=core|smt|l3|node]\n"
+	  "       [--sched=other|fifo|rr|deadline] [--priority=prio]\n"
+	  "       [--deadline=runtime_us,period_us] [--preflight]\n"
+	  "       [--counters] [--trace-marker] [--trace-report=trace]\n"
+	  "       [--telemetry[=name]] [--daemon=[addr:]port]\n"
+	  "       [--duty=percent] [--bursts=count]\n",
 	  av0);
 #else
-  fprintf(stderr,"usage: %s [-n samples] [-w bits] [-h] [-o outname] [-s]\n",
+  fprintf(stderr,"usage: %s [-n samples] [-w bits] [-h] [-o outname] [-s]\n"
+	  "       [--format=text|bin] [--hugepages] [--mlock]\n"
+	  "       [--mlockall] [--timestamps] [--events]\n"
+	  "       [--event-threshold=ns] [--kernel=name[,name...]|list]\n"
+	  "       [--wss=bytes[K|M|G]] [--target-us=us]\n"
+	  "       [--timer=name|list] [--timer-test] [--counters]\n"
+	  "       [--trace-report=trace]\n",
 	  av0);
 #endif
   exit(EXIT_FAILURE);
 }
 
+/**
+ * parse_size() : a byte count with an optional K, M or G (binary)
+ * suffix.  returns 0 if str is not one.
+ */
+static size_t parse_size(const char *str) {
+  char *end;
+  size_t n = strtoull(str, &end, 0);
+
+  switch (*end) {
+  case 'G': case 'g':
+    n <<= 10;
+    /* fall through */
+  case 'M': case 'm':
+    n <<= 10;
+    /* fall through */
+  case 'K': case 'k':
+    n <<= 10;
+    end++;
+  }
+  return *end == '\0' ? n : 0;
+}
+
+/**
+ * start_barrier() : called by every thread once it is pinned, has its
+ * buffers and is warmed up.  the last thread to arrive picks a start
+ * tick BARRIER_LEAD ticks ahead and everybody spins until the clock
+ * reaches it, so that all threads begin sampling on the same edge
+ * instead of staggered by thread creation.  the clock is the selected
+ * timer, the same one start_ticks[] is read with.  returns the tick
+ * actually seen when leaving the barrier.
+ */
+static ticks start_barrier(void) {
+  ticks start, now;
+
+  if (__sync_add_and_fetch(&barrier_arrived, 1) == numthreads)
+    __atomic_store_n(&barrier_start,
+		     timers[timer_id].read() + BARRIER_LEAD, __ATOMIC_RELEASE);
+
+  while ((start = __atomic_load_n(&barrier_start, __ATOMIC_ACQUIRE)) == 0)
+    ;
+  while ((now = timers[timer_id].read()) < start)
+    ;
+  return now;
+}
+
+/*
+ * where a thread's samples go, see fwq_run().  buf holds cap samples
+ * and gbuf, when not NULL, side_words side words for each of them: the
+ * gap before it if gaps is set, then the deltas of pmc if that is not
+ * NULL.  samples over limit count as slow for pmc_sample(), and are
+ * queued on trace when that is not NULL; index numbers the samples for
+ * it and for progress, where the count taken so far is published for
+ * --telemetry.  in streaming mode buf and gbuf are the chunks being
+ * filled in ring.
+ */
+struct run {
+  struct work work;
+  unsigned long long *buf;
+  uint32_t *gbuf;
+  unsigned long pos, cap;
+  ticks prev;
+  int gaps;
+  struct pmc *pmc;
+  unsigned long long limit;
+  struct trace_ring *trace;
+  unsigned long long index;
+#ifdef _WITH_PTHREADS_
+  struct stream_ring *ring;
+  struct telem_progress *progress;
+#endif
+};
+
+/**
+ * fwq_run() : take n samples of work into r.  always inlined, and only
+ * ever called with a constant kernel and timer, so every combination
+ * gets its own copy of the loop with the work in line between the
+ * timer reads.
+ */
+static inline __attribute__((always_inline))
+void fwq_run(struct run *r, unsigned long n, void (*work)(struct work *),
+	     ticks (*start)(void), ticks (*stop)(void)) {
+  register unsigned long done;
+  unsigned long long *buf = r->buf;
+  uint32_t *gbuf = r->gbuf, *side;
+  struct trace_ring *trace = r->trace;
+#ifdef _WITH_PTHREADS_
+  struct telem_progress *progress = r->progress;
+#endif
+  unsigned long pos = r->pos, cap = r->cap;
+  ticks tick, tock, prev = r->prev;
+
+  for (done = 0; done < n; done++) {
+    tick = start();
+    work(&r->work);
+    tock = stop();
+    buf[pos] = tock-tick;
+    if (gbuf != NULL) {
+      side = gbuf + pos * side_words;
+      if (r->gaps) {
+	/* untimed gap since the previous sample ended */
+	*side++ = tick-prev > UINT32_MAX ? UINT32_MAX : tick-prev;
+	prev = tock;
+      }
+      /* counters are read after the timed region, never inside it */
+      if (r->pmc != NULL)
+	pmc_sample(r->pmc, side, tock-tick > r->limit);
+    }
+    if (trace != NULL && tock-tick > r->limit)
+      trace_spike(trace, r->index + done, tick, tock-tick);
+#ifdef _WITH_PTHREADS_
+    if (progress != NULL)
+      telemetry_progress(progress, r->index + done + 1);
+#endif
+    if (++pos == cap) {
+#ifdef _WITH_PTHREADS_
+      if (r->ring != NULL) {
+	buf = stream_hand_off(r->ring, pos);
+	gbuf = r->ring->side[r->ring->cur];
+      }
+#endif
+      pos = 0;
+    }
+  }
+
+  r->buf = buf;
+  r->gbuf = gbuf;
+  r->pos = pos;
+  r->prev = prev;
+  r->index += n;
+}
+
+/* the kernel table: one instance of fwq_run() per kernel and timer */
+struct kernel {
+  const char *name;
+  const char *desc;
+  int (*supported)(void);
+  int (*setup)(struct work *w);
+  void (*teardown)(struct work *w);
+  void (*run[NUM_TIMERS])(struct run *r, unsigned long n);
+};
+
+#define Y(kname, target, tname, start, stop, unit_ns, desc)		\
+  static target void run_##kname##_##tname(struct run *r,		\
+					   unsigned long n) {		\
+    fwq_run(r, n, kernel_##kname, start, stop);				\
+  }
+#define X(name, target, supported, setup, teardown, desc)  \
+  TIMERS(Y, name, target)
+FWQ_KERNELS(X)
+#undef X
+#undef Y
+
+static const struct kernel kernels[] = {
+#define Y(kname, target, tname, start, stop, unit_ns, desc)  \
+  run_##kname##_##tname,
+#define X(name, target, supported, setup, teardown, desc)  \
+  { #name, desc, supported, setup, teardown, { TIMERS(Y, name, ) } },
+  FWQ_KERNELS(X)
+#undef X
+#undef Y
+};
+
+#define NUM_KERNELS  ((int)(sizeof(kernels) / sizeof(kernels[0])))
+
+/* --kernel: the kernels threads run, assigned round robin */
+static const struct kernel **kernel_list;
+static int num_kernel_list;
+
+static int kernel_supported(const struct kernel *k) {
+  return k->supported == NULL || k->supported();
+}
+
+/**
+ * find_kernel() : the kernel called name.  "default" is the build's
+ * default and "simd" the widest vector kernel this CPU supports.
+ * returns NULL if there is no such kernel.
+ */
+static const struct kernel *find_kernel(const char *name) {
+  static const char *const simd[] = { SIMD_KERNELS NULL };
+  int i;
+
+  if (strcmp(name, "default") == 0)
+    name = DEFAULT_KERNEL;
+  if (strcmp(name, "simd") == 0) {
+    for (i = 0; simd[i] != NULL; i++)
+      if (kernel_supported(find_kernel(simd[i])))
+	return find_kernel(simd[i]);
+    return NULL;
+  }
+  for (i = 0; i < NUM_KERNELS; i++)
+    if (strcmp(name, kernels[i].name) == 0)
+      return &kernels[i];
+  return NULL;
+}
+
+/**
+ * list_kernels() : one line per available kernel.
+ */
+static void list_kernels(FILE *fp) {
+  int i;
+
+  fprintf(fp, "kernels (default %s; simd is the widest supported "
+	  "vector kernel):\n", DEFAULT_KERNEL);
+  for (i = 0; i < NUM_KERNELS; i++)
+    fprintf(fp, "  %-10s %s%s\n", kernels[i].name, kernels[i].desc,
+	    kernel_supported(&kernels[i]) ? "" : " (not supported here)");
+}
+
+/**
+ * parse_kernels() : set kernel_list from a comma separated list of
+ * kernel names.  exits on an unknown or unsupported kernel.
+ */
+static void parse_kernels(const char *list) {
+  char *names, *name, *save;
+  int n = 1;
+
+  for (name = (char *)list; *name; name++)
+    n += *name == ',';
+  free(kernel_list);
+  kernel_list = malloc(sizeof(*kernel_list)*n);
+  assert(kernel_list != NULL);
+  names = strdup(list);
+  assert(names != NULL);
+
+  num_kernel_list = 0;
+  for (name = strtok_r(names, ",", &save); name != NULL;
+       name = strtok_r(NULL, ",", &save)) {
+    const struct kernel *k = find_kernel(name);
+
+    if (k == NULL) {
+      fprintf(stderr,"ERROR: unknown kernel '%s'.\n", name);
+      list_kernels(stderr);
+      exit(EXIT_FAILURE);
+    }
+    if (!kernel_supported(k)) {
+      fprintf(stderr,"ERROR: kernel '%s' is not supported on this CPU.\n",
+	      name);
+      exit(EXIT_FAILURE);
+    }
+    kernel_list[num_kernel_list++] = k;
+  }
+  free(names);
+  if (num_kernel_list == 0) {
+    fprintf(stderr,"ERROR: no kernel in '%s'.\n", list);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* fastest of CAL_REPS samples of iters iterations, in ns */
+static unsigned long long time_kernel(const struct kernel *kernel,
+				      struct run *r, long long iters) {
+  struct timespec t0, t1;
+  unsigned long long ns, best = ~0ULL;
+  int i;
+
+  r->work.wl = -iters;
+  for (i = 0; i < CAL_REPS; i++) {
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    kernel->run[timer_id](r, 1);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ns = (t1.tv_sec - t0.tv_sec) * 1000000000ULL + t1.tv_nsec - t0.tv_nsec;
+    if (ns < best)
+      best = ns;
+  }
+  r->pos = 0;
+  return best ? best : 1;
+}
+
+/**
+ * calibrate() : the number of kernel iterations that makes one sample
+ * take target_ns.  the iteration count doubles until a sample is long
+ * enough to time well, is scaled to the target, and is then timed and
+ * scaled once more to take out the fixed cost of a sample.  returns 0
+ * for a kernel whose time does not grow with the count (empty).
+ */
+static long long calibrate(const struct kernel *kernel, struct run *r) {
+  unsigned long long floor = target_ns / 8, best;
+  long long iters = 1;
+  int pass;
+
+  if (floor < CAL_MIN_NS)
+    floor = CAL_MIN_NS;
+  while ((best = time_kernel(kernel, r, iters)) < floor && iters < (1LL << 40))
+    iters *= 2;
+  if (best < floor)
+    return 0;
+  for (pass = 0; pass < 2; pass++) {
+    iters = (long long)((double)iters * target_ns / best + 0.5);
+    if (iters < 1)
+      iters = 1;
+    if (pass == 0)
+      best = time_kernel(kernel, r, iters);
+  }
+  return iters;
+}
+
+#ifdef _WITH_PTHREADS_
+/*
+ * daemon worker side: report the previous burst (or the set up) done,
+ * then wait for the controller to start the next one.  gen is the
+ * burst the caller last took.
+ */
+static void burst_next(unsigned long *gen) {
+  pthread_mutex_lock(&burst_lock);
+  if (--burst_left == 0)
+    pthread_cond_broadcast(&burst_cond);
+  while (burst_gen == *gen)
+    pthread_cond_wait(&burst_cond, &burst_lock);
+  *gen = burst_gen;
+  pthread_mutex_unlock(&burst_lock);
+}
+#endif
+
 /*************************************************************************
  * FWQ core: does the measurement                                        *
  *************************************************************************/
 void *fwq_core(void *arg) {
   /* thread number, zero based. */
   int thread_num = (int)(intptr_t)arg;
-  int i=0,offset;
-
-  ticks tick, tock;
-  register unsigned long done;
-  register long long count;
-  register long long wl = -work_length;
-#ifdef DAXPY
-  double da, dx[VECLEN], dy[VECLEN];
-  void daxpy();
+  const struct kernel *kernel = kernel_list[thread_num % num_kernel_list];
+  struct run r;
+  struct pmc pmc;
+  uint32_t *gbuf;
+  unsigned long done;
+  unsigned long long best;
+#ifdef _WITH_PTHREADS_
+  unsigned long gen = 0;
 #endif
 
-  printf("Starting FWQ_CORE with work_length = %lld, wl = %lld, count = %lld\n",
-    work_length, wl, count);
-#ifdef DAXPY
-  /* Intialize FP work */
-  da = 1.0e-6;
-  for( i=0; i<VECLEN; i++ ) {
-    dx[i] = 0.3141592654;
-    dy[i] = 0.271828182845904523536;
-  }
-#endif
+  memset(&r, 0, sizeof(r));
+  r.work.wl = -work_length;
+  r.work.memflags = memflags;
+  r.work.wss = wss;
+
+  if (!use_daemon)
+    printf("Starting FWQ_CORE %d with kernel = %s, work_length = %lld\n",
+	   thread_num, kernel->name, work_length);
 
 #ifdef _WITH_PTHREADS_
   /* affinity stuff */
-  cpu_set_t *set;
-  int ret;
-  size_t size;
-  int numthreads = thread_num + 1;
-
-  set = CPU_ALLOC(numthreads);
-  size = CPU_ALLOC_SIZE(numthreads);
-  CPU_ZERO_S(size, set);
-  CPU_SET_S(thread_num, size, set);
-  ret = sched_setaffinity(0, size, set);
-  if (ret < 0) {
-    fprintf(stderr, "failed to set CPU affinity: pid %d, thread: %d, %m\n",
-	    getpid(), thread_num);
+  if (cpu_pin(cpus[thread_num]) < 0) {
+    fprintf(stderr, "failed to set CPU affinity: pid %d, thread: %d, "
+	    "cpu: %u, %m\n", getpid(), thread_num, cpus[thread_num]);
+    exit(1);
+  }
+  if (rt_apply(&rt_sched) < 0) {
+    fprintf(stderr, "failed to set %s scheduling: thread: %d, %m\n",
+	    rt_name(rt_sched.policy), thread_num);
     exit(1);
   }
 #endif
 
-  offset = thread_num * numsamples;
+  if (kernel->setup != NULL && kernel->setup(&r.work) < 0) {
+    fprintf(stderr, "failed to set up kernel %s: thread: %d, %m\n",
+	    kernel->name, thread_num);
+    exit(1);
+  }
+
+  /* counters on this thread, now that it is on its CPU */
+  if (use_counters) {
+    if (pmc_open(&pmc) == 0)
+      fprintf(stderr, "WARNING: no performance counters available: "
+	      "thread: %d, %m\n", thread_num);
+    pmc_mask[thread_num] = pmc.mask;
+    pmc_fast[thread_num] = pmc.fast;
+  }
+
+  /* where the samples go: straight into this thread's own buffer, or
+     a chunk at a time through the stream ring.  either way the memory
+     is allocated and faulted in here, now that we are on our CPU. */
+#ifdef _WITH_PTHREADS_
+  if (use_stream) {
+    if (stream_ring_init(&stream, thread_num) < 0) {
+      fprintf(stderr, "failed to allocate samples: thread: %d, %m\n",
+	      thread_num);
+      exit(1);
+    }
+    r.ring = &stream.rings[thread_num];
+    r.buf = r.ring->chunk[r.ring->cur];
+    r.gbuf = r.ring->side[r.ring->cur];
+    r.cap = STREAM_CHUNK_WORDS;
+  } else
+#endif
+  {
+    r.buf = sample_alloc(sizeof(unsigned long long)*numsamples, memflags);
+    if (side_words)
+      r.gbuf = sample_alloc(sizeof(uint32_t)*numsamples*side_words,
+			    memflags);
+    if (r.buf == NULL || (side_words && r.gbuf == NULL)) {
+      fprintf(stderr, "failed to allocate samples: thread: %d, %m\n",
+	      thread_num);
+      exit(1);
+    }
+    samples[thread_num] = r.buf;
+    if (side_words)
+      sides[thread_num] = r.gbuf;
+    r.cap = numsamples;
+  }
 
   /***************************************************/
   /* first, warm things up with 1000 test iterations */
   /***************************************************/
-  for(done=0; done<1000; done++ ) {
-
-#ifdef __x86_64__
-    /* Core work construct written as loop in gas (GNU Assembler) for
-       x86-64 in 64b mode with 16 NOPs in the loop. If your running in
-       on x86 compatible hardware in 32b mode change "incq" to "incl"
-       and "cmpq" to "cmpl".  You can also add/remove "nop"
-       instructions to minimize instruction cache turbulence and/or
-       increase/decrease the work for each pass of the loop. Verify by
-       inspecting the compiler generated assembly code listing.
-     */
-    count = wl;
-    tick = getticks();
-      __asm__ __volatile__(
-			   "myL1:\tincq %0\n\t"
-			   "nop\n\t"
-			   "nop\n\t"
-			   "nop\n\t"
-			   "nop\n\t"
-			   "nop\n\t"
-			   "nop\n\t"
-			   "nop\n\t"
-			   "nop\n\t"
-			   "nop\n\t"
-			   "nop\n\t"
-			   "nop\n\t"
-			   "nop\n\t"
-			   "nop\n\t"
-			   "nop\n\t"
-			   "nop\n\t"
-			   "nop\n\t"
-/* Group of 16 NOPs */
-			   "cmpq $0, %1\n\t"
-			   "js myL1"
-			   : "=r"(count)          /* output */
-			   : "0"(count),"r"(count) /* input */
-			   );
-#elif DAXPY
-      /* Work construct based on a function call and a vector update
-	 operation. VECLEN should be chosen so that this work
-	 construct fits into L1 cache (for all hardware threads
-	 sharing a core) and have minimal hardware induced runtime
-	 variation.
-      */
-      count = wl;
-      tick = getticks();
-      for(count = wl; count<0; count++) {
-	daxpy( VECLEN, da, dx, 1, dy, 1 );
-      }
-#elif defined(__aarch64__)
-    /* Core work loop in gas */
-    count = wl;
-    tick = getticks();
-    __asm__ __volatile__(
-        "myL1:\n\t"
-        "add %0, %0, #1\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "cmp %1, #0\n\t"
-        "b.ne myL1"
-        : "=r"(count)          /* output */
-        : "0"(count), "r"(count)  /* input */
-        : "cc", "memory"       /* clobbered registers */
-    );
-#else
-    /* This is the default work construct. Be very careful with this
-      as it is most important that "count" variable be in a register
-      and the loop not get optimized away by over zealous compiler
-      optimizers.  If "count" not in a register you will get alot of
-      variations in runtime due to memory latency.  If the loop is
-      optimized away, then the sample runtime will be very short and
-      not change even if the work length is increased.  For example,
-      with gcc v4.3 -g optimization puts "count" in a memory
-      location. -O1 and above optimization levels removes the "count"
-      loop entirely.  This is why we wrote the assembly code
-      above. The only way to verify what is actually happening is to
-      carefully review the compiler generated assembly language.
-      */
-      count = wl;
-      tick = getticks();
-      for( count=wl; count<0; ) {
-#ifdef MULTIITER
-	register int k;
-	for (k=0;k<ITERCOUNT;k++)
-	  count++;
-	for (k=0;k<(ITERCOUNT-1);k++)
-	  count--;
+  /* same loop as the real sampling, into the start of the buffer (at
+     least WARMUP_COUNT long in every mode), without gaps or hand offs.
+     with --target-us the quantum is calibrated first, the same way. */
+  gbuf = r.gbuf;
+  r.gbuf = NULL;
+#ifdef _WITH_PTHREADS_
+  {
+    struct stream_ring *ring = r.ring;
+
+    r.ring = NULL;
+    if (target_ns)
+      r.work.wl = -calibrate(kernel, &r);
+    kernel->run[timer_id](&r, WARMUP_COUNT);
+    r.ring = ring;
+  }
 #else
-	count++;
-#endif /* MULTIPLIER */
-      }
-#endif /* ASMx8664 or DAXPY or default */
-      tock = getticks();
-      samples[offset+done] = tock-tick;
+  if (target_ns)
+    r.work.wl = -calibrate(kernel, &r);
+  kernel->run[timer_id](&r, WARMUP_COUNT);
+#endif
+  r.gbuf = gbuf;
+  quanta[thread_num] = -r.work.wl;
+  r.pos = 0;
+
+  /* the fastest warm-up sample is the noise free baseline, for events
+     and for what counts as a slow sample when reading counters */
+  best = r.buf[0];
+  for (done=1; done<WARMUP_COUNT; done++)
+    if (r.buf[done] < best)
+      best = r.buf[done];
+  if (use_events) {
+    events_set_baseline(&thread_events[thread_num], best, event_threshold);
+    r.limit = thread_events[thread_num].limit;
+  } else {
+    struct events ev;
+
+    events_set_baseline(&ev, best, event_threshold);
+    r.limit = ev.limit;
+  }
+  r.gaps = use_timestamps;
+  if (use_counters) {
+    thread_pmc[thread_num].limit = r.limit;
+    if (pmc.mask)
+      r.pmc = &pmc;
   }
+  if (use_trace)
+    r.trace = &trace.rings[thread_num];
+#ifdef _WITH_PTHREADS_
+  if (use_telemetry) {
+    telemetry.progress[thread_num].limit = r.limit;
+    r.progress = &telemetry.progress[thread_num];
+  }
+#endif
+  r.index = 0;
 
   /****************************/
   /* now do the real sampling */
   /****************************/
-
-  for(done=0; done<numsamples; done++ ) {
-
-#ifdef __x86_64__
-    /* Core work loop in gas */
-    count = wl;
-    tick = getticks();
-      __asm__ __volatile__("myL2:\tincq %0\n\t"
-			   "nop\n\t"
-			   "nop\n\t"
-			   "nop\n\t"
-			   "nop\n\t"
-			   "nop\n\t"
-			   "nop\n\t"
-			   "nop\n\t"
-			   "nop\n\t"
-			   "nop\n\t"
-			   "nop\n\t"
-			   "nop\n\t"
-			   "nop\n\t"
-			   "nop\n\t"
-			   "nop\n\t"
-			   "nop\n\t"
-			   "nop\n\t"
-/* Group of 16 NOPs */
-			   "cmpq $0, %1\n\t"
-			   "js myL2"
-			   : "=r"(count)          /* output */
-			   : "0"(count),"r"(count) /* input */
-			   );
-#elif DAXPY
-      /* Core work as function all and 64b FP vector update loop */
-      count = wl;
-      tick = getticks();
-      for(count = wl; count<0; count++) {
-	daxpy( VECLEN, da, dx, 1, dy, 1 );
-      }
-#elif defined(__aarch64__)
-    /* Core work loop in gas */
-    count = wl;
-    tick = getticks();
-    __asm__ __volatile__(
-        "myL2:\n\t"
-        "add %0, %0, #1\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "cmp %1, #0\n\t"
-        "b.ne myL2"
-        : "=r"(count)          /* output */
-        : "0"(count), "r"(count)  /* input */
-        : "cc", "memory"       /* clobbered registers */
-    );
-#else
-      /* Default core work loop */
-      count = wl;
-      tick = getticks();
-      for( count=wl; count<0; ) {
-#ifdef MULTIITER
-	register int k;
-	for (k=0;k<ITERCOUNT;k++)
-	  count++;
-	for (k=0;k<(ITERCOUNT-1);k++)
-	  count--;
-#else
-	count++;
-#endif /* MULTIITER */
-      }
-#endif /* ASMx86 or DAXPY or default */
-      tock = getticks();
-      samples[offset+done] = tock-tick;
+  for (;;) {
+#ifdef _WITH_PTHREADS_
+    /* the daemon's workers keep everything above and take a burst into
+       the same buffer whenever fwq_daemon() says so */
+    if (use_daemon)
+      burst_next(&gen);
+#endif
+    start_barrier();
+    if (r.pmc != NULL)
+      pmc_prime(r.pmc);
+    r.prev = start_ticks[thread_num] = timers[timer_id].read();
+    kernel->run[timer_id](&r, numsamples);
+    if (!use_daemon)
+      break;
+#ifdef _WITH_PTHREADS_
+    end_ticks[thread_num] = timers[timer_id].read();
+#endif
   }
 
+#ifdef _WITH_PTHREADS_
+  if (r.ring != NULL)
+    stream_done(r.ring, r.pos);
+#endif
+
+  if (kernel->teardown != NULL)
+    kernel->teardown(&r.work);
+  if (use_counters)
+    pmc_close(&pmc);
+
   return NULL;
 }
-void daxpy( int n, double da, double *dx, int incx, double *dy, int incy )
-{
-  register int k;
-  for( k=0; k<n; k++ ) {
-    dx[k] += da*dy[k];
+
+#ifdef _WITH_PTHREADS_
+/*
+ * streaming mode: runs on the drain thread for every chunk written, so
+ * the summary is built as the run goes.
+ */
+static void fwq_consume(int thread, const unsigned long long *v,
+			const uint32_t *side, unsigned long words,
+			void *arg) {
+  stats_add(&thread_stats[thread], v, words, 1);
+  if (use_events)
+    events_add(&thread_events[thread], v, words, 1);
+  if (use_counters)
+    pmc_stats_add(&thread_pmc[thread], v, side + use_timestamps, words,
+		  side_words);
+}
+#endif
+
+#ifdef _WITH_PTHREADS_
+/**
+ * fwq_daemon() : --daemon.  start one worker per measured CPU, which
+ * sets up once, then take a burst of numsamples on every CPU, fold it
+ * into the metrics, and sleep long enough that the bursts take duty
+ * percent of the time.  the metrics server runs on the housekeeping CPU
+ * throughout.  does not return.
+ */
+static void fwq_daemon(int housekeeping, double scale) {
+  pthread_t *threads;
+  struct timespec t0, t1, pause;
+  unsigned long long first, last, base, limit;
+  double busy, spent, wall;
+  unsigned long burst;
+  int j;
+
+  if (metrics_init(&metrics, cpus, numthreads) < 0) {
+    perror("can not allocate metrics");
+    exit(EXIT_FAILURE);
+  }
+  metrics.cpu = housekeeping;
+  if (metrics_listen(&metrics, daemon_addr) < 0) {
+    fprintf(stderr,"ERROR: can not listen on '%s': %s\n", daemon_addr,
+	    strerror(errno));
+    exit(EXIT_FAILURE);
   }
-  return;
+  if (metrics_start(&metrics)) {
+    fprintf(stderr,"ERROR: pthread_create() failed.\n");
+    exit(EXIT_FAILURE);
+  }
+  printf("# daemon: %d cpus, %lu samples per burst, %.2f%% duty, metrics "
+	 "on http://%s%s/metrics\n", numthreads, numsamples, duty,
+	 strchr(daemon_addr, ':') ? "" : METRICS_ADDR ":", daemon_addr);
+  fflush(stdout);
+
+  /* pinning, kernel set up, calibration, warm-up and the sample
+     buffers are paid for once, here, and never inside a burst */
+  end_ticks = calloc(numthreads, sizeof(*end_ticks));
+  threads = malloc(sizeof(pthread_t)*numthreads);
+  assert(end_ticks != NULL && threads != NULL);
+  burst_left = numthreads;
+  for (j=0;j<numthreads;j++)
+    if (pthread_create(&threads[j], NULL, fwq_core, (void *)(intptr_t)j)) {
+      fprintf(stderr,"ERROR: pthread_create() failed.\n");
+      exit(EXIT_FAILURE);
+    }
+  pthread_mutex_lock(&burst_lock);
+  while (burst_left > 0)
+    pthread_cond_wait(&burst_cond, &burst_lock);
+  pthread_mutex_unlock(&burst_lock);
+
+  for (burst = 0; daemon_bursts == 0 || burst < daemon_bursts; burst++) {
+    /* fresh counts, same baseline */
+    for (j=0;j<numthreads;j++) {
+      base = thread_events[j].baseline;
+      limit = thread_events[j].limit;
+      events_open(&thread_events[j], NULL);
+      events_set_baseline(&thread_events[j], base, limit - base);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pthread_mutex_lock(&burst_lock);
+    barrier_arrived = 0;
+    barrier_start = 0;
+    burst_left = numthreads;
+    burst_gen++;
+    pthread_cond_broadcast(&burst_cond);
+    /* once all are done the workers wait for the next burst and leave
+       their samples alone until then */
+    while (burst_left > 0)
+      pthread_cond_wait(&burst_cond, &burst_lock);
+    pthread_mutex_unlock(&burst_lock);
+
+    /* only the totals are kept */
+    for (j=0;j<numthreads;j++) {
+      events_add(&thread_events[j], samples[j], numsamples, 1);
+      events_close(&thread_events[j]);
+      metrics_add(&metrics, j, samples[j], numsamples, scale,
+		  &thread_events[j]);
+    }
+
+    /* busy from the start barrier to the last worker done, on the
+       selected timer; the wall time is the whole cycle, this folding
+       and the pause after it included */
+    first = start_ticks[0];
+    last = end_ticks[0];
+    for (j=1;j<numthreads;j++) {
+      if (start_ticks[j] < first)
+	first = start_ticks[j];
+      if (end_ticks[j] > last)
+	last = end_ticks[j];
+    }
+    busy = (last - first) * scale;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    spent = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+    wall = busy * 100.0 / duty;
+    if (wall < spent)
+      wall = spent;
+    metrics_burst(&metrics, busy, wall);
+    if (daemon_bursts != 0 && burst + 1 == daemon_bursts)
+      break;
+    pause.tv_sec = (wall - spent) / 1e9;
+    pause.tv_nsec = (wall - spent) - pause.tv_sec * 1e9;
+    while (nanosleep(&pause, &pause) < 0 && errno == EINTR)
+      ;
+  }
+  exit(EXIT_SUCCESS);
 }
+#endif
 
 /**
  * main()
  */
 int main(int argc, char **argv) {
   /* local variables */
-  char fname_times[1024], buf[32], outname[255];
+  char fname_times[1024], outname[255];
   int i,j;
-  int numthreads = 1, use_threads = 0;
+  int use_threads = 0;
   int fp;
   int use_stdout = 0;
+  int format = FORMAT_TEXT;
+  int use_mlockall = 0;
+  /* interrupt snapshots around the sampling, see irqstat.h */
+  struct irqstat irq_before, irq_after;
+  struct timespec irq_t0, irq_t1;
+  int use_irqstat;
+  int use_timer_test = 0;
+  double scale;
+  struct ftq_bin_header hdr;
+  uint32_t *cpu_list = NULL;
 #ifdef _WITH_PTHREADS_
   int rc;
   pthread_t *threads;
-  cpu_set_t cpu_set;
+  struct timespec poll = { 0, 1000000 };
+  char *cpus_arg = NULL;
+  int use_preflight = 0;
+  int placement = PLACE_NONE;
+  int ncpus;
+  int housekeeping = -1;
 #endif
-  unsigned long long max_num = 1, max_time = 0, offset_num = 0;
-  double avg_time = 0;
+  struct stats total;
+  char label[16];
 
   /* default output name prefix */
   sprintf(outname,"fwq");
+  parse_kernels("default");
+  timer_id = find_timer("default");
 
 #ifdef Plan9
   ARGBEGIN{
@@ -384,10 +913,37 @@ int main(int argc, char **argv) {
 	 {"outname",0,0,'o'},
 	 {"stdout",0,0,'s'},
 	 {"threads",0,0,'t'},
+	 {"format",1,0,'f'},
+	 {"stream",0,0,OPT_STREAM},
+	 {"housekeeping",1,0,OPT_HOUSEKEEPING},
+	 {"hugepages",0,0,OPT_HUGEPAGES},
+	 {"mlock",0,0,OPT_MLOCK},
+	 {"mlockall",0,0,OPT_MLOCKALL},
+	 {"timestamps",0,0,OPT_TIMESTAMPS},
+	 {"events",0,0,OPT_EVENTS},
+	 {"event-threshold",1,0,OPT_EVENT_THRESHOLD},
+	 {"kernel",1,0,OPT_KERNEL},
+	 {"wss",1,0,OPT_WSS},
+	 {"target-us",1,0,OPT_TARGET_US},
+	 {"timer",1,0,OPT_TIMER},
+	 {"timer-test",0,0,OPT_TIMER_TEST},
+	 {"cpus",1,0,OPT_CPUS},
+	 {"placement",1,0,OPT_PLACEMENT},
+	 {"sched",1,0,OPT_SCHED},
+	 {"priority",1,0,OPT_PRIORITY},
+	 {"deadline",1,0,OPT_DEADLINE},
+	 {"preflight",0,0,OPT_PREFLIGHT},
+	 {"counters",0,0,OPT_COUNTERS},
+	 {"trace-marker",0,0,OPT_TRACE_MARKER},
+	 {"trace-report",1,0,OPT_TRACE_REPORT},
+	 {"telemetry",2,0,OPT_TELEMETRY},
+	 {"daemon",1,0,OPT_DAEMON},
+	 {"duty",1,0,OPT_DUTY},
+	 {"bursts",1,0,OPT_BURSTS},
 	 {0,0,0,0}
        };
 
-       c = getopt_long(argc, argv, "n:hsw:o:t:",
+       c = getopt_long(argc, argv, "n:hsw:o:t:f:",
 		       long_options, &option_index);
        if (c == -1)
 	 break;
@@ -404,6 +960,13 @@ int main(int argc, char **argv) {
        case 's':
 	 use_stdout = 1;
 	 break;
+       case 'f':
+	 format = parse_format(optarg);
+	 if (format < 0) {
+	   fprintf(stderr,"ERROR: unknown output format '%s'.\n", optarg);
+	   usage(argv[0]);
+	 }
+	 break;
        case 'o':
 	 sprintf(outname,"%s",optarg);
 	 break;
@@ -411,7 +974,175 @@ int main(int argc, char **argv) {
 	 work_bits = atoi(optarg);
 	 break;
        case 'n':
-	 numsamples = atoi(optarg);
+	 numsamples = strtoul(optarg, NULL, 0);
+	 break;
+       case OPT_STREAM:
+#ifndef _WITH_PTHREADS_
+	 fprintf(stderr,"ERROR: streaming requires pthreads support.\n");
+	 exit(EXIT_FAILURE);
+#endif
+	 use_stream = 1;
+	 break;
+       case OPT_HOUSEKEEPING:
+#ifndef _WITH_PTHREADS_
+	 fprintf(stderr,"ERROR: --housekeeping requires pthreads support.\n");
+	 exit(EXIT_FAILURE);
+#else
+	 housekeeping = atoi(optarg);
+#endif
+	 break;
+       case OPT_HUGEPAGES:
+	 memflags |= MEM_HUGE;
+	 break;
+       case OPT_MLOCK:
+	 memflags |= MEM_LOCK;
+	 break;
+       case OPT_MLOCKALL:
+	 use_mlockall = 1;
+	 break;
+       case OPT_TIMESTAMPS:
+	 use_timestamps = 1;
+	 break;
+       case OPT_EVENTS:
+	 use_events = 1;
+	 break;
+       case OPT_EVENT_THRESHOLD:
+	 event_threshold_ns = strtod(optarg, NULL);
+	 use_events = 1;
+	 break;
+       case OPT_KERNEL:
+	 if (strcmp(optarg, "list") == 0) {
+	   list_kernels(stdout);
+	   exit(EXIT_SUCCESS);
+	 }
+	 parse_kernels(optarg);
+	 break;
+       case OPT_WSS:
+	 wss = parse_size(optarg);
+	 if (wss == 0) {
+	   fprintf(stderr,"ERROR: invalid working set size '%s'.\n", optarg);
+	   exit(EXIT_FAILURE);
+	 }
+	 break;
+       case OPT_TARGET_US:
+	 target_ns = strtod(optarg, NULL) * 1000 + 0.5;
+	 if (target_ns == 0) {
+	   fprintf(stderr,"ERROR: invalid target sample time '%s'.\n", optarg);
+	   exit(EXIT_FAILURE);
+	 }
+	 break;
+       case OPT_TIMER:
+	 timer_id = find_timer(optarg);
+	 if (timer_id < 0) {
+	   if (strcmp(optarg, "list") != 0)
+	     fprintf(stderr,"ERROR: unknown timer '%s'.\n", optarg);
+	   fprintf(stderr,"timers (default %s):\n", DEFAULT_TIMER);
+	   for (j=0;j<NUM_TIMERS;j++)
+	     fprintf(stderr,"  %-10s %s\n", timers[j].name, timers[j].desc);
+	   exit(strcmp(optarg, "list") ? EXIT_FAILURE : EXIT_SUCCESS);
+	 }
+	 break;
+       case OPT_TIMER_TEST:
+	 use_timer_test = 1;
+	 break;
+       case OPT_COUNTERS:
+	 use_counters = 1;
+	 break;
+       case OPT_TRACE_MARKER:
+#ifndef _WITH_PTHREADS_
+	 fprintf(stderr,"ERROR: --trace-marker requires pthreads support.\n");
+	 exit(EXIT_FAILURE);
+#endif
+	 use_trace = 1;
+	 break;
+       case OPT_TELEMETRY:
+#ifndef _WITH_PTHREADS_
+	 fprintf(stderr,"ERROR: --telemetry requires pthreads support.\n");
+	 exit(EXIT_FAILURE);
+#else
+	 if (optarg != NULL)
+	   snprintf(telemetry.name, sizeof(telemetry.name), "%s%s",
+		    optarg[0] == '/' ? "" : "/", optarg);
+	 use_telemetry = 1;
+#endif
+	 break;
+       case OPT_DAEMON:
+       case OPT_DUTY:
+       case OPT_BURSTS:
+#ifndef _WITH_PTHREADS_
+	 fprintf(stderr,"ERROR: daemon mode requires pthreads support.\n");
+	 exit(EXIT_FAILURE);
+#else
+	 if (c == OPT_DAEMON) {
+	   daemon_addr = optarg;
+	   use_daemon = 1;
+	 } else if (c == OPT_DUTY) {
+	   duty = strtod(optarg, NULL);
+	   if (duty <= 0 || duty > 100) {
+	     fprintf(stderr,"ERROR: invalid duty cycle '%s'.\n", optarg);
+	     exit(EXIT_FAILURE);
+	   }
+	 } else {
+	   daemon_bursts = strtoul(optarg, NULL, 0);
+	 }
+#endif
+	 break;
+       case OPT_TRACE_REPORT:
+	 if (trace_report(stdout, optarg) < 0) {
+	   perror("can not read trace");
+	   exit(EXIT_FAILURE);
+	 }
+	 exit(EXIT_SUCCESS);
+       case OPT_CPUS:
+#ifndef _WITH_PTHREADS_
+	 fprintf(stderr,"ERROR: --cpus requires pthreads support.\n");
+	 exit(EXIT_FAILURE);
+#else
+	 cpus_arg = optarg;
+#endif
+	 break;
+       case OPT_PLACEMENT:
+#ifndef _WITH_PTHREADS_
+	 fprintf(stderr,"ERROR: --placement requires pthreads support.\n");
+	 exit(EXIT_FAILURE);
+#else
+	 placement = parse_placement(optarg);
+	 if (placement < 0) {
+	   fprintf(stderr,"ERROR: unknown placement '%s'.\n", optarg);
+	   usage(argv[0]);
+	 }
+#endif
+	 break;
+       case OPT_SCHED:
+       case OPT_PRIORITY:
+       case OPT_DEADLINE:
+       case OPT_PREFLIGHT:
+#ifndef _WITH_PTHREADS_
+	 fprintf(stderr,"ERROR: scheduling options require pthreads "
+		 "support.\n");
+	 exit(EXIT_FAILURE);
+#else
+	 if (c == OPT_SCHED) {
+	   rt_sched.policy = parse_sched(optarg);
+	   if (rt_sched.policy < 0) {
+	     fprintf(stderr,"ERROR: unknown scheduling policy '%s'.\n", optarg);
+	     usage(argv[0]);
+	   }
+	 } else if (c == OPT_PRIORITY) {
+	   rt_sched.prio = atoi(optarg);
+	 } else if (c == OPT_DEADLINE) {
+	   char *end;
+
+	   rt_sched.runtime = strtod(optarg, &end) * 1000;
+	   rt_sched.period = (*end == ',') ? strtod(end + 1, NULL) * 1000 : 0;
+	   if (rt_sched.runtime == 0 || rt_sched.period < rt_sched.runtime) {
+	     fprintf(stderr,"ERROR: invalid deadline '%s'.\n", optarg);
+	     exit(EXIT_FAILURE);
+	   }
+	 } else {
+	   use_preflight = 1;
+	 }
+#endif
 	 break;
        case 'h':
        default:
@@ -421,8 +1152,9 @@ int main(int argc, char **argv) {
      }
 #endif /* Plan9 */
 
-  /* sanity check */
-  if (numsamples > MAX_SAMPLES) {
+  /* sanity check.  streamed runs only ever hold two chunks per thread
+     in memory, so they are not limited. */
+  if (numsamples > MAX_SAMPLES && !use_stream) {
     fprintf(stderr,"WARNING: sample count exceeds maximum.\n");
     fprintf(stderr,"         setting count to maximum.\n");
     numsamples = MAX_SAMPLES;
@@ -433,17 +1165,87 @@ int main(int argc, char **argv) {
     numsamples = MIN_SAMPLES;
   }
 
-  /* allocate sample storage */
-  samples = malloc(sizeof(unsigned long long)*numsamples*numthreads);
+#ifdef _WITH_PTHREADS_
+  /* --cpus and --placement pick the CPUs; one thread each, or the first
+     -t of them */
+  if (cpus_arg != NULL || placement != PLACE_NONE) {
+    ncpus = cpus_select(cpus_arg, placement, &cpu_list);
+    if (ncpus <= 0) {
+      fprintf(stderr,"ERROR: no CPUs to measure in '%s'.\n",
+	      cpus_arg ? cpus_arg : "online");
+      exit(EXIT_FAILURE);
+    }
+    if (use_threads == 0)
+      numthreads = ncpus;
+    else if (numthreads > ncpus) {
+      fprintf(stderr,"ERROR: %d threads but only %d CPUs selected.\n",
+	      numthreads, ncpus);
+      exit(EXIT_FAILURE);
+    }
+    use_threads = 1;
+  }
+#endif
+
+  /* the CPU each thread measures, as recorded in binary output and,
+     with an explicit CPU selection, in the file names */
+  cpus = malloc(sizeof(*cpus)*numthreads);
+  assert(cpus != NULL);
+  for (j=0;j<numthreads;j++) {
+#ifdef _WITH_PTHREADS_
+    cpus[j] = cpu_list ? cpu_list[j] : (uint32_t)j;
+#else
+    cpus[j] = FTQ_CPU_NONE;
+#endif
+  }
+  if (cpu_list != NULL)
+    name_cpus = cpus;
+  free(cpu_list);
+
+  /* sample storage itself is allocated by each thread in fwq_core() */
+  samples = calloc(numthreads, sizeof(*samples));
   assert(samples != NULL);
+  start_ticks = calloc(numthreads, sizeof(*start_ticks));
+  assert(start_ticks != NULL);
+  quanta = calloc(numthreads, sizeof(*quanta));
+  assert(quanta != NULL);
+  side_words = use_timestamps + (use_counters ? NUM_PMC : 0);
+  sides = calloc(numthreads, sizeof(*sides));
+  assert(sides != NULL);
+  thread_pmc = calloc(numthreads, sizeof(*thread_pmc));
+  assert(thread_pmc != NULL);
+  pmc_mask = calloc(numthreads, sizeof(*pmc_mask));
+  assert(pmc_mask != NULL);
+  pmc_fast = calloc(numthreads, sizeof(*pmc_fast));
+  assert(pmc_fast != NULL);
+  thread_stats = calloc(numthreads, sizeof(*thread_stats));
+  assert(thread_stats != NULL);
+  for (j=0;j<numthreads;j++)
+    assert(stats_init(&thread_stats[j]) == 0);
+
+  /* event lists go next to the times files.  the daemon always finds
+     events, but keeps only their totals */
+  if (use_daemon)
+    use_events = 1;
+  thread_events = calloc(numthreads, sizeof(*thread_events));
+  assert(thread_events != NULL);
+  for (j=0;j<numthreads;j++) {
+    if (!use_events || use_daemon)
+      continue;
+    sample_fname(fname_times, sizeof(fname_times), outname, j, name_cpus,
+		 "events");
+    if (events_open(&thread_events[j], use_stdout ? NULL : fname_times) < 0) {
+      perror("can not create file");
+      exit(EXIT_FAILURE);
+    }
+  }
 
   if (work_bits > MAX_BITS || work_bits < MIN_BITS) {
     fprintf(stderr,"WARNING: work bits invalid. set to %d.\n", MAX_BITS);
     work_bits = MAX_BITS;
   }
 
-  if (use_threads == 1 && numthreads < 2) {
-    fprintf(stderr,"ERROR: >1 threads required for multithread mode.\n");
+  if (use_threads == 1 && numthreads < 1) {
+    fprintf(stderr,"ERROR: at least 1 thread required for multithread mode.\n");
     exit(EXIT_FAILURE);
   }
 
@@ -452,22 +1254,211 @@ int main(int argc, char **argv) {
     exit(EXIT_FAILURE);
   }
 
+  if (format == FORMAT_BIN && use_stdout == 1) {
+    fprintf(stderr,"ERROR: cannot write binary format to stdout.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (use_timestamps == 1 && use_stdout == 1) {
+    fprintf(stderr,"ERROR: cannot write timestamps to stdout.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (use_counters == 1 && use_stdout == 1) {
+    fprintf(stderr,"ERROR: cannot write counters to stdout.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (use_stream == 1 && use_stdout == 1) {
+    fprintf(stderr,"ERROR: cannot stream to stdout.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /* the daemon keeps no samples, so nothing that writes them out */
+  if (use_daemon == 1 && (use_stream || use_stdout || use_timestamps ||
+			  use_counters || use_trace || use_telemetry ||
+			  format != FORMAT_TEXT)) {
+    fprintf(stderr,"ERROR: --daemon only keeps metrics; it cannot be "
+	    "combined with sample output, --counters, --trace-marker or "
+	    "--telemetry.\n");
+    exit(EXIT_FAILURE);
+  }
+
+#ifdef _WITH_PTHREADS_
+  /* the controlling thread, and the drain, trace, telemetry and metrics
+     threads with it, get a CPU of their own: by default the lowest one
+     that is not measured */
+  if (use_daemon == 1)
+    use_threads = 1;
+  if (use_threads == 1 || use_stream == 1 || use_preflight == 1 ||
+      use_trace == 1 || use_telemetry == 1) {
+    if (housekeeping < 0) {
+      housekeeping = cpu_housekeeping(cpus, numthreads);
+      if (housekeeping < 0)
+	fprintf(stderr,"WARNING: no spare CPU for housekeeping, "
+		"leaving the controller unpinned.\n");
+    } else {
+      for (j=0;j<numthreads;j++)
+	if (cpus[j] == (uint32_t)housekeeping) {
+	  fprintf(stderr,"ERROR: housekeeping CPU %d is also measured.\n",
+		  housekeeping);
+	  exit(EXIT_FAILURE);
+	}
+    }
+    if (use_threads == 1 && housekeeping >= 0 && cpu_pin(housekeeping) < 0) {
+      perror("sched_setaffinity");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  /* check the measured CPUs are set up for this before spending a long
+     run on them.  --preflight only reports, on stdout; a real run keeps
+     the report on stderr, out of the way of the samples (-s) */
+  if (use_preflight == 1) {
+    if (rt_preflight(stdout, cpus, numthreads, housekeeping, &rt_sched) > 0)
+      exit(EXIT_FAILURE);
+    exit(EXIT_SUCCESS);
+  }
+  if (use_threads == 1)
+    rt_preflight(stderr, cpus, numthreads, housekeeping, &rt_sched);
+#endif
+
   /* set up sampling.  first, take a few bogus samples to warm up the
    *  cache and pipeline */
   work_length = 1 << work_bits;
 
-  if (use_threads == 1) {
+  /* samples are taken in ticks; work out how long a tick is so that
+     reports can be in ns */
+  timer_calibrate(&timer);
+  timer_print(stdout, &timer);
+  if (!timer.invariant)
+    fprintf(stderr,"WARNING: the tick counter may not run at a constant "
+	    "rate; ns figures are approximate.\n");
+  scale = timers[timer_id].unit_ns ? 1.0 : timer.ns_per_tick;
+  if (event_threshold_ns > 0) {
+    event_threshold = event_threshold_ns / scale + 0.5;
+    if (event_threshold == 0)
+      event_threshold = 1;
+  }
+
+  if (use_timer_test) {
+    timer_selftest(stdout, &timer, TIMER_TEST_COUNT);
+    exit(EXIT_SUCCESS);
+  }
+
+  /* lock everything the process has and will map (stacks, sample
+     buffers, stream chunks) before any thread starts warming up */
+  if (use_mlockall == 1 && mlockall(MCL_CURRENT|MCL_FUTURE) < 0) {
+    perror("mlockall");
+    exit(EXIT_FAILURE);
+  }
+
+  ftq_bin_init(&hdr, FTQ_BIN_FWQ, numthreads, numsamples, 1);
+  hdr.bits = work_bits;
+  hdr.quantum = target_ns ? 0 : work_length;
+  hdr.target_ns = target_ns;
+  if (timers[timer_id].unit_ns)
+    hdr.tick_unit = FTQ_TICK_NS;
+  hdr.ns_per_tick = scale;
+  hdr.tick_err_ppm = timers[timer_id].unit_ns ? 0 : timer.err_ppm;
+  snprintf(hdr.timer, sizeof(hdr.timer), "%s", timers[timer_id].name);
+  if (side_words)
+    ftq_bin_set_side(&hdr, side_words);
+  if (use_timestamps)
+    hdr.flags |= FTQ_FLAG_GAPS;
+  if (use_counters)
+    hdr.flags |= FTQ_FLAG_COUNTERS;
+  clock_pair(CLOCK_MONOTONIC, &hdr.clock_ticks[0], &hdr.clock_ns[0]);
+
 #ifdef _WITH_PTHREADS_
-    CPU_ZERO(&cpu_set);
-    CPU_SET(0, &cpu_set);
-    if (sched_setaffinity(0, sizeof(cpu_set), &cpu_set) < 0 ) {
-      perror("sched_setaffinity");
+  if (use_stream == 1) {
+    const char *suffixes[2 + NUM_PMC];
+    int c = 0;
+
+    suffixes[c++] = "times";
+    if (use_timestamps)
+      suffixes[c++] = "gaps";
+    for (j=0;use_counters && j<NUM_PMC;j++)
+      suffixes[c++] = pmc_names[j];
+    stream.numthreads = numthreads;
+    stream.sample_words = 1;
+    stream.side_words = side_words;
+    stream.format = format;
+    stream.cpu = housekeeping;
+    stream.memflags = memflags;
+    stream.name_cpus = name_cpus;
+    stream.consume = fwq_consume;
+    stream.consume_arg = NULL;
+    if (stream_open(&stream, outname, suffixes, &hdr, cpus,
+		    start_ticks, quanta) < 0) {
+      perror("can not create stream output");
+      exit(EXIT_FAILURE);
+    }
+    if (stream_start(&stream)) {
+      fprintf(stderr,"ERROR: pthread_create() failed.\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  /* slow samples are marked in the trace by a helper thread, with
+     their ticks put on CLOCK_MONOTONIC the same way as in the header */
+  if (use_trace == 1) {
+    trace.numthreads = numthreads;
+    trace.cpu = housekeeping;
+    trace.cpus = cpus;
+    trace.tick0 = timers[timer_id].unit_ns ? 0 : hdr.clock_ticks[0];
+    trace.ns0 = timers[timer_id].unit_ns ? 0 : hdr.clock_ns[0];
+    trace.ns_per_tick = scale;
+    if (trace_open(&trace) < 0) {
+      perror("can not open trace_marker");
+      exit(EXIT_FAILURE);
     }
+    if (trace_start(&trace)) {
+      fprintf(stderr,"ERROR: pthread_create() failed.\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  /* progress for fwq-top, read out of the sample buffers (or stream
+     chunks) by a helper thread */
+  if (use_telemetry == 1) {
+    telemetry.numthreads = numthreads;
+    telemetry.cpu = housekeeping;
+    telemetry.cpus = cpus;
+    telemetry.numsamples = numsamples;
+    telemetry.ns_per_tick = scale;
+    telemetry.samples = samples;
+    telemetry.rings = use_stream ? stream.rings : NULL;
+    if (telemetry_open(&telemetry) < 0) {
+      perror("can not create telemetry segment");
+      exit(EXIT_FAILURE);
+    }
+    if (telemetry_start(&telemetry)) {
+      fprintf(stderr,"ERROR: pthread_create() failed.\n");
+      exit(EXIT_FAILURE);
+    }
+    printf("# telemetry: %s, watch with fwq-top\n", telemetry.name);
+  }
+
+  if (use_daemon == 1)
+    fwq_daemon(housekeeping, scale);
+#endif
+
+  /* unpinned threads could be anywhere, so only pinned runs count
+     interrupts */
+  memset(&irq_before, 0, sizeof(irq_before));
+  memset(&irq_after, 0, sizeof(irq_after));
+  use_irqstat = cpus[0] != FTQ_CPU_NONE;
+
+  if (use_threads == 1) {
+#ifdef _WITH_PTHREADS_
+    /* this thread only controls: every measured CPU gets a worker of
+       its own, started and joined from the housekeeping CPU */
     threads = malloc(sizeof(pthread_t)*numthreads);
     assert(threads != NULL);
 
     printf("numthreads = %d\n", numthreads);
-    for (i=1;i<numthreads;i++) {
+    for (i=0;i<numthreads;i++) {
       printf("thread number %d being created.\n",i);
       rc = pthread_create(&threads[i], NULL, fwq_core, (void *)(intptr_t)i);
       if (rc) {
@@ -475,9 +1466,15 @@ int main(int argc, char **argv) {
         exit(EXIT_FAILURE);
       }
     }
-    fwq_core(0);
 
-    for (i=1;i<numthreads;i++) {
+    /* interrupt counts from when every thread is about to sample */
+    while (__atomic_load_n(&barrier_arrived, __ATOMIC_ACQUIRE) < numthreads)
+      nanosleep(&poll, NULL);
+    if (use_irqstat && irqstat_take(&irq_before, cpus, numthreads) < 0)
+      use_irqstat = 0;
+    clock_gettime(CLOCK_MONOTONIC, &irq_t0);
+
+    for (i=0;i<numthreads;i++) {
       rc = pthread_join(threads[i],NULL);
       if (rc) {
 	fprintf(stderr,"ERROR: pthread_join() failed.\n");
@@ -488,44 +1485,234 @@ int main(int argc, char **argv) {
     free(threads);
 #endif /* _WITH_PTHREADS_ */
   } else {
+    if (use_irqstat && irqstat_take(&irq_before, cpus, numthreads) < 0)
+      use_irqstat = 0;
+    clock_gettime(CLOCK_MONOTONIC, &irq_t0);
     fwq_core(0);
   }
+  if (use_irqstat && irqstat_take(&irq_after, cpus, numthreads) < 0)
+    use_irqstat = 0;
+  clock_gettime(CLOCK_MONOTONIC, &irq_t1);
+  clock_pair(CLOCK_MONOTONIC, &hdr.clock_ticks[1], &hdr.clock_ns[1]);
+#ifdef _WITH_PTHREADS_
+  if (use_trace == 1) {
+    trace_finish(&trace);
+    printf("# trace: %llu spike markers written to trace_marker\n",
+	   trace.written);
+  }
+  if (use_telemetry == 1)
+    telemetry_finish(&telemetry);
+#endif
+
+  /* the counters every thread had, and read every sample */
+  if (use_counters) {
+    hdr.counters = hdr.counters_fast = ~0U;
+    for (j=0;j<numthreads;j++) {
+      hdr.counters &= pmc_mask[j];
+      hdr.counters_fast &= pmc_fast[j];
+    }
+  }
 
-  if (use_stdout == 1) {
+  if (use_stream == 1) {
+#ifdef _WITH_PTHREADS_
+    if (stream_finish(&stream) < 0) {
+      perror("can not write samples");
+      exit(EXIT_FAILURE);
+    }
+#endif
+  } else if (format == FORMAT_BIN) {
+    sprintf(fname_times,"%s.bin",outname);
+    fp = open(fname_times, O_CREAT|O_TRUNC|O_WRONLY, 0644);
+    if(fp < 0) {
+      perror("can not create file");
+      exit(EXIT_FAILURE);
+    }
+    if (ftq_write_bin(fp, &hdr, cpus, start_ticks, quanta, samples, sides) < 0) {
+      perror("can not write samples");
+      exit(EXIT_FAILURE);
+    }
+    close(fp);
+  } else if (use_stdout == 1) {
     for (i=0;i<numsamples;i++) {
-      fprintf(stdout,"%lld\n",samples[i]);
+      fprintf(stdout,"%lld\n",samples[0][i]);
     }
   } else {
 
-    for (j=0;j<numthreads;j++) {
-      sprintf(fname_times,"%s_%d_times.dat",outname,j);
+    struct text_job *jobs;
+    int njobs = 0;
 
-#ifdef Plan9
-      fp = create(fname_times, OWRITE, 700);
-#else
-      fp = open(fname_times, O_CREAT|O_TRUNC|O_WRONLY, 0644);
-#endif
-      if(fp < 0) {
-	perror("can not create file");
-	exit(EXIT_FAILURE);
-      }
-      for (i=0;i<numsamples;i++) {
-	sprintf(buf, "%lld\n", samples[i+(numsamples*j)]);
-	write(fp, buf, strlen(buf));
+    jobs = calloc(numthreads*(1+side_words), sizeof(*jobs));
+    assert(jobs != NULL);
+    for (j=0;j<numthreads;j++) {
+      sample_fname(jobs[njobs].fname, sizeof(jobs[njobs].fname), outname, j,
+		   name_cpus, "times");
+      jobs[njobs].base = samples[j];
+      jobs[njobs].count = numsamples;
+      jobs[njobs].stride = 1;
+      njobs++;
+      for (i=0;i<side_words;i++) {
+	sample_fname(jobs[njobs].fname, sizeof(jobs[njobs].fname), outname,
+		     j, name_cpus, i < use_timestamps ? "gaps" :
+		     pmc_names[i - use_timestamps]);
+	jobs[njobs].base32 = sides[j] + i;
+	jobs[njobs].count = numsamples;
+	jobs[njobs].stride = side_words;
+	njobs++;
       }
-      close(fp);
+    }
+    if (ftq_write_text(jobs, njobs) < 0) {
+      perror("can not write samples");
+      exit(EXIT_FAILURE);
+    }
+    free(jobs);
+  }
+
+  /* text output keeps the per-thread start ticks in a file of their
+     own, one line per thread, so the times files stay unchanged */
+  if (format == FORMAT_TEXT && use_stdout == 0) {
+    struct text_job job;
+
+    memset(&job, 0, sizeof(job));
+    sprintf(job.fname,"%s_start.dat",outname);
+    job.base = start_ticks;
+    job.count = numthreads;
+    job.stride = 1;
+    if (ftq_write_text(&job, 1) < 0) {
+      perror("can not write start ticks");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  /* ... likewise the calibrated quantum of each thread */
+  if (format == FORMAT_TEXT && use_stdout == 0 && target_ns) {
+    struct text_job job;
+
+    memset(&job, 0, sizeof(job));
+    sprintf(job.fname,"%s_quanta.dat",outname);
+    job.base = quanta;
+    job.count = numthreads;
+    job.stride = 1;
+    if (ftq_write_text(&job, 1) < 0) {
+      perror("can not write quanta");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  /* ... and with timestamps, the tick/CLOCK_MONOTONIC pairs from the
+     start and end of the run as "tick ns" lines */
+  if (format == FORMAT_TEXT && use_stdout == 0 && use_timestamps) {
+    FILE *clk;
 
+    sprintf(fname_times,"%s_clock.dat",outname);
+    clk = fopen(fname_times, "w");
+    if (clk == NULL) {
+      perror("can not create file");
+      exit(EXIT_FAILURE);
     }
+    for (j=0;j<2;j++)
+      fprintf(clk,"%llu %llu\n",
+	      (unsigned long long)hdr.clock_ticks[j],
+	      (unsigned long long)hdr.clock_ns[j]);
+    fclose(clk);
   }
 
-  max_num = numthreads * numsamples;
-  for(offset_num=0; offset_num<max_num; offset_num++ ) {
-    max_time += samples[offset_num];
+  if (numthreads > 1) {
+    unsigned long long first = start_ticks[0], last = start_ticks[0];
+
+    for (j=1;j<numthreads;j++) {
+      if (start_ticks[j] < first)
+	first = start_ticks[j];
+      if (start_ticks[j] > last)
+	last = start_ticks[j];
+    }
+    printf("Sampling start skew across %d threads: %.0f ns\n",
+	   numthreads, (last - first) * scale);
+  }
+
+  if (target_ns) {
+    printf("# work quantum calibrated to %llu ns per sample\n", target_ns);
+    for (j=0;j<numthreads;j++)
+      printf("  thread %d: %s x %llu\n", j,
+	     kernel_list[j % num_kernel_list]->name, quanta[j]);
+  }
+
+  /* summary of the sample times, per thread and for the whole run.
+     streamed runs have already been summarised by the drain thread. */
+  if (!use_stream) {
+    for (j=0;j<numthreads;j++) {
+      stats_add(&thread_stats[j], samples[j], numsamples, 1);
+      if (use_events)
+	events_add(&thread_events[j], samples[j], numsamples, 1);
+      if (use_counters)
+	pmc_stats_add(&thread_pmc[j], samples[j], sides[j] + use_timestamps,
+		      numsamples, side_words);
+      sample_free(samples[j], sizeof(unsigned long long)*numsamples,
+		  memflags);
+      sample_free(sides[j], sizeof(uint32_t)*numsamples*side_words,
+		  memflags);
+    }
+  }
+  assert(stats_init(&total) == 0);
+  printf("# sample time summary (ns), %d threads x %lu samples\n",
+	 numthreads, numsamples);
+  stats_print_header(stdout);
+  for (j=0;j<numthreads;j++) {
+    sprintf(label,"%d",j);
+    stats_print(stdout, label, &thread_stats[j], scale);
+    stats_merge(&total, &thread_stats[j]);
+    stats_free(&thread_stats[j]);
+  }
+  if (numthreads > 1)
+    stats_print(stdout, "all", &total, scale);
+  stats_free(&total);
+  free(thread_stats);
+
+  if (use_events) {
+    printf("# noise events (samples over limit; excess over baseline; ns)\n");
+    events_print_header(stdout);
+    for (j=0;j<numthreads;j++) {
+      if (events_close(&thread_events[j]) < 0)
+	perror("can not write events");
+      sprintf(label,"%d",j);
+      events_print(stdout, label, &thread_events[j], scale);
+    }
+    events_print_hist(stdout, thread_events, numthreads, scale,
+		      "ns");
+  }
+
+  /* ... and what interrupted the measured CPUs meanwhile */
+  if (use_irqstat)
+    irqstat_print(stdout, &irq_before, &irq_after,
+		  (irq_t1.tv_sec - irq_t0.tv_sec) +
+		  (irq_t1.tv_nsec - irq_t0.tv_nsec) / 1e9);
+  irqstat_free(&irq_before);
+  irqstat_free(&irq_after);
+  free(thread_events);
+
+  if (use_counters) {
+    printf("# counters: ");
+    for (i=0;i<NUM_PMC;i++)
+      printf("%s %s%s", pmc_names[i],
+	     !(hdr.counters & (1U << i)) ? "n/a" :
+	     (hdr.counters_fast & (1U << i)) ? "per sample" :
+	     "since the previous slow sample",
+	     i < NUM_PMC-1 ? ", " : "\n");
+    printf("# counters are read after each sample, so deltas include "
+	   "the untimed gap before it\n");
+    pmc_print_header(stdout);
+    for (j=0;j<numthreads;j++) {
+      sprintf(label,"%d",j);
+      pmc_stats_print(stdout, label, &thread_pmc[j], scale);
+    }
   }
-  avg_time = max_time/max_num;
-  printf("Total time for %d threads(%ld tasks/thread): %llu(ns)\nAverage time per thread per task:%.0f(ns)\n",
-         numthreads, numsamples, max_time, avg_time);
+  free(thread_pmc);
+  free(pmc_mask);
+  free(pmc_fast);
   free(samples);
+  free(start_ticks);
+  free(quanta);
+  free(sides);
+  free(cpus);
 
 #ifdef _WITH_PTHREADS_
   pthread_exit(NULL);
@@ -0,0 +1,282 @@
+/*
+ * irqstat.c : interrupt, softirq and scheduler counts of the measured
+ * CPUs, from procfs.
+ *
+ * Licensed under the terms of the GNU Public Licence.  See LICENCE_GPL
+ * for details.
+ */
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "irqstat.h"
+
+/* the column of each measured CPU in a "CPU0 CPU1 ..." header line, -1
+   for CPUs not listed (offline).  returns the number of columns. */
+static int cpu_columns(const char *line, const struct irqstat *s, int *col) {
+  const char *p = line;
+  char *end;
+  unsigned long cpu;
+  int c = 0, i;
+
+  for (i = 0; i < s->n; i++)
+    col[i] = -1;
+  while ((p = strstr(p, "CPU")) != NULL) {
+    cpu = strtoul(p + 3, &end, 10);
+    for (i = 0; i < s->n; i++)
+      if (s->cpus[i] == cpu)
+	col[i] = c;
+    c++;
+    p = end;
+  }
+  return c;
+}
+
+/* add a source called label, described by desc, to s */
+static struct irqstat_source *add_source(struct irqstat *s, const char *label,
+					 const char *desc) {
+  struct irqstat_source *src;
+
+  s->src = realloc(s->src, sizeof(*s->src) * (s->nsrc + 1));
+  if (s->src == NULL)
+    return NULL;
+  src = &s->src[s->nsrc++];
+  snprintf(src->label, sizeof(src->label), "%s", label);
+  snprintf(src->name, sizeof(src->name), "%s", desc);
+  src->count = calloc(s->n, sizeof(*src->count));
+  return src->count != NULL ? src : NULL;
+}
+
+/*
+ * read /proc/interrupts or /proc/softirqs: a header of CPU columns,
+ * then "label: count count ... description" lines.  softirqs get a
+ * "softirq " prefix; device interrupts are named by their label and
+ * the last word of the description, which is the device.
+ */
+static int read_table(struct irqstat *s, const char *path, int soft) {
+  FILE *fp = fopen(path, "r");
+  char *line = NULL, *p, *end, *colon, *last;
+  char label[16], desc[IRQSTAT_NAME];
+  size_t len = 0;
+  int *col, ncols = 0, c, i;
+  unsigned long long *v = NULL;
+  struct irqstat_source *src;
+
+  if (fp == NULL)
+    return -1;
+  col = malloc(sizeof(int) * s->n);
+  if (col == NULL || getline(&line, &len, fp) < 0)
+    goto bad;
+  /* one column per CPU the kernel lists, however many that is */
+  ncols = cpu_columns(line, s, col);
+  v = malloc(sizeof(*v) * (ncols ? ncols : 1));
+  if (v == NULL)
+    goto bad;
+
+  while (getline(&line, &len, fp) >= 0) {
+    if ((colon = strchr(line, ':')) == NULL)
+      continue;
+    *colon = '\0';
+    for (p = line; isspace((unsigned char)*p); p++)
+      ;
+    snprintf(label, sizeof(label), "%s%s", soft ? "s:" : "", p);
+
+    p = colon + 1;
+    for (c = 0; c < ncols; c++) {
+      v[c] = strtoull(p, &end, 10);
+      if (end == p)
+	break;
+      p = end;
+    }
+    for (; c < ncols; c++)
+      v[c] = 0;
+
+    /* the rest of the line describes the source */
+    while (isspace((unsigned char)*p))
+      p++;
+    for (end = p + strlen(p); end > p && isspace((unsigned char)end[-1]); )
+      *--end = '\0';
+    if (soft)
+      snprintf(desc, sizeof(desc), "softirq %s", label + 2);
+    else if (isdigit((unsigned char)label[0])) {
+      last = strrchr(p, ' ');
+      snprintf(desc, sizeof(desc), "%s %s", label, last ? last + 1 : p);
+    } else
+      snprintf(desc, sizeof(desc), "%s %s", label, p);
+
+    if ((src = add_source(s, label, desc)) == NULL)
+      break;
+    for (i = 0; i < s->n; i++)
+      if (col[i] >= 0)
+	src->count[i] = v[col[i]];
+  }
+  free(line);
+  free(v);
+  free(col);
+  fclose(fp);
+  return 0;
+
+ bad:
+  free(line);
+  free(col);
+  fclose(fp);
+  return -1;
+}
+
+/* per-CPU lines of /proc/stat or /proc/schedstat: "cpuN v0 v1 ...".
+   keeps values k[0..nk-1] of measured CPU i in out[i*nk ...].  returns
+   the number of measured CPUs found. */
+static int read_cpu_lines(const struct irqstat *s, const char *path,
+			  const int *k, int nk, unsigned long long *out) {
+  FILE *fp = fopen(path, "r");
+  char *line = NULL, *p, *end;
+  size_t len = 0;
+  unsigned long cpu;
+  unsigned long long v[16];
+  int i, j, f, found = 0;
+
+  if (fp == NULL)
+    return 0;
+  while (getline(&line, &len, fp) >= 0) {
+    if (strncmp(line, "cpu", 3) != 0 || !isdigit((unsigned char)line[3]))
+      continue;
+    cpu = strtoul(line + 3, &p, 10);
+    for (f = 0; f < 16; f++) {
+      v[f] = strtoull(p, &end, 10);
+      if (end == p)
+	break;
+      p = end;
+    }
+    for (i = 0; i < s->n; i++) {
+      if (s->cpus[i] != cpu)
+	continue;
+      for (j = 0; j < nk; j++)
+	out[i*nk + j] = k[j] < f ? v[k[j]] : 0;
+      found++;
+    }
+  }
+  free(line);
+  fclose(fp);
+  return found;
+}
+
+/* whether the kernel is keeping schedstats.  with kernel.sched_schedstats
+   off /proc/schedstat still exists but its counts stay 0; kernels
+   without the switch keep them whenever the file is there */
+static int schedstats_on(void) {
+  FILE *fp = fopen("/proc/sys/kernel/sched_schedstats", "r");
+  int c;
+
+  if (fp == NULL)
+    return 1;
+  c = fgetc(fp);
+  fclose(fp);
+  return c != '0';
+}
+
+/**
+ * irqstat_take() : snapshot the counts of the n cpus.  returns 0, or -1
+ * if /proc/interrupts could not be read.
+ */
+int irqstat_take(struct irqstat *s, const uint32_t *cpus, int n) {
+  /* /proc/stat: irq, softirq, steal */
+  static const int stat_fields[IRQSTAT_TIMES] = { 5, 6, 7 };
+  /* /proc/schedstat: sched_count */
+  static const int sched_fields[1] = { 2 };
+
+  memset(s, 0, sizeof(*s));
+  s->n = n;
+  s->cpus = cpus;
+  s->sched = calloc(n, sizeof(*s->sched));
+  s->times = calloc(n * IRQSTAT_TIMES, sizeof(*s->times));
+  if (s->sched == NULL || s->times == NULL)
+    return -1;
+  if (read_table(s, "/proc/interrupts", 0) < 0)
+    return -1;
+  read_table(s, "/proc/softirqs", 1);
+  read_cpu_lines(s, "/proc/stat", stat_fields, IRQSTAT_TIMES, s->times);
+  s->have_sched = schedstats_on() &&
+    read_cpu_lines(s, "/proc/schedstat", sched_fields, 1, s->sched) > 0;
+  return 0;
+}
+
+/**
+ * irqstat_free() : release a snapshot.
+ */
+void irqstat_free(struct irqstat *s) {
+  int k;
+
+  for (k = 0; k < s->nsrc; k++)
+    free(s->src[k].count);
+  free(s->src);
+  free(s->sched);
+  free(s->times);
+  memset(s, 0, sizeof(*s));
+}
+
+struct hit {
+  unsigned long long count;
+  const char *name;
+};
+
+static int hit_cmp(const void *a, const void *b) {
+  const struct hit *x = a, *y = b;
+
+  return (x->count < y->count) - (x->count > y->count);
+}
+
+/**
+ * irqstat_print() : for each measured CPU, what changed between the
+ * two snapshots, seconds apart: every interrupt and softirq source that
+ * fired, most frequent first, with its count and rate.
+ */
+void irqstat_print(FILE *fp, const struct irqstat *before,
+		   const struct irqstat *after, double seconds) {
+  long hz = sysconf(_SC_CLK_TCK);
+  struct hit *hits;
+  int i, k, b, nh;
+
+  hits = malloc(sizeof(*hits) * (after->nsrc ? after->nsrc : 1));
+  if (hits == NULL)
+    return;
+  fprintf(fp, "# interrupts during sampling (%.3f s), per measured cpu\n",
+	  seconds);
+  for (i = 0; i < after->n; i++) {
+    fprintf(fp, "# cpu %u:", after->cpus[i]);
+    if (after->have_sched && before->have_sched)
+      fprintf(fp, " %llu schedule() calls,",
+	      after->sched[i] - before->sched[i]);
+    else
+      fprintf(fp, " schedule() calls n/a,");
+    fprintf(fp, " irq %.0f ms, softirq %.0f ms, steal %.0f ms\n",
+	    (after->times[i*IRQSTAT_TIMES + IRQSTAT_IRQ] -
+	     before->times[i*IRQSTAT_TIMES + IRQSTAT_IRQ]) * 1000.0 / hz,
+	    (after->times[i*IRQSTAT_TIMES + IRQSTAT_SOFTIRQ] -
+	     before->times[i*IRQSTAT_TIMES + IRQSTAT_SOFTIRQ]) * 1000.0 / hz,
+	    (after->times[i*IRQSTAT_TIMES + IRQSTAT_STEAL] -
+	     before->times[i*IRQSTAT_TIMES + IRQSTAT_STEAL]) * 1000.0 / hz);
+
+    /* sources are matched by label: interrupts can come and go */
+    nh = 0;
+    for (k = 0; k < after->nsrc; k++) {
+      unsigned long long prev = 0;
+
+      for (b = 0; b < before->nsrc; b++)
+	if (strcmp(before->src[b].label, after->src[k].label) == 0) {
+	  prev = before->src[b].count[i];
+	  break;
+	}
+      if (after->src[k].count[i] > prev) {
+	hits[nh].count = after->src[k].count[i] - prev;
+	hits[nh].name = after->src[k].name;
+	nh++;
+      }
+    }
+    qsort(hits, nh, sizeof(*hits), hit_cmp);
+    for (k = 0; k < nh; k++)
+      fprintf(fp, "  %12llu %10.1f/s  %s\n", hits[k].count,
+	      seconds > 0 ? hits[k].count / seconds : 0.0, hits[k].name);
+  }
+  free(hits);
+}
@@ -0,0 +1,53 @@
+/*
+ * irqstat.h : which interrupt sources hit the measured CPUs during a
+ * run.
+ *
+ * The controller snapshots /proc/interrupts, /proc/softirqs, /proc/stat
+ * and, when the kernel keeps schedstats (kernel.sched_schedstats),
+ * /proc/schedstat just before the measuring threads start sampling and
+ * again once they are done.  The difference, for the measured CPUs
+ * only, is reported next to the noise statistics: how often each
+ * interrupt and softirq fired on each CPU, how many times it went
+ * through the scheduler (n/a without schedstats), and how much time the
+ * kernel accounted to irq, softirq and steal there.
+ *
+ * Licensed under the terms of the GNU Public Licence.  See LICENCE_GPL
+ * for details.
+ */
+#ifndef __IRQSTAT_H__
+#define __IRQSTAT_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* longest source name kept, "LOC", "24 ACPI:Ged", "softirq TIMER" ... */
+#define IRQSTAT_NAME   48
+
+/* /proc/stat times kept per CPU */
+#define IRQSTAT_IRQ      0
+#define IRQSTAT_SOFTIRQ  1
+#define IRQSTAT_STEAL    2
+#define IRQSTAT_TIMES    3
+
+struct irqstat_source {
+  char label[16];                 /* "24", "LOC", "TIMER" ... */
+  char name[IRQSTAT_NAME];
+  unsigned long long *count;      /* per measured CPU */
+};
+
+struct irqstat {
+  int n;                          /* measured CPUs */
+  const uint32_t *cpus;
+  int nsrc;
+  struct irqstat_source *src;
+  unsigned long long *sched;      /* schedule() calls, if schedstats */
+  int have_sched;
+  unsigned long long *times;      /* IRQSTAT_TIMES per CPU, USER_HZ */
+};
+
+extern int irqstat_take(struct irqstat *s, const uint32_t *cpus, int n);
+extern void irqstat_print(FILE *fp, const struct irqstat *before,
+			  const struct irqstat *after, double seconds);
+extern void irqstat_free(struct irqstat *s);
+
+#endif /* __IRQSTAT_H__ */
@@ -0,0 +1,130 @@
+/*
+ * kernels.c : out of line support for the fwq work kernels.
+ *
+ * Licensed under the terms of the GNU Public Licence.  See LICENCE_GPL
+ * for details.
+ */
+#include <stdlib.h>
+#include "kernels.h"
+#include "mem.h"
+
+/**
+ * daxpy_setup() : the two VECLEN vectors daxpy works on.  returns 0,
+ * or -1 with errno set.
+ */
+int daxpy_setup(struct work *w) {
+  int i;
+
+  w->dx = sample_alloc(sizeof(double)*VECLEN*2, w->memflags);
+  if (w->dx == NULL)
+    return -1;
+  w->dy = w->dx + VECLEN;
+  w->da = 1.0e-6;
+  for (i = 0; i < VECLEN; i++) {
+    w->dx[i] = 0.3141592654;
+    w->dy[i] = 0.271828182845904523536;
+  }
+  return 0;
+}
+
+void daxpy_teardown(struct work *w) {
+  sample_free(w->dx, sizeof(double)*VECLEN*2, w->memflags);
+}
+
+/* kept out of line, in its own file, so the call is part of the work */
+void daxpy(int n, double da, double *dx, int incx, double *dy, int incy) {
+  register int k;
+
+  for (k = 0; k < n; k++)
+    dx[k] += da*dy[k];
+}
+
+#if defined(__x86_64__)
+/* cpu_has_*() : whether the CPU, and the kernel's saving of its
+   registers, allow the avx2 and avx512 kernels */
+int cpu_has_avx2(void) {
+  return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+
+int cpu_has_avx512(void) {
+  return __builtin_cpu_supports("avx512f");
+}
+#endif
+
+/**
+ * chase_setup() : link the CHASE_LINE sized lines of a working set of
+ * wss bytes into one cycle in random order.  Sattolo's shuffle of the
+ * line numbers gives a single cycle through all of them.  returns 0, or
+ * -1 with errno set.
+ */
+int chase_setup(struct work *w) {
+  size_t n = w->wss / CHASE_LINE, i, j, t;
+  size_t *next;
+  char *base;
+  unsigned long long x = 0x9e3779b97f4a7c15ULL;
+
+  if (n < 2)
+    n = 2;
+  w->wss = n * CHASE_LINE;
+  base = sample_alloc(w->wss, w->memflags);
+  if (base == NULL)
+    return -1;
+  next = malloc(n * sizeof(*next));
+  if (next == NULL) {
+    sample_free(base, w->wss, w->memflags);
+    return -1;
+  }
+
+  for (i = 0; i < n; i++)
+    next[i] = i;
+  for (i = n - 1; i > 0; i--) {
+    /* xorshift64, fixed seed: the same cycle every run */
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    j = x % i;
+    t = next[i];
+    next[i] = next[j];
+    next[j] = t;
+  }
+  for (i = 0; i < n; i++)
+    *(void **)(base + i * CHASE_LINE) = base + next[i] * CHASE_LINE;
+  free(next);
+
+  w->chase_base = base;
+  w->chase = (void **)base;
+  return 0;
+}
+
+void chase_teardown(struct work *w) {
+  sample_free(w->chase_base, w->wss, w->memflags);
+}
+
+/**
+ * triad_setup() : the three triad arrays, wss bytes between them.
+ * returns 0, or -1 with errno set.
+ */
+int triad_setup(struct work *w) {
+  size_t i;
+
+  w->tlen = w->wss / (3 * sizeof(double));
+  if (w->tlen < 1)
+    w->tlen = 1;
+  w->wss = w->tlen * 3 * sizeof(double);
+  w->ta = sample_alloc(w->wss, w->memflags);
+  if (w->ta == NULL)
+    return -1;
+  w->tb = w->ta + w->tlen;
+  w->tc = w->tb + w->tlen;
+  for (i = 0; i < w->tlen; i++) {
+    w->ta[i] = 1.0;
+    w->tb[i] = 2.0;
+    w->tc[i] = 0.0;
+  }
+  w->tpos = 0;
+  return 0;
+}
+
+void triad_teardown(struct work *w) {
+  sample_free(w->ta, w->wss, w->memflags);
+}
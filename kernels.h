@@ -0,0 +1,300 @@
+/*
+ * kernels.h : fwq work kernels.
+ *
+ * A kernel is one fixed quantum of work.  Each is an always inlined
+ * function so that fwq can instantiate its sampling loop once per
+ * kernel, with the work in line between the two tick reads rather than
+ * behind a function pointer.  The list of kernels is FWQ_KERNELS(X),
+ * expanded with X(name, target, supported, setup, teardown, description);
+ * kernel_<name>() is the work itself.  target is empty or the
+ * KERNEL_TARGET() the kernel and its sampling loop are compiled for, and
+ * supported(), if not NULL, says whether this CPU can run it.
+ * setup/teardown, either of which may be NULL, prepare and release any
+ * data it needs.  setup runs on the measuring thread after it has been
+ * pinned, so the data is local to its CPU.
+ *
+ * To add a kernel, write kernel_<name>() and add it to the list.
+ *
+ * Licensed under the terms of the GNU Public Licence.  See LICENCE_GPL
+ * for details.
+ */
+#ifndef __KERNELS_H__
+#define __KERNELS_H__
+
+#define KERNEL_INLINE  static inline __attribute__((always_inline))
+#define KERNEL_TARGET(isa)  __attribute__((target(isa)))
+
+/* count: inner loop trip count.  daxpy: vector length, chosen so that
+   the vectors fit in L1 for all hardware threads sharing a core */
+#define ITERCOUNT      32
+#define VECLEN         1024
+/* chase and triad: default working set, and the pointer chase stride */
+#define DEFAULT_WSS    (64UL << 20)
+#define CHASE_LINE     64
+
+/* per-thread kernel state */
+struct work {
+  long long wl;             /* minus the number of iterations per quantum */
+  int memflags;             /* for sample_alloc(), see mem.h */
+  double da, *dx, *dy;      /* daxpy */
+  size_t wss;               /* chase, triad: working set in bytes */
+  void **chase;             /* chase: current position in the cycle */
+  void *chase_base;
+  double *ta, *tb, *tc;     /* triad: a = b + s*c ... */
+  size_t tlen, tpos;        /* ... over tlen elements, resuming at tpos */
+};
+
+extern int daxpy_setup(struct work *w);
+extern void daxpy_teardown(struct work *w);
+extern void daxpy(int n, double da, double *dx, int incx, double *dy,
+		  int incy);
+extern int chase_setup(struct work *w);
+extern void chase_teardown(struct work *w);
+extern int triad_setup(struct work *w);
+extern void triad_teardown(struct work *w);
+extern int cpu_has_avx2(void);
+extern int cpu_has_avx512(void);
+
+#if defined(__x86_64__) || defined(__aarch64__)
+#define KERNELS_ASM(X)							\
+  X(nop16, , NULL, NULL, NULL,						\
+    "asm loop: increment, 16 nops, compare and branch")
+#else
+#define KERNELS_ASM(X)
+#endif
+
+/*
+ * explicitly vectorised daxpy, one kernel per vector width.  SVE is not
+ * here: its vectors have no compile time length, so it does not fit
+ * GCC's vector extensions.
+ */
+#if defined(__x86_64__)
+#define KERNELS_SIMD(X)							\
+  X(sse2, KERNEL_TARGET("sse2"), NULL, daxpy_setup, daxpy_teardown,	\
+    "daxpy in 128 bit SSE2 vectors")					\
+  X(avx2, KERNEL_TARGET("avx2,fma"), cpu_has_avx2,			\
+    daxpy_setup, daxpy_teardown, "daxpy in 256 bit AVX2 vectors, FMA")	\
+  X(avx512, KERNEL_TARGET("avx512f"), cpu_has_avx512,			\
+    daxpy_setup, daxpy_teardown, "daxpy in 512 bit AVX-512 vectors, FMA")
+#define SIMD_KERNELS  "avx512", "avx2", "sse2",
+#elif defined(__aarch64__)
+#define KERNELS_SIMD(X)							\
+  X(neon, , NULL, daxpy_setup, daxpy_teardown,				\
+    "daxpy in 128 bit NEON vectors")
+#define SIMD_KERNELS  "neon",
+#else
+#define KERNELS_SIMD(X)
+#define SIMD_KERNELS
+#endif
+
+#define FWQ_KERNELS(X)							\
+  X(empty, , NULL, NULL, NULL,						\
+    "no work at all: back to back timer reads, the measurement floor") \
+  KERNELS_ASM(X)							\
+  X(count, , NULL, NULL, NULL, "register increment/decrement loop in C") \
+  X(daxpy, , NULL, daxpy_setup, daxpy_teardown,				\
+    "call to daxpy() on VECLEN doubles per iteration")			\
+  KERNELS_SIMD(X)							\
+  X(chase, , NULL, chase_setup, chase_teardown,				\
+    "dependent loads around a random cycle of lines over --wss bytes")	\
+  X(triad, , NULL, triad_setup, triad_teardown,				\
+    "STREAM triad a = b + s*c, one element per iteration, over --wss bytes")
+
+/* the kernel used when none is asked for */
+#ifdef DAXPY
+#define DEFAULT_KERNEL "daxpy"
+#elif defined(__x86_64__) || defined(__aarch64__)
+#define DEFAULT_KERNEL "nop16"
+#else
+#define DEFAULT_KERNEL "count"
+#endif
+
+/*
+ * No work: the sample is just the two timer reads, so its time is the
+ * smallest anything can be measured as on that core.  Subtract it from
+ * other kernels' samples; any spread in it is noise that even the timer
+ * read sees (SMIs, interrupts, a hypervisor).  -w has no effect on it,
+ * and --target-us calibrates it to 0 iterations.
+ */
+KERNEL_INLINE void kernel_empty(struct work *w) {
+  __asm__ __volatile__("" : : "r" (w) : "memory");
+}
+
+#if defined(__x86_64__)
+/*
+ * Core work construct written as loop in gas (GNU Assembler) for x86-64
+ * in 64b mode with 16 NOPs in the loop.  If you are running on x86
+ * compatible hardware in 32b mode change "incq" to "incl" and "cmpq" to
+ * "cmpl".  You can also add/remove "nop" instructions to minimize
+ * instruction cache turbulence and/or increase/decrease the work for
+ * each pass of the loop.  Verify by inspecting the compiler generated
+ * assembly code listing.
+ */
+KERNEL_INLINE void kernel_nop16(struct work *w) {
+  register long long count = w->wl;
+
+  __asm__ __volatile__("1:\tincq %0\n\t"
+		       "nop\n\t"
+		       "nop\n\t"
+		       "nop\n\t"
+		       "nop\n\t"
+		       "nop\n\t"
+		       "nop\n\t"
+		       "nop\n\t"
+		       "nop\n\t"
+		       "nop\n\t"
+		       "nop\n\t"
+		       "nop\n\t"
+		       "nop\n\t"
+		       "nop\n\t"
+		       "nop\n\t"
+		       "nop\n\t"
+		       "nop\n\t"
+/* Group of 16 NOPs */
+		       "cmpq $0, %0\n\t"
+		       "js 1b"
+		       : "+r"(count)
+		       :
+		       : "cc");
+}
+#elif defined(__aarch64__)
+/* Core work loop in gas */
+KERNEL_INLINE void kernel_nop16(struct work *w) {
+  register long long count = w->wl;
+
+  __asm__ __volatile__("1:\n\t"
+		       "add %0, %0, #1\n\t"
+		       "nop\n\t"
+		       "nop\n\t"
+		       "nop\n\t"
+		       "nop\n\t"
+		       "nop\n\t"
+		       "nop\n\t"
+		       "nop\n\t"
+		       "nop\n\t"
+		       "nop\n\t"
+		       "nop\n\t"
+		       "nop\n\t"
+		       "nop\n\t"
+		       "nop\n\t"
+		       "nop\n\t"
+		       "nop\n\t"
+		       "nop\n\t"
+		       "cmp %0, #0\n\t"
+		       "b.ne 1b"
+		       : "+r"(count)
+		       :
+		       : "cc", "memory");
+}
+#endif
+
+/*
+ * This is the default work construct.  Be very careful with this as it
+ * is most important that "count" variable be in a register and the loop
+ * not get optimized away by over zealous compiler optimizers.  If
+ * "count" is not in a register you will get a lot of variations in
+ * runtime due to memory latency.  If the loop is optimized away, then
+ * the sample runtime will be very short and not change even if the work
+ * length is increased.  The empty asm statements pin "count" to a
+ * register and keep every step of the inner loops; verify with the
+ * compiler generated assembly language.
+ */
+KERNEL_INLINE void kernel_count(struct work *w) {
+  register long long count;
+  register int k;
+
+  for (count = w->wl; count < 0; ) {
+    for (k = 0; k < ITERCOUNT; k++) {
+      count++;
+      __asm__ __volatile__("" : "+r"(count));
+    }
+    for (k = 0; k < (ITERCOUNT-1); k++) {
+      count--;
+      __asm__ __volatile__("" : "+r"(count));
+    }
+  }
+}
+
+/*
+ * Work construct based on a function call and a vector update
+ * operation, with minimal hardware induced runtime variation as long as
+ * the vectors stay in L1.
+ */
+KERNEL_INLINE void kernel_daxpy(struct work *w) {
+  register long long count;
+
+  for (count = w->wl; count < 0; count++)
+    daxpy(VECLEN, w->da, w->dx, 1, w->dy, 1);
+}
+
+/*
+ * SIMD daxpy: dx += da*dy over the same VECLEN doubles as daxpy, but
+ * in vectors of a fixed width rather than whatever the compiler makes
+ * of daxpy().  Wide vectors, AVX-512 especially, can drop the core's
+ * clock while they run, so these show both the cost of a frequency
+ * licence change on the measuring thread and its effect on neighbours
+ * running other kernels (see --kernel).
+ */
+#define KERNEL_SIMD(name, target, bytes)				\
+  typedef double name##_vec __attribute__((vector_size(bytes)));	\
+  KERNEL_INLINE target void kernel_##name(struct work *w) {		\
+    register long long count;						\
+    name##_vec a = (name##_vec){} + w->da;				\
+    name##_vec *x = (name##_vec *)w->dx, *y = (name##_vec *)w->dy;	\
+    int k;								\
+									\
+    for (count = w->wl; count < 0; count++)				\
+      for (k = 0; k < (int)(VECLEN*sizeof(double)/bytes); k++)		\
+	x[k] += a*y[k];							\
+  }
+
+#if defined(__x86_64__)
+KERNEL_SIMD(sse2, KERNEL_TARGET("sse2"), 16)
+KERNEL_SIMD(avx2, KERNEL_TARGET("avx2,fma"), 32)
+KERNEL_SIMD(avx512, KERNEL_TARGET("avx512f"), 64)
+#elif defined(__aarch64__)
+KERNEL_SIMD(neon, , 16)
+#endif
+
+/*
+ * Pointer chase: every iteration is a load whose address comes from the
+ * previous one.  The cycle visits each CHASE_LINE sized line of the
+ * working set once, in random order, so neither the prefetchers nor
+ * spatial locality help, and the time per sample tracks the latency of
+ * whichever level of the hierarchy the working set fits in.  The chase
+ * resumes where the last sample left it.
+ */
+KERNEL_INLINE void kernel_chase(struct work *w) {
+  register long long count;
+  register void **p = w->chase;
+
+  for (count = w->wl; count < 0; count++)
+    p = (void **)*p;
+  w->chase = p;
+}
+
+/*
+ * STREAM triad: two streams of loads and one of stores per element,
+ * bound by memory bandwidth once the three arrays leave the caches.
+ * Like the chase it wraps around the arrays, resuming where the last
+ * sample left off.
+ */
+KERNEL_INLINE void kernel_triad(struct work *w) {
+  double *a = w->ta, *b = w->tb, *c = w->tc;
+  const double scalar = 3.0;
+  size_t pos = w->tpos, len = w->tlen, n, k;
+  unsigned long long left = -w->wl;
+
+  while (left > 0) {
+    n = len - pos < left ? len - pos : left;
+    for (k = pos; k < pos + n; k++)
+      a[k] = b[k] + scalar*c[k];
+    pos += n;
+    if (pos == len)
+      pos = 0;
+    left -= n;
+  }
+  w->tpos = pos;
+}
+
+#endif /* __KERNELS_H__ */
@@ -0,0 +1,107 @@
+/*
+ * mem.c : sample buffer allocation shared by ftq and fwq.
+ *
+ * Every measuring thread allocates its own sample buffer after it has
+ * pinned itself, so that first touch places the pages on the thread's
+ * own NUMA node and no two threads' samples share a page, let alone a
+ * cache line.
+ *
+ * Licensed under the terms of the GNU Public Licence.  See LICENCE_GPL
+ * for details.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "mem.h"
+
+/* huge page size to assume if /proc/meminfo does not give one */
+#define HUGE_PAGE_DEFAULT  (2UL << 20)
+
+/*
+ * the default huge page size, which MAP_HUGETLB mappings come in whole
+ * multiples of: 2MB on x86, but 512MB on arm64 kernels with 64K pages.
+ */
+static size_t huge_page_size(void) {
+  FILE *fp = fopen("/proc/meminfo", "r");
+  char line[128];
+  unsigned long kb;
+  size_t size = HUGE_PAGE_DEFAULT;
+
+  if (fp == NULL)
+    return size;
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1 && kb > 0) {
+      size = (size_t)kb << 10;
+      break;
+    }
+  }
+  fclose(fp);
+  return size;
+}
+
+static size_t map_len(size_t len, int flags) {
+  size_t page;
+
+  if (len == 0)
+    len = 1;
+  if (flags & MEM_HUGE) {
+    page = huge_page_size();
+    len = (len + page - 1) / page * page;
+  }
+  return len;
+}
+
+/**
+ * sample_alloc() : page aligned, private, pre-faulted memory for len
+ * bytes of samples.  with MEM_HUGE, try explicit huge pages first, then
+ * fall back to normal pages with a transparent huge page hint.  with
+ * MEM_LOCK the pages are also locked, so not even reclaim can fault
+ * them out again during the run.  call from the thread that will use
+ * the memory, after setting its affinity.  returns NULL with errno set
+ * on failure; a failed mlock() is a failure.
+ */
+void *sample_alloc(size_t len, int flags) {
+  void *p = MAP_FAILED;
+  int saved;
+
+  len = map_len(len, flags);
+
+#ifdef MAP_HUGETLB
+  if (flags & MEM_HUGE)
+    p = mmap(NULL, len, PROT_READ|PROT_WRITE,
+	     MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+#endif
+  if (p == MAP_FAILED) {
+    p = mmap(NULL, len, PROT_READ|PROT_WRITE,
+	     MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+      return NULL;
+#ifdef MADV_HUGEPAGE
+    if (flags & MEM_HUGE)
+      madvise(p, len, MADV_HUGEPAGE);
+#endif
+  }
+
+  if ((flags & MEM_LOCK) && mlock(p, len) < 0) {
+    saved = errno;
+    munmap(p, len);
+    errno = saved;
+    return NULL;
+  }
+
+  /* fault every page in now, from this CPU */
+  memset(p, 0, len);
+  return p;
+}
+
+/**
+ * sample_free() : release memory from sample_alloc(), given the same
+ * len and flags.
+ */
+void sample_free(void *p, size_t len, int flags) {
+  if (p == NULL)
+    return;
+  munmap(p, map_len(len, flags));
+}
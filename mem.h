@@ -0,0 +1,19 @@
+/*
+ * mem.h : sample buffer allocation shared by ftq and fwq.
+ *
+ * Licensed under the terms of the GNU Public Licence.  See LICENCE_GPL
+ * for details.
+ */
+#ifndef __MEM_H__
+#define __MEM_H__
+
+#include <stddef.h>
+
+/* sample_alloc() flags */
+#define MEM_HUGE   0x1   /* try to use huge pages */
+#define MEM_LOCK   0x2   /* mlock() the buffer */
+
+extern void *sample_alloc(size_t len, int flags);
+extern void sample_free(void *p, size_t len, int flags);
+
+#endif /* __MEM_H__ */
@@ -0,0 +1,304 @@
+/*
+ * metrics.c : Prometheus metrics for fwq's daemon mode.
+ *
+ * Licensed under the terms of the GNU Public Licence.  See LICENCE_GPL
+ * for details.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "cpus.h"
+#include "metrics.h"
+
+/**
+ * metrics_init() : empty totals for the n measured cpus.  returns 0, or
+ * -1 if they could not be allocated.
+ */
+int metrics_init(struct metrics *m, const uint32_t *cpus, int n) {
+  int j;
+
+  memset(m, 0, sizeof(*m));
+  pthread_mutex_init(&m->lock, NULL);
+  m->n = n;
+  m->fd = -1;
+  m->cpus = calloc(n, sizeof(*m->cpus));
+  if (m->cpus == NULL)
+    return -1;
+  for (j = 0; j < n; j++)
+    m->cpus[j].cpu = cpus[j];
+  return 0;
+}
+
+/**
+ * metrics_add() : fold count samples of measured cpu j, in ticks of
+ * scale ns, and the noise events found in them into the totals.
+ */
+void metrics_add(struct metrics *m, int j, const unsigned long long *v,
+		 unsigned long count, double scale, const struct events *ev) {
+  struct metrics_cpu *c = &m->cpus[j];
+  unsigned long long hist[METRICS_BUCKETS] = { 0 }, ns;
+  double sum = 0.0;
+  unsigned long i;
+  int b;
+
+  /* bucket outside the lock, the server may be reading */
+  for (i = 0; i < count; i++) {
+    ns = v[i] * scale;
+    sum += ns;
+    for (b = 0; b < METRICS_BUCKETS; b++)
+      if (ns <= 1ULL << (b + METRICS_MIN_SHIFT)) {
+	hist[b]++;
+	break;
+      }
+  }
+
+  pthread_mutex_lock(&m->lock);
+  c->samples += count;
+  for (b = 0; b < METRICS_BUCKETS; b++)
+    c->hist[b] += hist[b];
+  c->sum_ns += sum;
+  c->noisy += ev->noisy;
+  c->events += ev->count;
+  c->excess_ns += ev->total_excess * scale;
+  c->baseline_ns = ev->baseline * scale;
+  pthread_mutex_unlock(&m->lock);
+}
+
+/**
+ * metrics_burst() : account for a burst that kept the cpus busy for
+ * busy_ns out of wall_ns, the pause after it included.
+ */
+void metrics_burst(struct metrics *m, double busy_ns, double wall_ns) {
+  pthread_mutex_lock(&m->lock);
+  m->bursts++;
+  m->busy_ns += busy_ns;
+  m->wall_ns += wall_ns;
+  pthread_mutex_unlock(&m->lock);
+}
+
+/* a growing text buffer */
+struct text {
+  char *buf;
+  size_t len, size;
+};
+
+static void put(struct text *t, const char *fmt, ...) {
+  va_list ap;
+  int n;
+  char *grown;
+
+  for (;;) {
+    va_start(ap, fmt);
+    n = vsnprintf(t->buf + t->len, t->size - t->len, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+      return;
+    if (t->len + n < t->size) {
+      t->len += n;
+      return;
+    }
+    grown = realloc(t->buf, t->size * 2 + n);
+    if (grown == NULL)
+      return;
+    t->buf = grown;
+    t->size = t->size * 2 + n;
+  }
+}
+
+/* the metrics page */
+static void render(struct metrics *m, struct text *t) {
+  struct metrics_cpu *c;
+  unsigned long long cum;
+  int j, b;
+
+  pthread_mutex_lock(&m->lock);
+  put(t, "# HELP fwq_sample_seconds Time taken by each fixed work sample.\n"
+      "# TYPE fwq_sample_seconds histogram\n");
+  for (j = 0; j < m->n; j++) {
+    c = &m->cpus[j];
+    for (b = 0, cum = 0; b < METRICS_BUCKETS; b++) {
+      cum += c->hist[b];
+      put(t, "fwq_sample_seconds_bucket{cpu=\"%u\",le=\"%g\"} %llu\n",
+	  c->cpu, (1ULL << (b + METRICS_MIN_SHIFT)) / 1e9, cum);
+    }
+    put(t, "fwq_sample_seconds_bucket{cpu=\"%u\",le=\"+Inf\"} %llu\n"
+	"fwq_sample_seconds_sum{cpu=\"%u\"} %.9f\n"
+	"fwq_sample_seconds_count{cpu=\"%u\"} %llu\n",
+	c->cpu, c->samples, c->cpu, c->sum_ns / 1e9, c->cpu, c->samples);
+  }
+
+  put(t, "# HELP fwq_noisy_samples_total Samples over the outlier limit.\n"
+      "# TYPE fwq_noisy_samples_total counter\n");
+  for (j = 0; j < m->n; j++)
+    put(t, "fwq_noisy_samples_total{cpu=\"%u\"} %llu\n", m->cpus[j].cpu,
+	m->cpus[j].noisy);
+  put(t, "# HELP fwq_noise_events_total Runs of consecutive noisy "
+      "samples.\n# TYPE fwq_noise_events_total counter\n");
+  for (j = 0; j < m->n; j++)
+    put(t, "fwq_noise_events_total{cpu=\"%u\"} %llu\n", m->cpus[j].cpu,
+	m->cpus[j].events);
+  put(t, "# HELP fwq_noise_excess_seconds_total Time noisy samples took "
+      "over the baseline.\n# TYPE fwq_noise_excess_seconds_total counter\n");
+  for (j = 0; j < m->n; j++)
+    put(t, "fwq_noise_excess_seconds_total{cpu=\"%u\"} %.9f\n",
+	m->cpus[j].cpu, m->cpus[j].excess_ns / 1e9);
+  put(t, "# HELP fwq_baseline_seconds Noise free sample time in the last "
+      "burst.\n# TYPE fwq_baseline_seconds gauge\n");
+  for (j = 0; j < m->n; j++)
+    put(t, "fwq_baseline_seconds{cpu=\"%u\"} %.9f\n", m->cpus[j].cpu,
+	m->cpus[j].baseline_ns / 1e9);
+
+  put(t, "# HELP fwq_bursts_total Sampling bursts completed.\n"
+      "# TYPE fwq_bursts_total counter\n"
+      "fwq_bursts_total %llu\n"
+      "# HELP fwq_busy_seconds_total Time each measured CPU spent in "
+      "bursts.\n# TYPE fwq_busy_seconds_total counter\n"
+      "fwq_busy_seconds_total %.6f\n"
+      "# HELP fwq_duty_cycle_ratio Fraction of the time the measured CPUs "
+      "were busy.\n# TYPE fwq_duty_cycle_ratio gauge\n"
+      "fwq_duty_cycle_ratio %.6f\n",
+      m->bursts, m->busy_ns / 1e9,
+      m->wall_ns > 0 ? m->busy_ns / m->wall_ns : 0.0);
+  pthread_mutex_unlock(&m->lock);
+}
+
+/* write all of len bytes, or give up.  a client that goes away early
+   must not take the daemon down with SIGPIPE. */
+static void send_all(int fd, const char *buf, size_t len) {
+  ssize_t n;
+
+  while (len > 0) {
+    n = send(fd, buf, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return;
+    buf += n;
+    len -= n;
+  }
+}
+
+/* answer one request on fd */
+static void serve(struct metrics *m, int fd) {
+  struct timeval tv = { METRICS_TIMEOUT_S, 0 };
+  struct text body = { NULL, 0, 0 };
+  char req[METRICS_REQUEST], head[256];
+  size_t len = 0;
+  ssize_t n;
+  int hn;
+
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  /* only the request line matters, but read the headers so closing
+     does not reset the connection */
+  while (len < sizeof(req) - 1) {
+    n = read(fd, req + len, sizeof(req) - 1 - len);
+    if (n <= 0)
+      break;
+    len += n;
+    req[len] = '\0';
+    if (strstr(req, "\r\n\r\n") != NULL || strstr(req, "\n\n") != NULL)
+      break;
+  }
+  req[len] = '\0';
+
+  if (strncmp(req, "GET /metrics ", 13) == 0 ||
+      strncmp(req, "GET /metrics?", 13) == 0) {
+    body.size = 4096;
+    body.buf = malloc(body.size);
+    if (body.buf == NULL)
+      return;
+    render(m, &body);
+    hn = snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\n"
+		  "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+		  "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+		  body.len);
+    send_all(fd, head, hn);
+    send_all(fd, body.buf, body.len);
+    free(body.buf);
+  } else {
+    hn = snprintf(head, sizeof(head), "HTTP/1.0 404 Not Found\r\n"
+		  "Content-Type: text/plain\r\nContent-Length: 17\r\n"
+		  "Connection: close\r\n\r\ntry GET /metrics\n");
+    send_all(fd, head, hn);
+  }
+}
+
+/*
+ * server thread: answer one connection at a time for as long as the
+ * daemon runs.
+ */
+static void *metrics_server(void *arg) {
+  struct metrics *m = arg;
+  struct timespec backoff = { 0, METRICS_BACKOFF_NS };
+  int fd;
+
+  housekeeping_thread(m->cpu, "metrics server");
+
+  for (;;) {
+    fd = accept(m->fd, NULL, NULL);
+    if (fd < 0) {
+      /* out of descriptors or memory will not clear up at once */
+      if (errno != EINTR && errno != ECONNABORTED)
+	nanosleep(&backoff, NULL);
+      continue;
+    }
+    serve(m, fd);
+    close(fd);
+  }
+  return NULL;
+}
+
+/**
+ * metrics_listen() : listen on addr, "port" or "ipv4:port", the former
+ * on METRICS_ADDR only.  returns 0, or -1 with errno set.
+ */
+int metrics_listen(struct metrics *m, const char *addr) {
+  struct sockaddr_in sa;
+  char host[64];
+  const char *colon = strrchr(addr, ':');
+  char *end;
+  unsigned long port;
+  int one = 1;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  snprintf(host, sizeof(host), "%.*s",
+	   colon ? (int)(colon - addr) : (int)strlen(METRICS_ADDR),
+	   colon ? addr : METRICS_ADDR);
+  port = strtoul(colon ? colon + 1 : addr, &end, 10);
+  if (*end != '\0' || port == 0 || port > 65535 ||
+      inet_pton(AF_INET, host, &sa.sin_addr) != 1) {
+    errno = EINVAL;
+    return -1;
+  }
+  sa.sin_port = htons(port);
+
+  m->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (m->fd < 0)
+    return -1;
+  setsockopt(m->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (bind(m->fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+      listen(m->fd, 16) < 0) {
+    close(m->fd);
+    m->fd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * metrics_start() : start the server thread.  returns 0 or an errno.
+ */
+int metrics_start(struct metrics *m) {
+  return pthread_create(&m->server, NULL, metrics_server, m);
+}
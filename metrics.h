@@ -0,0 +1,75 @@
+/*
+ * metrics.h : Prometheus metrics for fwq's daemon mode (--daemon).
+ *
+ * In daemon mode fwq keeps taking short bursts of samples on the
+ * measured CPUs and sleeping in between, so that the CPUs are busy for
+ * only the requested fraction of the time.  The measuring threads are
+ * set up once and reuse their sample buffers for every burst, and after
+ * each burst the samples are folded into fixed size per-CPU totals, so
+ * memory does not grow however long the daemon runs.  A server thread
+ * on the housekeeping CPU answers "GET /metrics" with the totals in
+ * the Prometheus text exposition format:
+ *
+ *   fwq_sample_seconds            histogram of sample times, power of
+ *                                 two buckets from 2^METRICS_MIN_SHIFT ns
+ *   fwq_noisy_samples_total       samples over the outlier limit
+ *   fwq_noise_events_total        runs of consecutive noisy samples
+ *   fwq_noise_excess_seconds_total  time the noisy samples took over
+ *                                 the baseline
+ *   fwq_baseline_seconds          noise free sample time, from warm-up
+ *
+ * all labelled with cpu, and fwq_bursts_total, fwq_busy_seconds_total
+ * and fwq_duty_cycle_ratio for the daemon itself.
+ *
+ * Licensed under the terms of the GNU Public Licence.  See LICENCE_GPL
+ * for details.
+ */
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include "events.h"
+
+/* histogram buckets: le 2^METRICS_MIN_SHIFT ns (1us) ... 2^30 ns (1s),
+   then +Inf */
+#define METRICS_MIN_SHIFT  10
+#define METRICS_BUCKETS    21
+/* default listen address */
+#define METRICS_ADDR       "127.0.0.1"
+/* longest request read, and how long a client gets to send it */
+#define METRICS_REQUEST    4096
+#define METRICS_TIMEOUT_S  2
+/* pause after accept() fails for want of descriptors or memory */
+#define METRICS_BACKOFF_NS 100000000
+
+struct metrics_cpu {
+  uint32_t cpu;
+  unsigned long long samples;
+  unsigned long long hist[METRICS_BUCKETS];  /* not cumulative */
+  double sum_ns;
+  unsigned long long noisy, events;
+  double excess_ns;
+  double baseline_ns;
+};
+
+struct metrics {
+  pthread_mutex_t lock;
+  int n;
+  struct metrics_cpu *cpus;
+  unsigned long long bursts;
+  double busy_ns, wall_ns;
+  int fd;                       /* listening socket */
+  int cpu;                      /* housekeeping CPU, -1 to leave unpinned */
+  pthread_t server;
+};
+
+extern int metrics_init(struct metrics *m, const uint32_t *cpus, int n);
+extern void metrics_add(struct metrics *m, int j, const unsigned long long *v,
+			unsigned long count, double scale,
+			const struct events *ev);
+extern void metrics_burst(struct metrics *m, double busy_ns, double wall_ns);
+extern int metrics_listen(struct metrics *m, const char *addr);
+extern int metrics_start(struct metrics *m);
+
+#endif /* __METRICS_H__ */
@@ -0,0 +1,487 @@
+/*
+ * output.c : sample output routines shared by ftq and fwq.
+ *
+ * Licensed under the terms of the GNU Public Licence.  See LICENCE_GPL
+ * for details.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "output.h"
+
+#ifdef _WITH_PTHREADS_
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/* longest formatted value: sign, 19 digits, newline */
+#define TEXT_MAXLEN    24
+
+static const char digit_pairs[] =
+  "00010203040506070809"
+  "10111213141516171819"
+  "20212223242526272829"
+  "30313233343536373839"
+  "40414243444546474849"
+  "50515253545556575859"
+  "60616263646566676869"
+  "70717273747576777879"
+  "80818283848586878889"
+  "90919293949596979899";
+
+/**
+ * parse_format() : map a --format argument to FORMAT_*, -1 if unknown.
+ */
+int parse_format(const char *name) {
+  if (strcmp(name, "text") == 0)
+    return FORMAT_TEXT;
+  if (strcmp(name, "bin") == 0)
+    return FORMAT_BIN;
+  return -1;
+}
+
+/**
+ * sample_fname() : name of thread's text file for column suffix,
+ * <outname>_<thread>_<suffix>.dat.  when cpus is given the thread's CPU
+ * goes in the name too, <outname>_<thread>_cpu<N>_<suffix>.dat, so files
+ * from runs placed on different CPUs cannot be mixed up.
+ */
+void sample_fname(char *buf, size_t len, const char *outname, int thread,
+		  const uint32_t *cpus, const char *suffix) {
+  if (cpus != NULL && cpus[thread] != FTQ_CPU_NONE)
+    snprintf(buf, len, "%s_%d_cpu%u_%s.dat", outname, thread, cpus[thread],
+	     suffix);
+  else
+    snprintf(buf, len, "%s_%d_%s.dat", outname, thread, suffix);
+}
+
+/**
+ * write_all() : write() that retries on short writes and EINTR.
+ */
+int write_all(int fd, const void *buf, size_t len) {
+  const char *p = buf;
+  ssize_t rc;
+
+  while (len > 0) {
+    rc = write(fd, p, len);
+    if (rc < 0) {
+      if (errno == EINTR)
+	continue;
+      return -1;
+    }
+    p += rc;
+    len -= rc;
+  }
+  return 0;
+}
+
+/**
+ * pwrite_all() : pwrite() that retries on short writes and EINTR.
+ */
+int pwrite_all(int fd, const void *buf, size_t len, off_t off) {
+  const char *p = buf;
+  ssize_t rc;
+
+  while (len > 0) {
+    rc = pwrite(fd, p, len, off);
+    if (rc < 0) {
+      if (errno == EINTR)
+	continue;
+      return -1;
+    }
+    p += rc;
+    off += rc;
+    len -= rc;
+  }
+  return 0;
+}
+
+/*
+ * writev() every iovec in full.  the kernel is free to stop part way
+ * through a vector (and caps a single call at IOV_MAX entries and about
+ * 2GB), so advance through the array until everything is out.
+ */
+static int writev_all(int fd, struct iovec *iov, int cnt) {
+  ssize_t rc;
+
+  while (cnt > 0) {
+    rc = writev(fd, iov, cnt > IOV_MAX ? IOV_MAX : cnt);
+    if (rc < 0) {
+      if (errno == EINTR)
+	continue;
+      return -1;
+    }
+    while (cnt > 0 && (size_t)rc >= iov->iov_len) {
+      rc -= iov->iov_len;
+      iov++;
+      cnt--;
+    }
+    if (cnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + rc;
+      iov->iov_len -= rc;
+    }
+  }
+  return 0;
+}
+
+/**
+ * ftq_bin_init() : fill in a header for numthreads threads of
+ * numsamples samples each.  callers may set bits, quantum and tick_unit
+ * afterwards.
+ */
+void ftq_bin_init(struct ftq_bin_header *h, uint32_t kind,
+		  uint32_t numthreads, uint64_t numsamples,
+		  uint32_t sample_words) {
+  uint64_t end;
+
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, FTQ_BIN_MAGIC, sizeof(h->magic));
+  h->version = FTQ_BIN_VERSION;
+  h->header_size = sizeof(*h);
+  h->kind = kind;
+  h->tick_unit = FTQ_TICK_CYCLES;
+  h->numthreads = numthreads;
+  h->numsamples = numsamples;
+  h->sample_words = sample_words;
+  h->cpu_offset = sizeof(*h);
+  h->start_offset = h->cpu_offset + (uint64_t)numthreads * sizeof(uint32_t);
+  h->start_offset = (h->start_offset + 7) & ~(uint64_t)7;
+  h->quantum_offset = h->start_offset + (uint64_t)numthreads * sizeof(uint64_t);
+
+  end = h->quantum_offset + (uint64_t)numthreads * sizeof(uint64_t);
+  h->data_offset = (end + FTQ_BIN_ALIGN - 1) & ~(uint64_t)(FTQ_BIN_ALIGN - 1);
+}
+
+/**
+ * ftq_bin_set_side() : add side_words 32 bit words of side data per
+ * sample, placed after all of the samples.
+ */
+void ftq_bin_set_side(struct ftq_bin_header *h, uint32_t side_words) {
+  uint64_t end;
+
+  h->side_words = side_words;
+  if (side_words == 0) {
+    h->side_offset = 0;
+    return;
+  }
+  end = h->data_offset + (uint64_t)h->numthreads * h->numsamples *
+    h->sample_words * sizeof(unsigned long long);
+  h->side_offset = (end + FTQ_BIN_ALIGN - 1) & ~(uint64_t)(FTQ_BIN_ALIGN - 1);
+}
+
+/*
+ * build the header, per-thread tables and padding that precede the
+ * samples.  starts and quanta may be NULL if they were not recorded.
+ */
+static char *bin_head(const struct ftq_bin_header *h, const uint32_t *cpus,
+		      const unsigned long long *starts,
+		      const unsigned long long *quanta) {
+  char *head;
+
+  head = calloc(1, h->data_offset);
+  if (head == NULL)
+    return NULL;
+  memcpy(head, h, sizeof(*h));
+  memcpy(head + h->cpu_offset, cpus, h->numthreads * sizeof(uint32_t));
+  if (starts != NULL)
+    memcpy(head + h->start_offset, starts,
+	   h->numthreads * sizeof(*starts));
+  if (quanta != NULL)
+    memcpy(head + h->quantum_offset, quanta,
+	   h->numthreads * sizeof(*quanta));
+  return head;
+}
+
+/**
+ * ftq_write_bin_header() : write everything up to data_offset, for
+ * writers that fill in the samples themselves.  may be called again
+ * once more of the header is known.
+ */
+int ftq_write_bin_header(int fd, const struct ftq_bin_header *h,
+			 const uint32_t *cpus, const unsigned long long *starts,
+			 const unsigned long long *quanta) {
+  char *head;
+  int rc, saved;
+
+  head = bin_head(h, cpus, starts, quanta);
+  if (head == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+  rc = pwrite_all(fd, head, h->data_offset, 0);
+  saved = errno;
+  free(head);
+  errno = saved;
+  return rc;
+}
+
+/**
+ * ftq_write_bin() : write a complete binary sample file to fd.  bufs[j]
+ * points at thread j's numsamples*sample_words words and, if the header
+ * has side data, sides[j] at its numsamples*side_words side words.
+ * starts and quanta may be NULL.  everything goes out in a single
+ * gathered write.
+ * returns 0, or -1 with errno set.
+ */
+int ftq_write_bin(int fd, const struct ftq_bin_header *h,
+		  const uint32_t *cpus, const unsigned long long *starts,
+		  const unsigned long long *quanta,
+		  unsigned long long *const *bufs,
+		  uint32_t *const *sides) {
+  static const char zeros[FTQ_BIN_ALIGN];
+  struct iovec *iov;
+  char *head;
+  uint32_t j;
+  int n = 0, rc, saved;
+  uint64_t end;
+
+  head = bin_head(h, cpus, starts, quanta);
+  iov = malloc(sizeof(*iov) * (h->numthreads * 2 + 2));
+  if (head == NULL || iov == NULL) {
+    free(head);
+    free(iov);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  iov[n].iov_base = head;
+  iov[n++].iov_len = h->data_offset;
+  for (j = 0; j < h->numthreads; j++) {
+    iov[n].iov_base = bufs[j];
+    iov[n++].iov_len = h->numsamples * h->sample_words *
+      sizeof(unsigned long long);
+  }
+  if (h->side_words > 0) {
+    end = h->data_offset + (uint64_t)h->numthreads * h->numsamples *
+      h->sample_words * sizeof(unsigned long long);
+    iov[n].iov_base = (void *)zeros;
+    iov[n++].iov_len = h->side_offset - end;
+    for (j = 0; j < h->numthreads; j++) {
+      iov[n].iov_base = sides[j];
+      iov[n++].iov_len = h->numsamples * h->side_words * sizeof(uint32_t);
+    }
+  }
+
+  rc = writev_all(fd, iov, n);
+  saved = errno;
+  free(head);
+  free(iov);
+  errno = saved;
+  return rc;
+}
+
+/**
+ * format_lld() : format v in decimal at p, exactly as "%lld" would,
+ * and return a pointer just past the last digit.  no terminator is
+ * written.  two digits per division keeps this several times cheaper
+ * than sprintf().
+ */
+char *format_lld(char *p, long long v) {
+  char tmp[20], *t = tmp + sizeof(tmp);
+  unsigned long long u;
+  unsigned r;
+  size_t len;
+
+  if (v < 0) {
+    *p++ = '-';
+    u = -(unsigned long long)v;
+  } else {
+    u = v;
+  }
+
+  while (u >= 100) {
+    r = u % 100;
+    u /= 100;
+    t -= 2;
+    memcpy(t, digit_pairs + r*2, 2);
+  }
+  if (u >= 10) {
+    t -= 2;
+    memcpy(t, digit_pairs + u*2, 2);
+  } else {
+    *--t = '0' + u;
+  }
+
+  len = tmp + sizeof(tmp) - t;
+  memcpy(p, t, len);
+  return p + len;
+}
+
+/*
+ * the formatter behind both column writers: v holds values of size
+ * bytes, 64 bit words printed signed or 32 bit side words printed
+ * unsigned.
+ */
+static int write_column(int fd, const void *v, size_t size,
+			unsigned long count, unsigned long stride, char *buf) {
+  const char *q = v;
+  char *p = buf, *end = buf + TEXT_BUFSIZE - TEXT_MAXLEN;
+  unsigned long i;
+
+  for (i = 0; i < count; i++, q += stride * size) {
+    if (size == sizeof(uint32_t))
+      p = format_lld(p, *(const uint32_t *)q);
+    else
+      p = format_lld(p, (long long)*(const unsigned long long *)q);
+    *p++ = '\n';
+    if (p >= end) {
+      if (write_all(fd, buf, p - buf) < 0)
+	return -1;
+      p = buf;
+    }
+  }
+  if (p > buf && write_all(fd, buf, p - buf) < 0)
+    return -1;
+  return 0;
+}
+
+/**
+ * write_text_column() : format count values, taken every stride words
+ * from v, one per line, and write them to fd.  buf is caller supplied
+ * scratch of TEXT_BUFSIZE bytes.  returns 0, or -1 with errno set.
+ */
+int write_text_column(int fd, const unsigned long long *v,
+		      unsigned long count, unsigned long stride, char *buf) {
+  return write_column(fd, v, sizeof(*v), count, stride, buf);
+}
+
+/**
+ * write_text_column32() : write_text_column() for 32 bit side words.
+ */
+int write_text_column32(int fd, const uint32_t *v,
+			unsigned long count, unsigned long stride, char *buf) {
+  return write_column(fd, v, sizeof(*v), count, stride, buf);
+}
+
+/*
+ * open, format and close one job's file.
+ */
+static void write_text_job(struct text_job *job, char *buf) {
+  int fd;
+
+  fd = open(job->fname, O_CREAT|O_TRUNC|O_WRONLY, 0644);
+  if (fd < 0) {
+    job->err = errno;
+    return;
+  }
+  if ((job->base32 != NULL ?
+       write_text_column32(fd, job->base32, job->count, job->stride, buf) :
+       write_text_column(fd, job->base, job->count, job->stride, buf)) < 0) {
+    job->err = errno;
+    close(fd);
+    return;
+  }
+  if (close(fd) < 0)
+    job->err = errno;
+}
+
+#ifdef _WITH_PTHREADS_
+struct text_pool {
+  struct text_job *jobs;
+  int njobs;
+  int next;
+};
+
+/*
+ * writer thread: claim jobs until there are none left.  the thread
+ * that spawned us is usually pinned to a single CPU, so let the
+ * writers run anywhere.
+ */
+static void *text_writer(void *arg) {
+  struct text_pool *pool = arg;
+  long ncpus = sysconf(_SC_NPROCESSORS_CONF);
+  cpu_set_t *set;
+  size_t size;
+  char *buf;
+  int j;
+
+  set = CPU_ALLOC(ncpus);
+  if (set != NULL) {
+    size = CPU_ALLOC_SIZE(ncpus);
+    CPU_ZERO_S(size, set);
+    for (j = 0; j < ncpus; j++)
+      CPU_SET_S(j, size, set);
+    sched_setaffinity(0, size, set);
+    CPU_FREE(set);
+  }
+
+  buf = malloc(TEXT_BUFSIZE);
+  while ((j = __sync_fetch_and_add(&pool->next, 1)) < pool->njobs) {
+    if (buf == NULL)
+      pool->jobs[j].err = ENOMEM;
+    else
+      write_text_job(&pool->jobs[j], buf);
+  }
+  free(buf);
+  return NULL;
+}
+#endif /* _WITH_PTHREADS_ */
+
+/**
+ * ftq_write_text() : write every job's text file.  with pthreads there
+ * is one writer thread per file (up to the number of online CPUs).
+ * returns 0, or -1 with errno set from the first failing job; the
+ * failing file can be found from the job's err field.
+ */
+int ftq_write_text(struct text_job *jobs, int njobs) {
+  int j;
+#ifdef _WITH_PTHREADS_
+  struct text_pool pool;
+  pthread_t *writers;
+  long nwriters = sysconf(_SC_NPROCESSORS_ONLN);
+  int started = 0;
+
+  if (nwriters > njobs)
+    nwriters = njobs;
+  if (nwriters > 1) {
+    pool.jobs = jobs;
+    pool.njobs = njobs;
+    pool.next = 0;
+    writers = malloc(sizeof(*writers) * nwriters);
+    if (writers != NULL) {
+      /* the threads share the job list, so any that did start will
+	 drain all of it */
+      for (started = 0; started < nwriters; started++)
+	if (pthread_create(&writers[started], NULL, text_writer, &pool))
+	  break;
+      for (j = 0; j < started; j++)
+	pthread_join(writers[j], NULL);
+      free(writers);
+    }
+    if (started > 0)
+      goto done;
+  }
+#endif /* _WITH_PTHREADS_ */
+  {
+    char *buf = malloc(TEXT_BUFSIZE);
+
+    if (buf == NULL) {
+      errno = ENOMEM;
+      return -1;
+    }
+    for (j = 0; j < njobs; j++)
+      write_text_job(&jobs[j], buf);
+    free(buf);
+  }
+
+#ifdef _WITH_PTHREADS_
+ done:
+#endif
+  for (j = 0; j < njobs; j++) {
+    if (jobs[j].err) {
+      errno = jobs[j].err;
+      return -1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,169 @@
+/*
+ * output.h : sample output routines shared by ftq and fwq.
+ *
+ * Licensed under the terms of the GNU Public Licence.  See LICENCE_GPL
+ * for details.
+ */
+#ifndef __OUTPUT_H__
+#define __OUTPUT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * binary sample file (--format=bin)
+ *
+ * One file per run, laid out so that post-processing tools can mmap()
+ * it and use the sample arrays in place:
+ *
+ *   offset 0            struct ftq_bin_header
+ *   cpu_offset          uint32_t cpu[numthreads]  (FTQ_CPU_NONE if unpinned)
+ *   start_offset        uint64_t start[numthreads] (tick at which each
+ *                       thread began sampling, 0 if not recorded)
+ *   quantum_offset      uint64_t quantum[numthreads] (each thread's
+ *                       work_length, 0 if not recorded)
+ *   data_offset         thread 0 samples, thread 1 samples, ...
+ *   side_offset         thread 0 side data, thread 1 side data, ...
+ *
+ * Each thread contributes numsamples * sample_words native-endian 64 bit
+ * words, in exactly the layout the benchmark keeps in memory: fwq stores
+ * one elapsed tick count per sample, ftq stores (start tick, work count)
+ * pairs.  data_offset is page aligned.
+ *
+ * Optional per-sample side data (side_words > 0) follows as
+ * numsamples * side_words 32 bit words per thread, again sample-major.
+ * With FTQ_FLAG_GAPS set the first side word of each sample is the
+ * gap in ticks between the end of the previous sample (or the thread's
+ * start tick) and the start of this one, saturated at UINT32_MAX, so
+ * sample i started at
+ *
+ *   start[thread] + sum(elapsed[0..i-1]) + sum(gap[0..i])
+ *
+ * With FTQ_FLAG_COUNTERS set the next side words (all of them, after
+ * the gap if there is one) are fwq's per-sample performance counter
+ * deltas, in the order of PMC_COUNTERS in pmc.h.  counters has bit i set
+ * for each counter every thread could open (the others are 0), and
+ * counters_fast for each one read after every sample; the rest are
+ * only read after slow samples, are 0 for the others, and count since
+ * the previous slow sample.  Every counter is read after the sample,
+ * so its delta includes the untimed gap before the sample too.
+ *
+ * clock_ticks/clock_ns, when non-zero, are two (tick, CLOCK_MONOTONIC
+ * nanoseconds) pairs taken at the start and end of the run, for
+ * converting ticks to a time base shared with perf and ftrace.
+ *
+ * ns_per_tick and tick_err_ppm (IEEE doubles) are the calibration of
+ * the tick counter against CLOCK_MONOTONIC_RAW at the start of the run,
+ * 0 if none was done.  timer names the way samples were timed (fwq
+ * --timer); with tick_unit FTQ_TICK_NS, ns_per_tick is 1.
+ *
+ * target_ns is non-zero when fwq calibrated each thread's work quantum
+ * to take that long (--target-us).  the quanta then differ per thread,
+ * so the header quantum is 0 and the quantum table has the counts.
+ *
+ * Readers must check magic and version, and should use
+ * header_size/cpu_offset/data_offset rather than sizeof() so that later
+ * versions can grow the header.  Reserved fields are zero.
+ * FTQ_BIN_VERSION goes up with every layout change.
+ */
+#define FTQ_BIN_MAGIC    "FTQBIN\0\0"
+#define FTQ_BIN_VERSION  7
+#define FTQ_BIN_ALIGN    4096
+#define FTQ_CPU_NONE     0xffffffffU
+
+/* which benchmark produced the file */
+#define FTQ_BIN_FWQ      1
+#define FTQ_BIN_FTQ      2
+
+/* header flags */
+#define FTQ_FLAG_GAPS    0x1 /* side word 0 is the gap before each sample */
+#define FTQ_FLAG_COUNTERS 0x2 /* counter deltas follow in the side words */
+
+/* unit of the tick values */
+#define FTQ_TICK_CYCLES  0   /* raw getticks() units */
+#define FTQ_TICK_NS      1   /* nanoseconds */
+
+struct ftq_bin_header {
+  char     magic[8];
+  uint32_t version;
+  uint32_t header_size;   /* sizeof(struct ftq_bin_header) when written */
+  uint32_t kind;          /* FTQ_BIN_FWQ or FTQ_BIN_FTQ */
+  uint32_t tick_unit;     /* FTQ_TICK_* */
+  uint32_t bits;          /* work_bits (fwq) or interval_bits (ftq) */
+  uint32_t numthreads;
+  uint64_t numsamples;    /* samples per thread */
+  uint64_t quantum;       /* work_length (fwq) or interval_length (ftq) */
+  uint32_t sample_words;  /* 64 bit words per sample */
+  uint32_t cpu_offset;
+  uint64_t data_offset;
+  uint64_t start_offset;
+  uint64_t side_offset;   /* 0 if there is no side data */
+  uint32_t side_words;    /* 32 bit side words per sample */
+  uint32_t flags;
+  uint64_t clock_ticks[2];
+  uint64_t clock_ns[2];
+  uint64_t quantum_offset;
+  uint64_t target_ns;     /* calibrated sample duration, 0 if none */
+  double   ns_per_tick;
+  double   tick_err_ppm;
+  char     timer[16];     /* how samples were timed, see timer.h */
+  uint32_t counters;      /* FTQ_FLAG_COUNTERS: counters present */
+  uint32_t counters_fast; /* ... and read after every sample */
+  uint64_t reserved[1];
+};
+
+/* output formats selected with --format */
+#define FORMAT_TEXT      0
+#define FORMAT_BIN       1
+
+extern int parse_format(const char *name);
+extern void sample_fname(char *buf, size_t len, const char *outname,
+			 int thread, const uint32_t *cpus, const char *suffix);
+
+extern void ftq_bin_init(struct ftq_bin_header *h, uint32_t kind,
+			 uint32_t numthreads, uint64_t numsamples,
+			 uint32_t sample_words);
+extern void ftq_bin_set_side(struct ftq_bin_header *h, uint32_t side_words);
+extern int ftq_write_bin_header(int fd, const struct ftq_bin_header *h,
+				const uint32_t *cpus,
+				const unsigned long long *starts,
+				const unsigned long long *quanta);
+extern int ftq_write_bin(int fd, const struct ftq_bin_header *h,
+			 const uint32_t *cpus, const unsigned long long *starts,
+			 const unsigned long long *quanta,
+			 unsigned long long *const *bufs,
+			 uint32_t *const *sides);
+extern int write_all(int fd, const void *buf, size_t len);
+extern int pwrite_all(int fd, const void *buf, size_t len, off_t off);
+
+/**
+ * text sample files (--format=text)
+ *
+ * One job per output file: count values, taken every stride words
+ * starting at base, each printed as a signed decimal followed by a
+ * newline (byte for byte what printf("%lld\n") produces).  Jobs that
+ * set base32 instead print 32 bit side words, unsigned.
+ */
+struct text_job {
+  char fname[1024];
+  const unsigned long long *base;
+  const uint32_t *base32;
+  unsigned long count;
+  unsigned long stride;
+  int err;                /* errno of the failure, 0 on success */
+};
+
+/* formatting buffer size for write_text_column() */
+#define TEXT_BUFSIZE     (1 << 20)
+
+extern char *format_lld(char *p, long long v);
+extern int write_text_column(int fd, const unsigned long long *v,
+			     unsigned long count, unsigned long stride,
+			     char *buf);
+extern int write_text_column32(int fd, const uint32_t *v,
+			       unsigned long count, unsigned long stride,
+			       char *buf);
+extern int ftq_write_text(struct text_job *jobs, int njobs);
+
+#endif /* __OUTPUT_H__ */
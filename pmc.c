@@ -0,0 +1,171 @@
+/*
+ * pmc.c : per-sample performance counters for fwq.
+ *
+ * Licensed under the terms of the GNU Public Licence.  See LICENCE_GPL
+ * for details.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "pmc.h"
+
+const char *const pmc_names[NUM_PMC] = {
+#define X(name, type, config)  #name,
+  PMC_COUNTERS(X)
+#undef X
+};
+
+static const struct {
+  uint32_t type;
+  uint64_t config;
+} pmc_events[NUM_PMC] = {
+#define X(name, type, config)  { type, config },
+  PMC_COUNTERS(X)
+#undef X
+};
+
+/* one counter on the calling thread, any CPU */
+static int pmc_event_open(int i, int kernel) {
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = pmc_events[i].type;
+  attr.config = pmc_events[i].config;
+  attr.exclude_kernel = !kernel;
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* open every counter, counting the kernel or not.  returns -1 if that
+   was not allowed for any of them. */
+static int pmc_open_all(struct pmc *p, int kernel) {
+  long pagesize = sysconf(_SC_PAGESIZE);
+  int i, denied = 0;
+
+  memset(p, 0, sizeof(*p));
+  p->kernel = kernel;
+  for (i = 0; i < NUM_PMC; i++) {
+    p->fd[i] = pmc_event_open(i, kernel);
+    if (p->fd[i] < 0) {
+      denied |= errno == EACCES || errno == EPERM;
+      continue;
+    }
+    p->mask |= 1U << i;
+#if defined(__x86_64__) || defined(__i386__)
+    if (pmc_events[i].type == PERF_TYPE_HARDWARE) {
+      void *page = mmap(NULL, pagesize, PROT_READ, MAP_SHARED, p->fd[i], 0);
+
+      if (page != MAP_FAILED) {
+	p->page[i] = page;
+	if (p->page[i]->cap_user_rdpmc && p->page[i]->pmc_width > 0)
+	  p->fast |= 1U << i;
+      }
+    }
+#endif
+  }
+  return denied ? -1 : 0;
+}
+
+/**
+ * pmc_open() : open the counters for the calling thread, counting
+ * kernel time too if perf_event_paranoid allows, and user time only
+ * (for every counter, so they stay comparable) if not.  call it after
+ * the thread is pinned.  counters this machine does not have (hardware
+ * counters in most virtual machines) are left out of p->mask.  returns
+ * the number of counters opened.
+ */
+int pmc_open(struct pmc *p) {
+  if (pmc_open_all(p, 1) < 0) {
+    pmc_close(p);
+    pmc_open_all(p, 0);
+  }
+  return __builtin_popcount(p->mask);
+}
+
+/**
+ * pmc_close() : release the counters.
+ */
+void pmc_close(struct pmc *p) {
+  long pagesize = sysconf(_SC_PAGESIZE);
+  int i;
+
+  for (i = 0; i < NUM_PMC; i++) {
+    if (p->page[i] != NULL)
+      munmap(p->page[i], pagesize);
+    if (p->fd[i] >= 0)
+      close(p->fd[i]);
+  }
+  memset(p, 0, sizeof(*p));
+}
+
+/**
+ * pmc_prime() : read every counter, so that the first sample's deltas
+ * start from here.
+ */
+void pmc_prime(struct pmc *p) {
+  uint32_t side[NUM_PMC];
+
+  pmc_sample(p, side, 1);
+}
+
+/**
+ * pmc_stats_add() : add count samples v and the counter deltas that go
+ * with them, side[0..NUM_PMC-1] every side_words words, to ps.
+ */
+void pmc_stats_add(struct pmc_stats *ps, const unsigned long long *v,
+		   const uint32_t *side, unsigned long count,
+		   int side_words) {
+  unsigned long k;
+  int i, slow;
+
+  for (k = 0; k < count; k++, side += side_words) {
+    slow = v[k] > ps->limit;
+    ps->n[slow]++;
+    ps->ticks[slow] += v[k];
+    for (i = 0; i < NUM_PMC; i++)
+      ps->sum[slow][i] += side[i];
+  }
+}
+
+/**
+ * pmc_print_header() : column headings for pmc_stats_print().
+ */
+void pmc_print_header(FILE *fp) {
+  int i;
+
+  fprintf(fp, "# counters per sample, quiet and slow (over the outlier "
+	  "limit) samples\n");
+  fprintf(fp, "# %-12s %12s %12s %8s", "thread", "n", "ns", "GHz");
+  for (i = 0; i < NUM_PMC; i++)
+    fprintf(fp, " %12s", pmc_names[i]);
+  fprintf(fp, "\n");
+}
+
+/**
+ * pmc_stats_print() : mean counts per quiet and per slow sample.  GHz
+ * is cycles per ns of sample time; scale converts ticks to ns.
+ */
+void pmc_stats_print(FILE *fp, const char *label, const struct pmc_stats *ps,
+		     double scale) {
+  static const char *const cls[2] = { "quiet", "slow" };
+  char name[64];
+  double ns;
+  int c, i;
+
+  for (c = 0; c < 2; c++) {
+    snprintf(name, sizeof(name), "%s %s", label, cls[c]);
+    if (ps->n[c] == 0) {
+      fprintf(fp, "  %-12s %12d\n", name, 0);
+      continue;
+    }
+    ns = ps->ticks[c] * scale / ps->n[c];
+    fprintf(fp, "  %-12s %12llu %12.0f %8.3f", name, ps->n[c], ns,
+	    ns > 0 ? (double)ps->sum[c][PMC_cycles] / ps->n[c] / ns : 0.0);
+    for (i = 0; i < NUM_PMC; i++)
+      fprintf(fp, " %12.1f", (double)ps->sum[c][i] / ps->n[c]);
+    fprintf(fp, "\n");
+  }
+}
@@ -0,0 +1,137 @@
+/*
+ * pmc.h : per-sample performance counters for fwq (--counters).
+ *
+ * Each measuring thread opens its own perf_event_open() counters on
+ * itself.  After every sample the counters are read and their deltas
+ * since the previous read stored as 32 bit side words next to the
+ * sample, so a slow sample can be put down to an interrupt (extra
+ * cycles and instructions, kernel included), being switched out
+ * (context switches), page faults, cache misses or a frequency drop
+ * (fewer cycles per ns) without a second run.
+ *
+ * Hardware counters are read with rdpmc from the counter's mmap()ed
+ * control page, which costs a few tens of cycles and no system call.
+ * Software counters (and hardware counters where rdpmc is not allowed)
+ * can only be read with read(); they are read only after samples
+ * slower than the outlier limit, so the quiet samples are not slowed
+ * down by system calls between them.  Their deltas are then 0 for quiet
+ * samples, and for a slow sample cover everything since the previous
+ * slow sample, quiet samples included.
+ *
+ * Counters are read after the timed region, never around it, so a delta
+ * also covers the untimed gap before the sample and whatever fwq did in
+ * it (the previous counter read, stream hand off, queueing a trace
+ * spike).
+ *
+ * The counters are PMC_COUNTERS(X), X(name, type, config), in side
+ * word order.
+ *
+ * Licensed under the terms of the GNU Public Licence.  See LICENCE_GPL
+ * for details.
+ */
+#ifndef __PMC_H__
+#define __PMC_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+
+#define PMC_COUNTERS(X)							\
+  X(cycles,       PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES)	\
+  X(instructions, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS)	\
+  X(llc_misses,   PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES)	\
+  X(ctx_switches, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES)	\
+  X(page_faults,  PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS)
+
+enum {
+#define X(name, type, config)  PMC_##name,
+  PMC_COUNTERS(X)
+#undef X
+  NUM_PMC
+};
+
+extern const char *const pmc_names[NUM_PMC];
+
+struct pmc {
+  int fd[NUM_PMC];          /* -1 if the counter could not be opened */
+  /* control pages of the counters read with rdpmc, NULL for read() */
+  struct perf_event_mmap_page *page[NUM_PMC];
+  uint64_t last[NUM_PMC];   /* value at the previous read */
+  unsigned int mask;        /* bit i: counter i is open */
+  unsigned int fast;        /* bit i: counter i is read with rdpmc */
+  int kernel;               /* kernel time is counted too */
+};
+
+/* summary of the counters over quiet and slow samples */
+struct pmc_stats {
+  unsigned long long limit;          /* samples above this are slow */
+  unsigned long long n[2];           /* quiet, slow */
+  unsigned long long ticks[2];
+  unsigned long long sum[2][NUM_PMC];
+};
+
+extern int pmc_open(struct pmc *p);
+extern void pmc_close(struct pmc *p);
+extern void pmc_prime(struct pmc *p);
+extern void pmc_stats_add(struct pmc_stats *ps, const unsigned long long *v,
+			  const uint32_t *side, unsigned long count,
+			  int side_words);
+extern void pmc_print_header(FILE *fp);
+extern void pmc_stats_print(FILE *fp, const char *label,
+			    const struct pmc_stats *ps, double scale);
+
+/* the current value of a counter through its control page, following
+   the sequence lock protocol in linux/perf_event.h */
+static inline __attribute__((always_inline))
+uint64_t pmc_rdpmc(const volatile struct perf_event_mmap_page *pc) {
+  uint64_t count = 0;
+#if defined(__x86_64__) || defined(__i386__)
+  uint32_t seq, idx, lo, hi, width;
+  int64_t pmc;
+
+  do {
+    seq = pc->lock;
+    __asm__ __volatile__("" ::: "memory");
+    idx = pc->index;
+    count = pc->offset;
+    if (idx != 0) {
+      width = pc->pmc_width;
+      __asm__ __volatile__("rdpmc" : "=a"(lo), "=d"(hi) : "c"(idx - 1));
+      pmc = (int64_t)((uint64_t)hi << 32 | lo) << (64 - width);
+      count += pmc >> (64 - width);
+    }
+    __asm__ __volatile__("" ::: "memory");
+  } while (pc->lock != seq);
+#endif
+  return count;
+}
+
+/**
+ * pmc_sample() : read the counters after a sample and store their
+ * deltas in side[0..NUM_PMC-1], saturated at UINT32_MAX.  counters
+ * that need a system call are only read when slow is set, so their
+ * deltas run from the previous slow sample.
+ */
+static inline __attribute__((always_inline))
+void pmc_sample(struct pmc *p, uint32_t *side, int slow) {
+  uint64_t v, d;
+  int i;
+
+  for (i = 0; i < NUM_PMC; i++) {
+    if (p->fast & (1U << i))
+      v = pmc_rdpmc(p->page[i]);
+    else if (slow && (p->mask & (1U << i)) &&
+	     read(p->fd[i], &v, sizeof(v)) == sizeof(v))
+      ;
+    else {
+      side[i] = 0;
+      continue;
+    }
+    d = v - p->last[i];
+    p->last[i] = v;
+    side[i] = d > UINT32_MAX ? UINT32_MAX : d;
+  }
+}
+
+#endif /* __PMC_H__ */
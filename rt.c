@@ -0,0 +1,319 @@
+/*
+ * rt.c : real-time scheduling and isolation preflight shared by ftq and
+ * fwq.
+ *
+ * Licensed under the terms of the GNU Public Licence.  See LICENCE_GPL
+ * for details.
+ */
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "cpus.h"
+#include "rt.h"
+
+#define SYSFS_CPU     "/sys/devices/system/cpu"
+
+/* sched_setattr()'s argument, as in linux/sched/types.h (which cannot be
+   included alongside glibc's <sched.h>) */
+struct rt_attr {
+  uint32_t size;
+  uint32_t sched_policy;
+  uint64_t sched_flags;
+  int32_t sched_nice;
+  uint32_t sched_priority;
+  uint64_t sched_runtime;
+  uint64_t sched_deadline;
+  uint64_t sched_period;
+};
+
+/* longest kernel command line, and cpulist file, we care to read */
+#define RT_LINE_MAX   8192
+
+/**
+ * parse_sched() : map a --sched argument to a SCHED_* policy, or -1.
+ */
+int parse_sched(const char *name) {
+  if (strcmp(name, "other") == 0)
+    return SCHED_OTHER;
+  if (strcmp(name, "fifo") == 0)
+    return SCHED_FIFO;
+  if (strcmp(name, "rr") == 0)
+    return SCHED_RR;
+  if (strcmp(name, "deadline") == 0)
+    return SCHED_DEADLINE;
+  return -1;
+}
+
+/**
+ * rt_name() : the --sched name of a policy.
+ */
+const char *rt_name(int policy) {
+  switch (policy) {
+  case SCHED_FIFO:
+    return "fifo";
+  case SCHED_RR:
+    return "rr";
+  case SCHED_DEADLINE:
+    return "deadline";
+  }
+  return "other";
+}
+
+/**
+ * rt_apply() : put the calling thread under rs.  call it after pinning:
+ * SCHED_DEADLINE is only admitted for a single CPU when that CPU is a
+ * root domain of its own (an exclusive cpuset).  returns 0, or -1 with
+ * errno set.
+ */
+int rt_apply(const struct rt_sched *rs) {
+  struct sched_param sp;
+  struct rt_attr attr;
+
+  switch (rs->policy) {
+  case SCHED_OTHER:
+    return 0;
+  case SCHED_FIFO:
+  case SCHED_RR:
+    memset(&sp, 0, sizeof(sp));
+    sp.sched_priority = rs->prio;
+    return sched_setscheduler(0, rs->policy, &sp);
+  case SCHED_DEADLINE:
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.sched_policy = SCHED_DEADLINE;
+    attr.sched_runtime = rs->runtime;
+    attr.sched_deadline = rs->period;
+    attr.sched_period = rs->period;
+    return syscall(SYS_sched_setattr, 0, &attr, 0);
+  }
+  errno = EINVAL;
+  return -1;
+}
+
+/* a cpulist file, or "" if it does not exist */
+static void read_list(const char *path, char *buf) {
+  if (sysfs_read(path, buf, RT_LINE_MAX) != 0)
+    buf[0] = '\0';
+}
+
+/* the cpulist given to a kernel command line parameter, or "".  flags
+   in front of the list (isolcpus=nohz,domain,2-7) are skipped and "all"
+   means every CPU. */
+static void cmdline_list(const char *param, char *buf) {
+  char line[RT_LINE_MAX];
+  size_t len = strlen(param);
+  char *p, *end;
+
+  buf[0] = '\0';
+  if (sysfs_read("/proc/cmdline", line, sizeof(line)) != 0)
+    return;
+  for (p = line; (p = strstr(p, param)) != NULL; p += len) {
+    if ((p == line || p[-1] == ' ') && p[len] == '=')
+      break;
+  }
+  if (p == NULL)
+    return;
+  p += len + 1;
+  if ((end = strchr(p, ' ')) != NULL)
+    *end = '\0';
+  while (*p != '\0' && !(*p >= '0' && *p <= '9') && *p != '!' &&
+	 strcmp(p, "all") != 0) {
+    p = strchr(p, ',');
+    if (p == NULL)
+      return;
+    p++;
+  }
+  snprintf(buf, RT_LINE_MAX, "%s", strcmp(p, "all") ? p : "0-65535");
+}
+
+/* is cpu in a cpulist string?  malformed lists hold nothing */
+static int list_has(const char *list, uint32_t cpu) {
+  uint32_t *v;
+  int n, i, found = 0;
+
+  if (list[0] == '\0' || (n = cpulist_parse(list, &v)) < 0)
+    return 0;
+  for (i = 0; i < n && !found; i++)
+    found = (v[i] == cpu);
+  free(v);
+  return found;
+}
+
+/* does this /proc/irq entry have a handler?  they show up as
+   subdirectories named after the device. */
+static int irq_active(const char *dir) {
+  DIR *d = opendir(dir);
+  struct dirent *de;
+  int active = 0;
+
+  if (d == NULL)
+    return 0;
+  while (!active && (de = readdir(d)) != NULL)
+    active = de->d_type == DT_DIR && de->d_name[0] != '.';
+  closedir(d);
+  return active;
+}
+
+/* count the active device interrupts routed to each of the n cpus */
+static void count_irqs(const uint32_t *cpus, int n, int *irqs) {
+  char path[300], buf[RT_LINE_MAX];
+  DIR *d = opendir("/proc/irq");
+  struct dirent *de;
+  uint32_t *v;
+  int i, k, nv;
+
+  if (d == NULL)
+    return;
+  while ((de = readdir(d)) != NULL) {
+    if (de->d_name[0] < '0' || de->d_name[0] > '9')
+      continue;
+    snprintf(path, sizeof(path), "/proc/irq/%s", de->d_name);
+    if (!irq_active(path))
+      continue;
+    /* where the interrupt actually goes, if the kernel says */
+    snprintf(path, sizeof(path), "/proc/irq/%s/effective_affinity_list",
+	     de->d_name);
+    if (sysfs_read(path, buf, sizeof(buf)) != 0 || buf[0] == '\0') {
+      snprintf(path, sizeof(path), "/proc/irq/%s/smp_affinity_list",
+	       de->d_name);
+      if (sysfs_read(path, buf, sizeof(buf)) != 0)
+	continue;
+    }
+    if ((nv = cpulist_parse(buf, &v)) < 0)
+      continue;
+    for (i = 0; i < n; i++)
+      for (k = 0; k < nv; k++)
+	if (v[k] == cpus[i]) {
+	  irqs[i]++;
+	  break;
+	}
+    free(v);
+  }
+  closedir(d);
+}
+
+/**
+ * rt_preflight() : report how each of the n measured cpus is set up for
+ * noise measurement as '#' comment lines on fp, and warn on stderr
+ * about anything that will perturb the run: CPUs that are not isolated,
+ * still take the scheduler tick, RCU callbacks or device interrupts, or
+ * may change frequency, and about throttling of real-time workers.  the
+ * housekeeping CPU (-1 for none) is only reported.  returns the number
+ * of warnings.
+ */
+int rt_preflight(FILE *fp, const uint32_t *cpus, int n, int housekeeping,
+		 const struct rt_sched *rs) {
+  char *isol, *nohz, *nocbs, gov[64], path[256], buf[64];
+  int *irqs;
+  int i, warn = 0;
+  int not_isol = 0, not_nohz = 0, not_nocbs = 0, with_irqs = 0, slow = 0;
+  long rt_runtime = -1, rt_period = 0;
+
+  isol = malloc(RT_LINE_MAX);
+  nohz = malloc(RT_LINE_MAX);
+  nocbs = malloc(RT_LINE_MAX);
+  irqs = calloc(n, sizeof(int));
+  if (isol == NULL || nohz == NULL || nocbs == NULL || irqs == NULL) {
+    fprintf(stderr, "ERROR: out of memory in preflight.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  read_list(SYSFS_CPU "/isolated", isol);
+  if (isol[0] == '\0')
+    cmdline_list("isolcpus", isol);
+  read_list(SYSFS_CPU "/nohz_full", nohz);
+  if (nohz[0] == '\0' || strcmp(nohz, "(null)") == 0)
+    cmdline_list("nohz_full", nohz);
+  cmdline_list("rcu_nocbs", nocbs);
+  count_irqs(cpus, n, irqs);
+
+  fprintf(fp, "# preflight: %6s %8s %9s %9s %5s %s\n",
+	  "cpu", "isolated", "nohz_full", "rcu_nocbs", "irqs", "governor");
+  for (i = 0; i < n; i++) {
+    int is = list_has(isol, cpus[i]);
+    int nz = list_has(nohz, cpus[i]);
+    /* nohz_full CPUs have their callbacks offloaded implicitly */
+    int nc = nz || list_has(nocbs, cpus[i]);
+
+    snprintf(path, sizeof(path),
+	     SYSFS_CPU "/cpu%u/cpufreq/scaling_governor", cpus[i]);
+    if (sysfs_read(path, gov, sizeof(gov)) != 0)
+      strcpy(gov, "-");
+    fprintf(fp, "# preflight: %6u %8s %9s %9s %5d %s\n", cpus[i],
+	    is ? "yes" : "no", nz ? "yes" : "no", nc ? "yes" : "no",
+	    irqs[i], gov);
+    not_isol += !is;
+    not_nohz += !nz;
+    not_nocbs += !nc;
+    with_irqs += irqs[i] > 0;
+    slow += strcmp(gov, "-") != 0 && strcmp(gov, "performance") != 0;
+  }
+
+  if (not_isol) {
+    fprintf(stderr, "WARNING: %d of %d measured CPUs not in isolcpus; "
+	    "other tasks may be scheduled there.\n", not_isol, n);
+    warn++;
+  }
+  if (not_nohz) {
+    fprintf(stderr, "WARNING: %d of %d measured CPUs not in nohz_full; "
+	    "expect the scheduler tick in the samples.\n", not_nohz, n);
+    warn++;
+  }
+  if (not_nocbs) {
+    fprintf(stderr, "WARNING: %d of %d measured CPUs not in rcu_nocbs; "
+	    "RCU callbacks may run there.\n", not_nocbs, n);
+    warn++;
+  }
+  if (with_irqs) {
+    fprintf(stderr, "WARNING: %d of %d measured CPUs take device "
+	    "interrupts; see /proc/irq/*/smp_affinity_list.\n", with_irqs, n);
+    warn++;
+  }
+  if (slow) {
+    fprintf(stderr, "WARNING: %d of %d measured CPUs not using the "
+	    "performance cpufreq governor.\n", slow, n);
+    warn++;
+  }
+  if (housekeeping >= 0)
+    fprintf(fp, "# preflight: housekeeping cpu %d\n", housekeeping);
+  else
+    fprintf(fp, "# preflight: housekeeping cpu none\n");
+
+  if (rs->policy == SCHED_FIFO || rs->policy == SCHED_RR) {
+    if (sysfs_read("/proc/sys/kernel/sched_rt_runtime_us", buf,
+		   sizeof(buf)) == 0)
+      rt_runtime = strtol(buf, NULL, 10);
+    if (sysfs_read("/proc/sys/kernel/sched_rt_period_us", buf,
+		   sizeof(buf)) == 0)
+      rt_period = strtol(buf, NULL, 10);
+    fprintf(fp, "# preflight: sched %s priority %d, rt throttling %ld/%ld us\n",
+	    rt_name(rs->policy), rs->prio, rt_runtime, rt_period);
+    if (rt_runtime >= 0 && rt_runtime < rt_period) {
+      fprintf(stderr, "WARNING: real-time throttling idles workers for "
+	      "%ld us every %ld us; set sched_rt_runtime_us to -1.\n",
+	      rt_period - rt_runtime, rt_period);
+      warn++;
+    }
+  } else if (rs->policy == SCHED_DEADLINE) {
+    fprintf(fp, "# preflight: sched deadline runtime %llu ns period %llu ns\n",
+	    (unsigned long long)rs->runtime, (unsigned long long)rs->period);
+    if (rs->runtime < rs->period) {
+      fprintf(stderr, "WARNING: SCHED_DEADLINE throttles workers for "
+	      "%llu ns every %llu ns.\n",
+	      (unsigned long long)(rs->period - rs->runtime),
+	      (unsigned long long)rs->period);
+      warn++;
+    }
+  }
+
+  free(isol);
+  free(nohz);
+  free(nocbs);
+  free(irqs);
+  return warn;
+}
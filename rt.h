@@ -0,0 +1,44 @@
+/*
+ * rt.h : real-time scheduling of the measuring threads, and a preflight
+ * check of how well the measured CPUs are isolated.
+ *
+ * Workers can run under SCHED_FIFO or SCHED_RR at a chosen priority, or
+ * under SCHED_DEADLINE with a runtime and period.  Note that the kernel
+ * throttles busy real-time threads (sched_rt_runtime_us, and the
+ * deadline runtime itself), which shows up in the samples as noise;
+ * the preflight report points this out.
+ *
+ * The preflight looks at each measured CPU in turn: isolcpus, nohz_full,
+ * rcu_nocbs, the device interrupts routed to it and its cpufreq
+ * governor.  Anything that will add noise is warned about before the
+ * run starts rather than discovered after it.
+ *
+ * Licensed under the terms of the GNU Public Licence.  See LICENCE_GPL
+ * for details.
+ */
+#ifndef __RT_H__
+#define __RT_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* --sched defaults */
+#define RT_DEFAULT_PRIO       1
+#define RT_DEFAULT_RUNTIME    950000ULL   /* ns */
+#define RT_DEFAULT_PERIOD     1000000ULL  /* ns */
+
+struct rt_sched {
+  int policy;               /* SCHED_OTHER, SCHED_FIFO, SCHED_RR or
+			       SCHED_DEADLINE */
+  int prio;                 /* fifo/rr priority */
+  uint64_t runtime;         /* deadline runtime, ns */
+  uint64_t period;          /* deadline period (and deadline), ns */
+};
+
+extern int parse_sched(const char *name);
+extern int rt_apply(const struct rt_sched *rs);
+extern const char *rt_name(int policy);
+extern int rt_preflight(FILE *fp, const uint32_t *cpus, int n,
+			int housekeeping, const struct rt_sched *rs);
+
+#endif /* __RT_H__ */
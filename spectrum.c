@@ -0,0 +1,255 @@
+/*
+ * spectrum.c : power spectrum of a sample series, for finding periodic
+ * interference in ftq work counts.
+ *
+ * Licensed under the terms of the GNU Public Licence.  See LICENCE_GPL
+ * for details.
+ */
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "spectrum.h"
+
+/*
+ * two doubles at a time: SSE2 on x86_64, NEON on aarch64, plain scalar
+ * code elsewhere.  aligned(8) so loads from any double are allowed.
+ */
+typedef double v2d __attribute__((vector_size(16), aligned(8)));
+
+/**
+ * spectrum_size() : the segment size to use for a series of n samples,
+ * the largest power of two not above n or SPECTRUM_MAX_SIZE.  returns 0
+ * if n is too short to say anything useful.
+ */
+unsigned long spectrum_size(unsigned long n) {
+  unsigned long size = SPECTRUM_MAX_SIZE;
+
+  while (size > n)
+    size >>= 1;
+  return size < SPECTRUM_MIN_SIZE ? 0 : size;
+}
+
+/**
+ * spectrum_init() : an empty spectrum with segments of size samples, a
+ * power of two.  returns 0, or -1 if memory could not be allocated.
+ */
+int spectrum_init(struct spectrum *sp, unsigned long size) {
+  unsigned long m = size / 2, h, j;
+
+  memset(sp, 0, sizeof(*sp));
+  sp->size = size;
+  sp->seg = malloc(size * sizeof(double));
+  sp->window = malloc(size * sizeof(double));
+  sp->re = malloc(m * sizeof(double));
+  sp->im = malloc(m * sizeof(double));
+  sp->twr = malloc(m * sizeof(double));
+  sp->twi = malloc(m * sizeof(double));
+  sp->wr = malloc(m * sizeof(double));
+  sp->wi = malloc(m * sizeof(double));
+  sp->power = calloc(m + 1, sizeof(double));
+  if (!sp->seg || !sp->window || !sp->re || !sp->im || !sp->twr ||
+      !sp->twi || !sp->wr || !sp->wi || !sp->power) {
+    spectrum_free(sp);
+    return -1;
+  }
+
+  for (j = 0; j < size; j++)
+    sp->window[j] = 0.5 - 0.5 * cos(2 * M_PI * j / size);
+
+  /* the stage with half width h keeps its h twiddles at twr[h-1] */
+  for (h = 1; h < m; h <<= 1)
+    for (j = 0; j < h; j++) {
+      sp->twr[h - 1 + j] = cos(M_PI * j / h);
+      sp->twi[h - 1 + j] = -sin(M_PI * j / h);
+    }
+
+  for (j = 0; j < m; j++) {
+    sp->wr[j] = cos(2 * M_PI * j / size);
+    sp->wi[j] = -sin(2 * M_PI * j / size);
+  }
+  return 0;
+}
+
+void spectrum_free(struct spectrum *sp) {
+  free(sp->seg);
+  free(sp->window);
+  free(sp->re);
+  free(sp->im);
+  free(sp->twr);
+  free(sp->twi);
+  free(sp->wr);
+  free(sp->wi);
+  free(sp->power);
+  memset(sp, 0, sizeof(*sp));
+}
+
+/* in place radix-2 complex FFT of n points, n a power of two */
+static void fft(double *re, double *im, unsigned long n,
+		const double *twr, const double *twi) {
+  unsigned long i, j, k, h;
+  double t;
+
+  for (i = 1, j = 0; i < n; i++) {
+    for (k = n >> 1; j & k; k >>= 1)
+      j ^= k;
+    j |= k;
+    if (i < j) {
+      t = re[i]; re[i] = re[j]; re[j] = t;
+      t = im[i]; im[i] = im[j]; im[j] = t;
+    }
+  }
+
+  for (h = 1; h < n; h <<= 1) {
+    const double *wr = twr + h - 1, *wi = twi + h - 1;
+
+    for (i = 0; i < n; i += 2 * h) {
+      double *ar = re + i, *ai = im + i, *br = re + i + h, *bi = im + i + h;
+
+      if (h == 1) {
+	double tr = br[0], ti = bi[0];
+
+	br[0] = ar[0] - tr; bi[0] = ai[0] - ti;
+	ar[0] += tr; ai[0] += ti;
+	continue;
+      }
+      for (j = 0; j < h; j += 2) {
+	v2d xr = *(v2d *)(ar + j), xi = *(v2d *)(ai + j);
+	v2d yr = *(v2d *)(br + j), yi = *(v2d *)(bi + j);
+	v2d cr = *(const v2d *)(wr + j), ci = *(const v2d *)(wi + j);
+	v2d tr = yr * cr - yi * ci, ti = yr * ci + yi * cr;
+
+	*(v2d *)(br + j) = xr - tr;
+	*(v2d *)(bi + j) = xi - ti;
+	*(v2d *)(ar + j) = xr + tr;
+	*(v2d *)(ai + j) = xi + ti;
+      }
+    }
+  }
+}
+
+/*
+ * power spectrum of the full segment, added to sp->power.  the real
+ * series is packed into a half size complex one (even samples real, odd
+ * imaginary), transformed, and split back into the real transform.
+ */
+static void segment_done(struct spectrum *sp) {
+  unsigned long n = sp->size, m = n / 2, k;
+  double mean = 0;
+
+  for (k = 0; k < n; k++)
+    mean += sp->seg[k];
+  mean /= n;
+  for (k = 0; k < m; k++) {
+    sp->re[k] = (sp->seg[2 * k] - mean) * sp->window[2 * k];
+    sp->im[k] = (sp->seg[2 * k + 1] - mean) * sp->window[2 * k + 1];
+  }
+
+  fft(sp->re, sp->im, m, sp->twr, sp->twi);
+
+  for (k = 0; k <= m; k++) {
+    unsigned long a = k % m, b = (m - k) % m;
+    double er = 0.5 * (sp->re[a] + sp->re[b]);
+    double ei = 0.5 * (sp->im[a] - sp->im[b]);
+    double odr = 0.5 * (sp->im[a] + sp->im[b]);
+    double odi = -0.5 * (sp->re[a] - sp->re[b]);
+    double cr = k < m ? sp->wr[k] : -1, ci = k < m ? sp->wi[k] : 0;
+    double xr = er + cr * odr - ci * odi, xi = ei + cr * odi + ci * odr;
+
+    sp->power[k] += xr * xr + xi * xi;
+  }
+  sp->segments++;
+  sp->fill = 0;
+}
+
+/**
+ * spectrum_add() : append count values, stride words apart, to the
+ * series.  every completed segment is analysed straight away; a partial
+ * segment left at the end of the series is ignored.
+ */
+void spectrum_add(struct spectrum *sp, const unsigned long long *v,
+		  unsigned long count, unsigned long stride) {
+  unsigned long i;
+
+  for (i = 0; i < count; i++) {
+    sp->seg[sp->fill] = (double)v[i * stride];
+    if (++sp->fill == sp->size)
+      segment_done(sp);
+  }
+}
+
+/**
+ * spectrum_peaks() : the npeaks strongest local maxima of the averaged
+ * spectrum, strongest first.  sample_hz is the rate the series was
+ * sampled at.  returns the number of peaks found.
+ */
+int spectrum_peaks(const struct spectrum *sp, double sample_hz,
+		   struct spectrum_peak *peaks, int npeaks) {
+  unsigned long m = sp->size / 2, k;
+  const double *p = sp->power;
+  double total = 0;
+  int found = 0, i;
+
+  if (!sp->segments)
+    return 0;
+  for (k = 1; k <= m; k++)
+    total += p[k];
+  if (total <= 0)
+    return 0;
+
+  for (k = 1; k <= m; k++) {
+    double left = p[k - 1], right = k < m ? p[k + 1] : 0;
+    double share, delta = 0, denom;
+
+    if (p[k] <= left || p[k] < right)
+      continue;
+    /* a Hann window spreads a pure tone over three bins */
+    share = (left * (k > 1) + p[k] + right) / total;
+    for (i = found; i > 0 && peaks[i - 1].share < share; i--)
+      if (i < npeaks)
+	peaks[i] = peaks[i - 1];
+    if (i >= npeaks)
+      continue;
+
+    /* parabolic interpolation between the neighbouring bins */
+    denom = left - 2 * p[k] + right;
+    if (k < m && denom != 0)
+      delta = 0.5 * (left - right) / denom;
+    peaks[i].freq = (k + delta) * sample_hz / sp->size;
+    peaks[i].share = share;
+    /* a Hann windowed tone of amplitude A peaks at A * size / 4 */
+    peaks[i].amplitude = 4 * sqrt(p[k] / sp->segments) / sp->size;
+    if (found < npeaks)
+      found++;
+  }
+  return found;
+}
+
+/**
+ * spectrum_print() : the strongest peaks of sp, one per line, under a
+ * '#' header describing the analysis.
+ */
+void spectrum_print(FILE *fp, const char *label, const struct spectrum *sp,
+		    double sample_hz, int npeaks) {
+  struct spectrum_peak *peaks;
+  int i, found;
+
+  fprintf(fp, "# spectrum %s: %lu x %lu point segments, "
+	  "%.3f Hz sampling, %.4f Hz resolution\n",
+	  label, sp->segments, sp->size, sample_hz, sample_hz / sp->size);
+  if (!sp->segments) {
+    fprintf(fp, "  (series shorter than one segment)\n");
+    return;
+  }
+
+  peaks = malloc(npeaks * sizeof(*peaks));
+  if (!peaks)
+    return;
+  found = spectrum_peaks(sp, sample_hz, peaks, npeaks);
+  fprintf(fp, "# %14s %14s %10s %12s\n",
+	  "freq_hz", "period_ms", "share", "amplitude");
+  for (i = 0; i < found; i++)
+    fprintf(fp, "  %14.4f %14.4f %10.6f %12.2f\n",
+	    peaks[i].freq, 1000.0 / peaks[i].freq,
+	    peaks[i].share, peaks[i].amplitude);
+  free(peaks);
+}
@@ -0,0 +1,51 @@
+/*
+ * spectrum.h : power spectrum of a sample series, for finding periodic
+ * interference in ftq work counts.
+ *
+ * The series is cut into fixed size segments.  Each segment has its mean
+ * removed, is Hann windowed and goes through a real FFT; the power
+ * spectra of all segments are averaged (Welch's method).  Memory use
+ * depends only on the segment size, so series of any length, streamed
+ * or not, can be analysed.
+ *
+ * Licensed under the terms of the GNU Public Licence.  See LICENCE_GPL
+ * for details.
+ */
+#ifndef __SPECTRUM_H__
+#define __SPECTRUM_H__
+
+#include <stdio.h>
+
+#define SPECTRUM_MAX_SIZE  (1UL << 16)
+#define SPECTRUM_MIN_SIZE  64
+
+struct spectrum {
+  unsigned long size;       /* samples per segment, a power of two */
+  unsigned long fill;       /* samples in the current segment */
+  unsigned long segments;   /* segments analysed so far */
+  double *seg;              /* current segment */
+  double *window;           /* Hann window */
+  double *re, *im;          /* size/2 point complex FFT workspace */
+  double *twr, *twi;        /* per-stage twiddle factors */
+  double *wr, *wi;          /* exp(-2 pi i k / size), for the real split */
+  double *power;            /* summed power, size/2+1 bins */
+};
+
+struct spectrum_peak {
+  double freq;              /* Hz */
+  double share;             /* fraction of the total (non DC) power */
+  double amplitude;         /* approximate amplitude, in sample units */
+};
+
+extern unsigned long spectrum_size(unsigned long n);
+extern int spectrum_init(struct spectrum *sp, unsigned long size);
+extern void spectrum_free(struct spectrum *sp);
+extern void spectrum_add(struct spectrum *sp, const unsigned long long *v,
+			 unsigned long count, unsigned long stride);
+extern int spectrum_peaks(const struct spectrum *sp, double sample_hz,
+			  struct spectrum_peak *peaks, int npeaks);
+extern void spectrum_print(FILE *fp, const char *label,
+			   const struct spectrum *sp, double sample_hz,
+			   int npeaks);
+
+#endif /* __SPECTRUM_H__ */
@@ -0,0 +1,167 @@
+/*
+ * stats.c : single pass summary statistics for sample series.
+ *
+ * Licensed under the terms of the GNU Public Licence.  See LICENCE_GPL
+ * for details.
+ */
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "stats.h"
+
+#define SUB  (1ULL << STATS_SUB_BITS)
+
+/* histogram bucket holding v */
+static inline unsigned bucket(unsigned long long v) {
+  int e, shift;
+
+  if (v < SUB)
+    return v;
+  e = 63 - __builtin_clzll(v);
+  shift = e - STATS_SUB_BITS;
+  return ((shift + 1) << STATS_SUB_BITS) + ((v >> shift) & (SUB - 1));
+}
+
+/* smallest value in bucket b, and the bucket's width */
+static unsigned long long bucket_low(unsigned b, unsigned long long *width) {
+  int shift;
+
+  if (b < 2 * SUB) {
+    *width = 1;
+    return b;
+  }
+  shift = (b >> STATS_SUB_BITS) - 1;
+  *width = 1ULL << shift;
+  return (SUB + (b & (SUB - 1))) << shift;
+}
+
+/**
+ * stats_init() : an empty summary.  returns 0, or -1 if the histogram
+ * could not be allocated.
+ */
+int stats_init(struct stats *st) {
+  memset(st, 0, sizeof(*st));
+  st->min = ~0ULL;
+  st->hist = calloc(STATS_BUCKETS, sizeof(*st->hist));
+  return st->hist == NULL ? -1 : 0;
+}
+
+void stats_free(struct stats *st) {
+  free(st->hist);
+  st->hist = NULL;
+}
+
+/**
+ * stats_add() : account for count values taken every stride words
+ * from v.
+ */
+void stats_add(struct stats *st, const unsigned long long *v,
+	       unsigned long count, unsigned long stride) {
+  unsigned long i;
+  unsigned long long x;
+  double d;
+
+  for (i = 0; i < count; i++, v += stride) {
+    x = *v;
+    st->n++;
+    st->sum += x;
+    if (x < st->min)
+      st->min = x;
+    if (x > st->max)
+      st->max = x;
+    d = x - st->mean;
+    st->mean += d / st->n;
+    st->m2 += d * (x - st->mean);
+    st->hist[bucket(x)]++;
+  }
+}
+
+/**
+ * stats_merge() : fold src into dst, e.g. per-thread summaries into
+ * one for the whole run.
+ */
+void stats_merge(struct stats *dst, const struct stats *src) {
+  unsigned long long n;
+  double d;
+  int b;
+
+  if (src->n == 0)
+    return;
+  n = dst->n + src->n;
+  d = src->mean - dst->mean;
+  dst->m2 += src->m2 + d * d * ((double)dst->n * src->n / n);
+  dst->mean += d * src->n / n;
+  dst->n = n;
+  dst->sum += src->sum;
+  if (src->min < dst->min)
+    dst->min = src->min;
+  if (src->max > dst->max)
+    dst->max = src->max;
+  for (b = 0; b < STATS_BUCKETS; b++)
+    dst->hist[b] += src->hist[b];
+}
+
+/**
+ * stats_quantile() : the q quantile (0 <= q <= 1), as the middle of
+ * the histogram bucket it falls in, clamped to the observed range.
+ */
+unsigned long long stats_quantile(const struct stats *st, double q) {
+  unsigned long long rank, seen = 0, low, width, v;
+  int b;
+
+  if (st->n == 0)
+    return 0;
+  rank = (unsigned long long)ceil(q * st->n);
+  if (rank < 1)
+    rank = 1;
+
+  for (b = 0; b < STATS_BUCKETS; b++) {
+    seen += st->hist[b];
+    if (seen >= rank)
+      break;
+  }
+  low = bucket_low(b, &width);
+  v = low + (width - 1) / 2;
+  if (v < st->min)
+    v = st->min;
+  if (v > st->max)
+    v = st->max;
+  return v;
+}
+
+double stats_stddev(const struct stats *st) {
+  return st->n > 1 ? sqrt(st->m2 / (st->n - 1)) : 0.0;
+}
+
+/**
+ * stats_noise() : fraction of the total time spent above the fastest
+ * sample, i.e. the share of the run lost to interference.
+ */
+double stats_noise(const struct stats *st) {
+  if (st->n == 0 || st->sum == 0)
+    return 0.0;
+  return (double)(st->sum - st->n * st->min) / st->sum;
+}
+
+/**
+ * stats_print_header() / stats_print() : one whitespace separated line
+ * per summary, under a '#' header naming the columns, so the output can
+ * be fed straight to awk or a plotting script.  values are multiplied by
+ * scale (e.g. ns per tick) on the way out.
+ */
+void stats_print_header(FILE *fp) {
+  fprintf(fp, "# %-6s %12s %12s %12s %12s %12s %12s %12s %12s %14s %12s %8s\n",
+	  "thread", "n", "min", "p50", "p90", "p99", "p99.9", "p99.99",
+	  "max", "mean", "stddev", "noise");
+}
+
+void stats_print(FILE *fp, const char *label, const struct stats *st,
+		 double scale) {
+  fprintf(fp, "  %-6s %12llu %12.0f %12.0f %12.0f %12.0f %12.0f %12.0f %12.0f "
+	  "%14.1f %12.1f %8.6f\n",
+	  label, st->n, (st->n ? st->min : 0) * scale,
+	  stats_quantile(st, 0.5) * scale, stats_quantile(st, 0.9) * scale,
+	  stats_quantile(st, 0.99) * scale, stats_quantile(st, 0.999) * scale,
+	  stats_quantile(st, 0.9999) * scale, st->max * scale,
+	  st->mean * scale, stats_stddev(st) * scale, stats_noise(st));
+}
@@ -0,0 +1,42 @@
+/*
+ * stats.h : single pass summary statistics for sample series.
+ *
+ * Licensed under the terms of the GNU Public Licence.  See LICENCE_GPL
+ * for details.
+ */
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdio.h>
+
+/*
+ * quantiles come from a log-linear histogram: values below 2^STATS_SUB_BITS
+ * are counted exactly, larger ones in 2^STATS_SUB_BITS buckets per power of
+ * two, so any quantile is within 1/2^STATS_SUB_BITS (under 1%) of the true
+ * value.  memory is fixed (about 60KB) however many samples are added.
+ */
+#define STATS_SUB_BITS  7
+#define STATS_BUCKETS   ((64 - STATS_SUB_BITS + 1) << STATS_SUB_BITS)
+
+struct stats {
+  unsigned long long n;
+  unsigned long long min, max;
+  unsigned long long sum;
+  double mean, m2;              /* running mean and sum of squared
+				   deviations (Welford) */
+  unsigned long long *hist;     /* STATS_BUCKETS counters */
+};
+
+extern int stats_init(struct stats *st);
+extern void stats_free(struct stats *st);
+extern void stats_add(struct stats *st, const unsigned long long *v,
+		      unsigned long count, unsigned long stride);
+extern void stats_merge(struct stats *dst, const struct stats *src);
+extern unsigned long long stats_quantile(const struct stats *st, double q);
+extern double stats_stddev(const struct stats *st);
+extern double stats_noise(const struct stats *st);
+extern void stats_print_header(FILE *fp);
+extern void stats_print(FILE *fp, const char *label, const struct stats *st,
+			double scale);
+
+#endif /* __STATS_H__ */
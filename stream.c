@@ -0,0 +1,262 @@
+/*
+ * stream.c : streaming sample drain shared by ftq and fwq.
+ *
+ * Licensed under the terms of the GNU Public Licence.  See LICENCE_GPL
+ * for details.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "cpus.h"
+#include "mem.h"
+#include "stream.h"
+
+#define CHUNK_BYTES  (sizeof(unsigned long long) * STREAM_CHUNK_WORDS)
+#define SIDE_BYTES(s) \
+  (sizeof(uint32_t) * (STREAM_CHUNK_WORDS / (s)->sample_words) * \
+   (s)->side_words)
+
+/**
+ * stream_wait() : measuring thread side, slow path of stream_hand_off().
+ * the drain thread has not yet written the chunk we want to reuse, so
+ * spin until it has.  every stall perturbs the measurement and is
+ * counted so it can be reported.
+ */
+unsigned long long *stream_wait(struct stream_ring *r) {
+  r->stalls++;
+  while (__atomic_load_n(&r->fill[r->cur], __ATOMIC_ACQUIRE) != 0)
+    ;
+  return r->chunk[r->cur];
+}
+
+/*
+ * write one chunk of thread j's samples, and their side words, to its
+ * output.
+ */
+static int drain_chunk(struct stream *s, int j, const unsigned long long *v,
+		       const uint32_t *side, unsigned long words, char *buf) {
+  struct stream_ring *r = &s->rings[j];
+  unsigned long n = words / s->sample_words;
+  uint64_t done = r->words / s->sample_words;
+  int ncols = s->sample_words + s->side_words;
+  off_t off;
+  int c;
+
+  if (s->format == FORMAT_BIN) {
+    off = s->data_offset +
+      ((uint64_t)j * s->numsamples * s->sample_words + r->words) * sizeof(*v);
+    if (pwrite_all(s->binfd, v, words * sizeof(*v), off) < 0)
+      return -1;
+    if (s->side_words > 0) {
+      off = s->side_offset +
+	((uint64_t)j * s->numsamples + done) * s->side_words * sizeof(*side);
+      if (pwrite_all(s->binfd, side, n * s->side_words * sizeof(*side),
+		     off) < 0)
+	return -1;
+    }
+  } else {
+    for (c = 0; c < s->sample_words; c++) {
+      if (write_text_column(s->fds[j*ncols + c], v + c, n,
+			    s->sample_words, buf) < 0)
+	return -1;
+    }
+    for (c = 0; c < s->side_words; c++) {
+      if (write_text_column32(s->fds[j*ncols + s->sample_words + c],
+			      side + c, n, s->side_words, buf) < 0)
+	return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * drain thread: keep writing out full chunks until every measuring
+ * thread is done.
+ */
+static void *stream_drain(void *arg) {
+  struct stream *s = arg;
+  struct stream_ring *r;
+  struct timespec poll = { 0, STREAM_POLL_NS };
+  unsigned long n;
+  char *buf;
+  int j, busy, alldone, done;
+
+  housekeeping_thread(s->cpu, "drain thread");
+
+  buf = malloc(TEXT_BUFSIZE);
+  if (buf == NULL)
+    s->err = ENOMEM;
+
+  do {
+    busy = 0;
+    alldone = 1;
+    for (j = 0; j < s->numthreads; j++) {
+      r = &s->rings[j];
+      /* read done first: anything handed off before it was set is
+	 then guaranteed to be visible below */
+      done = __atomic_load_n(&r->done, __ATOMIC_ACQUIRE);
+      while ((n = __atomic_load_n(&r->fill[r->next], __ATOMIC_ACQUIRE))) {
+	/* after an error keep emptying chunks so nobody blocks */
+	if (s->err == 0 &&
+	    drain_chunk(s, j, r->chunk[r->next], r->side[r->next], n, buf) < 0)
+	  s->err = errno;
+	if (s->consume != NULL)
+	  s->consume(j, r->chunk[r->next], r->side[r->next], n,
+		     s->consume_arg);
+	r->words += n;
+	__atomic_store_n(&r->fill[r->next], 0, __ATOMIC_RELEASE);
+	r->next ^= 1;
+	busy = 1;
+      }
+      if (!done)
+	alldone = 0;
+    }
+    if (!busy && !alldone)
+      nanosleep(&poll, NULL);
+  } while (!alldone);
+
+  free(buf);
+  return NULL;
+}
+
+/**
+ * stream_open() : allocate the rings and create the output files.  the
+ * caller fills in numthreads, sample_words, side_words, format, cpu,
+ * memflags and optionally name_cpus and consume/consume_arg first.  the
+ * chunks themselves come from stream_ring_init().  text output goes to
+ * one file per thread per sample and side word, named as sample_fname()
+ * does with one suffix per column; binary output
+ * goes to <outname>.bin with hdr, cpus, starts and quanta as its header.
+ * those must stay valid until stream_finish(), which writes the header
+ * again so that anything filled in during the run (start ticks, quanta)
+ * is kept.
+ * returns 0, or -1 with errno set.
+ */
+int stream_open(struct stream *s, const char *outname,
+		const char *const *suffixes,
+		struct ftq_bin_header *hdr, const uint32_t *cpus,
+		const unsigned long long *starts,
+		const unsigned long long *quanta) {
+  char fname[1024];
+  int ncols = s->sample_words + s->side_words;
+  int j, c, fd;
+
+  s->numsamples = hdr->numsamples;
+  s->hdr = hdr;
+  s->cpus = cpus;
+  s->starts = starts;
+  s->quanta = quanta;
+  s->data_offset = hdr->data_offset;
+  s->side_offset = hdr->side_offset;
+  s->binfd = -1;
+  s->err = 0;
+
+  s->rings = aligned_alloc(64, sizeof(*s->rings) * s->numthreads);
+  if (s->rings == NULL)
+    return -1;
+  memset(s->rings, 0, sizeof(*s->rings) * s->numthreads);
+
+  if (s->format == FORMAT_BIN) {
+    sprintf(fname, "%s.bin", outname);
+    s->binfd = open(fname, O_CREAT|O_TRUNC|O_WRONLY, 0644);
+    if (s->binfd < 0 ||
+	ftq_write_bin_header(s->binfd, hdr, cpus, starts, quanta) < 0)
+      return -1;
+    s->fds = NULL;
+  } else {
+    s->fds = malloc(sizeof(int) * s->numthreads * ncols);
+    if (s->fds == NULL)
+      return -1;
+    for (j = 0; j < s->numthreads; j++) {
+      for (c = 0; c < ncols; c++) {
+	sample_fname(fname, sizeof(fname), outname, j, s->name_cpus,
+		     suffixes[c]);
+	fd = open(fname, O_CREAT|O_TRUNC|O_WRONLY, 0644);
+	if (fd < 0)
+	  return -1;
+	s->fds[j*ncols + c] = fd;
+      }
+    }
+  }
+  return 0;
+}
+
+/**
+ * stream_ring_init() : measuring thread side.  allocate and pre-fault
+ * this thread's two chunks; call after pinning so they are node local.
+ * returns 0, or -1 with errno set on allocation or locking failure.
+ */
+int stream_ring_init(struct stream *s, int thread) {
+  struct stream_ring *r = &s->rings[thread];
+  int c;
+
+  for (c = 0; c < 2; c++) {
+    r->chunk[c] = sample_alloc(CHUNK_BYTES, s->memflags);
+    if (r->chunk[c] == NULL)
+      return -1;
+    if (s->side_words > 0) {
+      r->side[c] = sample_alloc(SIDE_BYTES(s), s->memflags);
+      if (r->side[c] == NULL)
+	return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * stream_start() : start the drain thread.  returns 0 or an errno.
+ */
+int stream_start(struct stream *s) {
+  return pthread_create(&s->drain, NULL, stream_drain, s);
+}
+
+/**
+ * stream_finish() : wait for the drain thread to write everything the
+ * measuring threads handed off, then close the output and release the
+ * rings.  warns about any thread that had to wait for the drain.
+ * returns 0, or -1 with errno set if any write failed.
+ */
+int stream_finish(struct stream *s) {
+  int j, c;
+
+  pthread_join(s->drain, NULL);
+
+  for (j = 0; j < s->numthreads; j++) {
+    if (s->rings[j].stalls)
+      fprintf(stderr, "WARNING: thread %d waited for the drain thread %lu "
+	      "times; samples near those points are perturbed.\n",
+	      j, s->rings[j].stalls);
+    for (c = 0; c < 2; c++) {
+      sample_free(s->rings[j].chunk[c], CHUNK_BYTES, s->memflags);
+      if (s->side_words > 0)
+	sample_free(s->rings[j].side[c], SIDE_BYTES(s), s->memflags);
+    }
+  }
+  free(s->rings);
+
+  if (s->format == FORMAT_BIN) {
+    if (ftq_write_bin_header(s->binfd, s->hdr, s->cpus, s->starts,
+			     s->quanta) < 0 &&
+	s->err == 0)
+      s->err = errno;
+    if (close(s->binfd) < 0 && s->err == 0)
+      s->err = errno;
+  } else {
+    for (j = 0; j < s->numthreads * (s->sample_words + s->side_words); j++)
+      if (close(s->fds[j]) < 0 && s->err == 0)
+	s->err = errno;
+    free(s->fds);
+  }
+
+  if (s->err) {
+    errno = s->err;
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,112 @@
+/*
+ * stream.h : streaming sample drain shared by ftq and fwq.
+ *
+ * In streaming mode a measuring thread never holds more than two
+ * chunks of samples.  It fills one chunk while a low priority drain
+ * thread, pinned to a housekeeping CPU that is not being measured,
+ * writes the other one to disk.  Run length is then limited by disk
+ * space rather than memory.
+ *
+ * Licensed under the terms of the GNU Public Licence.  See LICENCE_GPL
+ * for details.
+ */
+#ifndef __STREAM_H__
+#define __STREAM_H__
+
+#include <pthread.h>
+#include "output.h"
+
+/* 64 bit words per chunk; each thread owns two */
+#define STREAM_CHUNK_WORDS  (1 << 16)
+/* how long the drain thread sleeps when there is nothing to write */
+#define STREAM_POLL_NS      1000000
+
+/*
+ * one per measuring thread, cache line aligned so that the flags the
+ * drain thread polls never share a line with another thread's.
+ *
+ * fill[i] is the number of words in chunk i waiting to be written, 0
+ * when the chunk belongs to the measuring thread.  the measuring thread
+ * fills the chunks alternately and the drain thread empties them in the
+ * same order.
+ */
+struct stream_ring {
+  unsigned long long *chunk[2];
+  uint32_t *side[2];        /* side words for the samples in chunk[i] */
+  unsigned long fill[2];
+  int cur;                  /* chunk being filled (measuring thread) */
+  int next;                 /* next chunk to write (drain thread) */
+  int done;                 /* measuring thread has finished */
+  unsigned long stalls;     /* times the measuring thread had to wait */
+  unsigned long long words; /* words written so far */
+} __attribute__((aligned(64)));
+
+/* called by the drain thread for every chunk after it is written, with
+   the chunk's side words (NULL if there are none) */
+typedef void (*stream_consume_fn)(int thread, const unsigned long long *v,
+				  const uint32_t *side, unsigned long words,
+				  void *arg);
+
+struct stream {
+  int numthreads;
+  int sample_words;         /* 64 bit words per sample */
+  int side_words;           /* 32 bit side words per sample, may be 0 */
+  int format;               /* FORMAT_TEXT or FORMAT_BIN */
+  int cpu;                  /* housekeeping CPU, -1 to leave unpinned */
+  int memflags;             /* MEM_* flags for the chunks */
+  struct stream_ring *rings;
+  int *fds;                 /* text: sample_words + side_words files
+			       per thread */
+  int binfd;
+  uint64_t data_offset;     /* bin: where thread 0's samples start */
+  uint64_t side_offset;     /* bin: where thread 0's side data starts */
+  uint64_t numsamples;
+  struct ftq_bin_header *hdr;  /* bin: rewritten by stream_finish() */
+  const uint32_t *cpus;
+  const uint32_t *name_cpus;   /* text: cpus to put in file names, or NULL */
+  const unsigned long long *starts;
+  const unsigned long long *quanta;
+  stream_consume_fn consume;
+  void *consume_arg;
+  pthread_t drain;
+  int err;                  /* first errno hit by the drain thread */
+};
+
+extern int stream_open(struct stream *s, const char *outname,
+		       const char *const *suffixes,
+		       struct ftq_bin_header *hdr, const uint32_t *cpus,
+		       const unsigned long long *starts,
+		       const unsigned long long *quanta);
+extern int stream_ring_init(struct stream *s, int thread);
+extern int stream_start(struct stream *s);
+extern int stream_finish(struct stream *s);
+extern unsigned long long *stream_wait(struct stream_ring *r);
+
+/**
+ * stream_hand_off() : measuring thread side.  give the chunk holding
+ * words words to the drain thread and return the chunk to fill next.
+ * only spins if the drain thread has fallen two chunks behind.  the
+ * matching side buffer is then r->side[r->cur].
+ */
+static inline unsigned long long *stream_hand_off(struct stream_ring *r,
+						  unsigned long words) {
+  __atomic_store_n(&r->fill[r->cur], words, __ATOMIC_RELEASE);
+  r->cur ^= 1;
+  if (__atomic_load_n(&r->fill[r->cur], __ATOMIC_ACQUIRE) != 0)
+    return stream_wait(r);
+  return r->chunk[r->cur];
+}
+
+/**
+ * stream_done() : measuring thread side.  hand off the last, possibly
+ * partial, chunk and tell the drain thread this ring is finished.
+ */
+static inline void stream_done(struct stream_ring *r, unsigned long words) {
+  if (words > 0) {
+    __atomic_store_n(&r->fill[r->cur], words, __ATOMIC_RELEASE);
+    r->cur ^= 1;
+  }
+  __atomic_store_n(&r->done, 1, __ATOMIC_RELEASE);
+}
+
+#endif /* __STREAM_H__ */
@@ -0,0 +1,229 @@
+/*
+ * telemetry.c : live progress of a threaded fwq run in shared memory.
+ *
+ * Licensed under the terms of the GNU Public Licence.  See LICENCE_GPL
+ * for details.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "cpus.h"
+#include "telemetry.h"
+
+/* most samples copied out of a stream chunk per update; the chunk
+   cannot be refilled while the copy is made as long as this is well
+   short of a chunk */
+#define TELEM_COPY  (STREAM_CHUNK_WORDS / 2)
+
+/* what the helper keeps per thread */
+struct telem_state {
+  unsigned long long next;      /* first sample not yet read */
+  unsigned long long min, max, p99, outliers, lost;
+  unsigned long long window_start;
+  struct stats window;
+  unsigned long long *copy;     /* streamed runs: TELEM_COPY samples */
+};
+
+static unsigned long long now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * telemetry_open() : create and map the shared segment and set up the
+ * helper's state.  the caller fills in numthreads, cpu, cpus,
+ * numsamples, ns_per_tick, samples or rings, and optionally name
+ * first.  returns 0, or -1 with errno set.
+ */
+int telemetry_open(struct telemetry *t) {
+  int fd, j;
+
+  if (t->name[0] == '\0')
+    snprintf(t->name, sizeof(t->name), "/fwq.%d", getpid());
+  t->size = sizeof(struct telem_header) +
+    sizeof(struct telem_thread) * t->numthreads;
+
+  fd = shm_open(t->name, O_CREAT|O_EXCL|O_RDWR, 0644);
+  if (fd < 0)
+    return -1;
+  if (ftruncate(fd, t->size) < 0) {
+    close(fd);
+    shm_unlink(t->name);
+    return -1;
+  }
+  t->hdr = mmap(NULL, t->size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (t->hdr == MAP_FAILED) {
+    shm_unlink(t->name);
+    return -1;
+  }
+
+  t->progress = aligned_alloc(64, sizeof(*t->progress) * t->numthreads);
+  t->state = calloc(t->numthreads, sizeof(*t->state));
+  if (t->progress == NULL || t->state == NULL)
+    goto bad;
+  memset(t->progress, 0, sizeof(*t->progress) * t->numthreads);
+  for (j = 0; j < t->numthreads; j++) {
+    if (stats_init(&t->state[j].window) < 0)
+      goto bad;
+    t->state[j].min = ~0ULL;
+    if (t->rings != NULL) {
+      t->state[j].copy = malloc(sizeof(unsigned long long) * TELEM_COPY);
+      if (t->state[j].copy == NULL)
+	goto bad;
+    }
+    telem_thread(t->hdr, j)->cpu = t->cpus[j];
+  }
+
+  /* the header last: readers check the magic before anything else */
+  t->hdr->version = TELEM_VERSION;
+  t->hdr->numthreads = t->numthreads;
+  t->hdr->numsamples = t->numsamples;
+  t->hdr->pid = getpid();
+  t->hdr->state = TELEM_RUNNING;
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(t->hdr->magic, TELEM_MAGIC, sizeof(t->hdr->magic));
+  t->stop = 0;
+  return 0;
+
+  /* leave no segment behind for fwq-top to find */
+ bad:
+  munmap(t->hdr, t->size);
+  shm_unlink(t->name);
+  if (t->state != NULL)
+    for (j = 0; j < t->numthreads; j++) {
+      stats_free(&t->state[j].window);
+      free(t->state[j].copy);
+    }
+  free(t->state);
+  free(t->progress);
+  t->state = NULL;
+  t->progress = NULL;
+  errno = ENOMEM;
+  return -1;
+}
+
+/* read thread j's new samples and publish its block */
+static void update(struct telemetry *t, int j, unsigned long long now) {
+  struct telem_state *st = &t->state[j];
+  struct telem_progress *p = &t->progress[j];
+  struct telem_thread *out = telem_thread(t->hdr, j);
+  unsigned long long done, n, k, idx;
+  const unsigned long long *v;
+
+  done = __atomic_load_n(&p->done, __ATOMIC_ACQUIRE);
+  if (done > st->next) {
+    n = done - st->next;
+    if (t->rings == NULL) {
+      v = t->samples[j] + st->next;
+    } else {
+      /* stream chunks are reused, so copy the samples out and make
+	 sure the thread did not come round to them meanwhile.  with two
+	 chunks, sample next is overwritten once the thread starts the
+	 chunk after the next one; done counts the sample in flight */
+      if (n > TELEM_COPY) {
+	st->lost += n - TELEM_COPY;
+	st->next = done - TELEM_COPY;
+	n = TELEM_COPY;
+      }
+      for (k = 0; k < n; k++) {
+	idx = st->next + k;
+	st->copy[k] = t->rings[j].chunk[(idx / STREAM_CHUNK_WORDS) & 1]
+	  [idx % STREAM_CHUNK_WORDS];
+      }
+      if (__atomic_load_n(&p->done, __ATOMIC_ACQUIRE) - st->next >=
+	  2 * STREAM_CHUNK_WORDS - st->next % STREAM_CHUNK_WORDS) {
+	st->lost += n;
+	n = 0;
+      }
+      v = st->copy;
+    }
+    for (k = 0; k < n; k++) {
+      if (v[k] < st->min)
+	st->min = v[k];
+      if (v[k] > st->max)
+	st->max = v[k];
+      st->outliers += v[k] > p->limit;
+    }
+    stats_add(&st->window, v, n, 1);
+    st->next = done;
+  }
+
+  if (st->window_start == 0)
+    st->window_start = now;
+  if (now - st->window_start >= TELEM_WINDOW_NS) {
+    if (st->window.n > 0) {
+      st->p99 = stats_quantile(&st->window, 0.99);
+      stats_free(&st->window);
+      stats_init(&st->window);
+    }
+    st->window_start = now;
+  }
+
+  __atomic_store_n(&out->seq, out->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  out->done = st->next;
+  out->min_ns = st->max ? st->min * t->ns_per_tick : 0;
+  out->max_ns = st->max * t->ns_per_tick;
+  out->p99_ns = st->p99 * t->ns_per_tick;
+  out->limit_ns = p->limit * t->ns_per_tick;
+  out->outliers = st->outliers;
+  out->lost = st->lost;
+  out->updated_ns = now;
+  __atomic_store_n(&out->seq, out->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * helper thread: publish every thread's progress until told to stop.
+ */
+static void *telemetry_helper(void *arg) {
+  struct telemetry *t = arg;
+  struct timespec poll = { 0, TELEM_POLL_NS };
+  int j, stop;
+
+  housekeeping_thread(t->cpu, "telemetry helper");
+
+  do {
+    stop = __atomic_load_n(&t->stop, __ATOMIC_ACQUIRE);
+    for (j = 0; j < t->numthreads; j++)
+      update(t, j, now_ns());
+    if (!stop)
+      nanosleep(&poll, NULL);
+  } while (!stop);
+  return NULL;
+}
+
+/**
+ * telemetry_start() : start the helper thread.  returns 0 or an errno.
+ */
+int telemetry_start(struct telemetry *t) {
+  return pthread_create(&t->helper, NULL, telemetry_helper, t);
+}
+
+/**
+ * telemetry_finish() : once the measuring threads are done, publish
+ * their final counts, mark the run done and remove the segment.
+ * viewers that have it mapped keep their copy.
+ */
+void telemetry_finish(struct telemetry *t) {
+  int j;
+
+  __atomic_store_n(&t->stop, 1, __ATOMIC_RELEASE);
+  pthread_join(t->helper, NULL);
+  __atomic_store_n(&t->hdr->state, TELEM_DONE, __ATOMIC_RELEASE);
+  munmap(t->hdr, t->size);
+  shm_unlink(t->name);
+  for (j = 0; j < t->numthreads; j++) {
+    stats_free(&t->state[j].window);
+    free(t->state[j].copy);
+  }
+  free(t->state);
+  free(t->progress);
+}
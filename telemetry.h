@@ -0,0 +1,139 @@
+/*
+ * telemetry.h : live progress of a threaded fwq run in shared memory,
+ * for fwq-top (--telemetry).
+ *
+ * A measuring thread does nothing more for this than store its sample
+ * count after every sample, to a cache line of its own.  A helper
+ * thread on the housekeeping CPU follows those counts, reads the new
+ * samples out of the threads' buffers (or stream chunks) and every
+ * TELEM_POLL_NS publishes, per thread, the samples done, the running
+ * minimum and maximum, the count of samples over the outlier limit and
+ * the p99 of the last TELEM_WINDOW_NS, in ns.
+ *
+ * The segment, /dev/shm/fwq.<pid> by default, is a struct telem_header
+ * followed by one struct telem_thread per thread.  Each thread block
+ * is guarded by a sequence lock: the helper makes seq odd while it
+ * writes, so a reader copies the block and retries until it saw the
+ * same even seq before and after (telem_read()), giving up if the block
+ * stays locked, as it does when fwq died mid update.  The segment is
+ * unlinked when the run ends, after state is set to TELEM_DONE.
+ *
+ * Licensed under the terms of the GNU Public Licence.  See LICENCE_GPL
+ * for details.
+ */
+#ifndef __TELEMETRY_H__
+#define __TELEMETRY_H__
+
+#include <stdint.h>
+#include <string.h>
+
+#define TELEM_MAGIC      "FWQTELEM"
+#define TELEM_VERSION    1
+/* how often the helper publishes */
+#define TELEM_POLL_NS    100000000
+/* p99 window */
+#define TELEM_WINDOW_NS  1000000000ULL
+/* seq loads before telem_read() gives up on a locked block; an update
+   takes well under a microsecond */
+#define TELEM_READ_SPINS 1000000
+
+/* telem_header.state */
+#define TELEM_RUNNING    1
+#define TELEM_DONE       2
+
+struct telem_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t numthreads;
+  uint64_t numsamples;          /* per thread */
+  int32_t pid;
+  uint32_t state;
+} __attribute__((aligned(64)));
+
+struct telem_thread {
+  uint32_t seq;
+  uint32_t cpu;
+  uint64_t done;                /* samples taken */
+  uint64_t min_ns, max_ns;
+  uint64_t p99_ns;              /* over the last window with samples */
+  uint64_t limit_ns;            /* outlier limit */
+  uint64_t outliers;            /* samples over it */
+  uint64_t lost;                /* samples the helper fell too far
+				   behind to read */
+  uint64_t updated_ns;          /* CLOCK_MONOTONIC of this update */
+} __attribute__((aligned(64)));
+
+/* thread i's block */
+static inline struct telem_thread *telem_thread(struct telem_header *h,
+						 int i) {
+  return (struct telem_thread *)(h + 1) + i;
+}
+
+/**
+ * telem_read() : a consistent copy of a thread block.  returns 0, or -1
+ * if the block was still being written after TELEM_READ_SPINS tries.
+ */
+static inline int telem_read(const volatile struct telem_thread *src,
+			     struct telem_thread *dst) {
+  uint32_t seq;
+  long spins = 0;
+
+  do {
+    while ((seq = __atomic_load_n(&src->seq, __ATOMIC_ACQUIRE)) & 1)
+      if (++spins == TELEM_READ_SPINS)
+	return -1;
+    memcpy(dst, (const void *)src, sizeof(*dst));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while (__atomic_load_n(&src->seq, __ATOMIC_RELAXED) != seq &&
+	   ++spins < TELEM_READ_SPINS);
+  return spins < TELEM_READ_SPINS ? 0 : -1;
+}
+
+#ifdef _WITH_PTHREADS_
+#include <pthread.h>
+#include "stats.h"
+#include "stream.h"
+
+/* a measuring thread's sample count, on a line of its own */
+struct telem_progress {
+  unsigned long long done;
+  unsigned long long limit;     /* outlier limit, ticks */
+} __attribute__((aligned(64)));
+
+struct telem_state;
+
+struct telemetry {
+  int numthreads;
+  int cpu;                      /* housekeeping CPU, -1 to leave unpinned */
+  const uint32_t *cpus;
+  unsigned long numsamples;
+  double ns_per_tick;
+  /* where the samples are: samples[j] for in memory runs (filled in
+     by each thread before its first sample), or rings for streamed
+     ones */
+  unsigned long long *const *samples;
+  struct stream_ring *rings;
+  struct telem_progress *progress;
+  char name[64];                /* shm_open() name */
+  struct telem_header *hdr;
+  size_t size;
+  struct telem_state *state;    /* the helper's own, per thread */
+  int stop;
+  pthread_t helper;
+};
+
+extern int telemetry_open(struct telemetry *t);
+extern int telemetry_start(struct telemetry *t);
+extern void telemetry_finish(struct telemetry *t);
+
+/**
+ * telemetry_progress() : measuring thread side.  done samples are in
+ * the buffer.
+ */
+static inline void telemetry_progress(struct telem_progress *p,
+				      unsigned long long done) {
+  __atomic_store_n(&p->done, done, __ATOMIC_RELEASE);
+}
+#endif /* _WITH_PTHREADS_ */
+
+#endif /* __TELEMETRY_H__ */
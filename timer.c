@@ -0,0 +1,198 @@
+/*
+ * timer.c : tick counter calibration shared by ftq and fwq.
+ *
+ * Licensed under the terms of the GNU Public Licence.  See LICENCE_GPL
+ * for details.
+ */
+#include <math.h>
+#include <stdlib.h>
+#include "timer.h"
+#include "stats.h"
+#ifdef __x86_64__
+#include <cpuid.h>
+#endif
+
+/**
+ * clock_pair() : read the tick counter and clock clk as nearly together
+ * as possible.  the tick is the midpoint of the two reads bracketing
+ * clock_gettime() in the tightest of CLOCK_TRIES attempts.  returns the
+ * width of that bracket in ticks, the uncertainty of the pairing.
+ */
+uint64_t clock_pair(clockid_t clk, uint64_t *tick, uint64_t *ns) {
+  struct timespec ts;
+  ticks t0, t1, best = ~(ticks)0;
+  int i;
+
+  for (i = 0; i < CLOCK_TRIES; i++) {
+    t0 = getticks();
+    clock_gettime(clk, &ts);
+    t1 = getticks();
+    if (t1 - t0 < best) {
+      best = t1 - t0;
+      *tick = t0 + (t1 - t0) / 2;
+      *ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+  }
+  return best;
+}
+
+/* what the hardware says about the counter getticks() reads */
+static void timer_probe(struct timer_cal *tc) {
+#if defined(__x86_64__)
+  unsigned int a, b, c, d;
+
+  tc->source = "tsc";
+  /* CPUID 0x80000007 EDX bit 8: invariant TSC */
+  if (__get_cpuid(0x80000007, &a, &b, &c, &d))
+    tc->invariant = (d >> 8) & 1;
+  /* CPUID 0x15: TSC/crystal ratio, and the crystal frequency if known */
+  if (__get_cpuid_max(0, NULL) >= 0x15) {
+    __cpuid(0x15, a, b, c, d);
+    if (a != 0 && b != 0 && c != 0)
+      tc->nominal_hz = (double)c * b / a;
+  }
+#elif defined(__aarch64__)
+  uint64_t freq;
+
+  tc->source = "cntvct_el0";
+  __asm__ __volatile__("mrs %0, cntfrq_el0" : "=r"(freq));
+  tc->nominal_hz = freq;
+  /* the architected timer runs at a fixed frequency by definition */
+  tc->invariant = 1;
+#else
+  tc->source = "getticks";
+#endif
+}
+
+/**
+ * timer_calibrate() : measure ns_per_tick against CLOCK_MONOTONIC_RAW
+ * (not slewed by NTP) over TIMER_CAL_NS.  the error is the sum of the
+ * two pairing uncertainties relative to the interval.  where the
+ * hardware states its frequency that is used instead, with the error
+ * being its disagreement with the measurement, unless they disagree by
+ * more than TIMER_NOMINAL_PPM.
+ */
+void timer_calibrate(struct timer_cal *tc) {
+  uint64_t t0, n0, t1, n1, w0, w1;
+  struct timespec req;
+  double measured;
+
+  tc->source = NULL;
+  tc->invariant = 0;
+  tc->nominal_hz = 0;
+  timer_probe(tc);
+
+  w0 = clock_pair(CLOCK_MONOTONIC_RAW, &t0, &n0);
+  req.tv_sec = TIMER_CAL_NS / 1000000000;
+  req.tv_nsec = TIMER_CAL_NS % 1000000000;
+  nanosleep(&req, NULL);
+  w1 = clock_pair(CLOCK_MONOTONIC_RAW, &t1, &n1);
+
+  if (t1 <= t0 || n1 <= n0) {
+    /* a counter that does not count: leave the values as they are */
+    tc->ns_per_tick = 1;
+    tc->err_ppm = 1e6;
+    return;
+  }
+  measured = (double)(n1 - n0) / (t1 - t0);
+  tc->ns_per_tick = measured;
+  tc->err_ppm = (double)(w0 + w1) / (t1 - t0) * 1e6;
+
+  if (tc->nominal_hz > 0) {
+    double off = fabs(measured * tc->nominal_hz / 1e9 - 1) * 1e6;
+
+    if (off > TIMER_NOMINAL_PPM) {
+      tc->nominal_hz = 0;
+      return;
+    }
+    tc->ns_per_tick = 1e9 / tc->nominal_hz;
+    tc->err_ppm = off;
+  }
+}
+
+/**
+ * timer_print() : one '#' comment line describing the calibration.
+ */
+void timer_print(FILE *fp, const struct timer_cal *tc) {
+  fprintf(fp, "# timer: %s%s, %.6f GHz%s, +/- %.1f ppm\n",
+	  tc->source, tc->invariant ? " (invariant)" : " (NOT invariant)",
+	  1 / tc->ns_per_tick, tc->nominal_hz > 0 ? " nominal" : " measured",
+	  tc->err_ppm);
+}
+
+/* out of line reads, and back to back start()/stop() loops for the
+   self test, one of each per strategy */
+#define Y(a, b, name, start, stop, unit_ns, desc)			\
+  static ticks read_##name(void) {					\
+    return stop();							\
+  }									\
+  static void test_##name(unsigned long long *d, unsigned long n) {	\
+    unsigned long i;							\
+    ticks t0;								\
+									\
+    for (i = 0; i < n; i++) {						\
+      t0 = start();							\
+      d[i] = stop() - t0;						\
+    }									\
+  }
+TIMERS(Y, , )
+#undef Y
+
+const struct timer timers[NUM_TIMERS] = {
+#define Y(a, b, name, start, stop, unit_ns, desc)  \
+  { #name, desc, unit_ns, read_##name },
+  TIMERS(Y, , )
+#undef Y
+};
+
+static void (*const timer_tests[NUM_TIMERS])(unsigned long long *,
+					     unsigned long) = {
+#define Y(a, b, name, start, stop, unit_ns, desc)  test_##name,
+  TIMERS(Y, , )
+#undef Y
+};
+
+/**
+ * find_timer() : index in timers[] of the strategy called name,
+ * "default" being the build's default.  returns -1 if there is none.
+ */
+int find_timer(const char *name) {
+  int i;
+
+  if (strcmp(name, "default") == 0)
+    name = DEFAULT_TIMER;
+  for (i = 0; i < NUM_TIMERS; i++)
+    if (strcmp(name, timers[i].name) == 0)
+      return i;
+  return -1;
+}
+
+/**
+ * timer_selftest() : time n empty start()/stop() pairs with every
+ * strategy and print the distribution of each, in ns, as a stats
+ * table.  the minimum is the strategy's overhead, the spread above it
+ * its jitter.
+ */
+void timer_selftest(FILE *fp, const struct timer_cal *tc, unsigned long n) {
+  unsigned long long *d;
+  struct stats st;
+  int i;
+
+  d = malloc(n * sizeof(*d));
+  assert(d != NULL);
+  fprintf(fp, "# timer overhead (ns), %lu back to back reads each\n", n);
+  stats_print_header(fp);
+  for (i = 0; i < NUM_TIMERS; i++) {
+    /* once to warm up, once for real */
+    timer_tests[i](d, n);
+    timer_tests[i](d, n);
+    assert(stats_init(&st) == 0);
+    stats_add(&st, d, n, 1);
+    stats_print(fp, timers[i].name, &st,
+		timers[i].unit_ns ? 1.0 : tc->ns_per_tick);
+    stats_free(&st);
+  }
+  for (i = 0; i < NUM_TIMERS; i++)
+    fprintf(fp, "#   %-8s %s\n", timers[i].name, timers[i].desc);
+  free(d);
+}
@@ -0,0 +1,162 @@
+/*
+ * timer.h : tick counter calibration shared by ftq and fwq.
+ *
+ * getticks() (cycle.h) counts in whatever unit the hardware provides.
+ * timer_calibrate() works out how long a tick is by reading the counter
+ * and CLOCK_MONOTONIC_RAW together some TIMER_CAL_NS apart, and says
+ * whether the counter can be trusted to tick at a constant rate at
+ * all: an invariant (constant and nonstop) TSC on x86_64, the
+ * architected generic timer, whose frequency is in cntfrq_el0, on
+ * aarch64.
+ *
+ * How the counter is read around a piece of work is a trade off between
+ * overhead and how tightly the read is ordered against the work.  The
+ * strategies are listed in TIMERS(Y, a, b), expanded with
+ * Y(a, b, name, start, stop, unit_ns, description): start() and stop()
+ * are the reads taken before and after the work, and unit_ns says they
+ * return nanoseconds rather than ticks.  a and b are passed through for
+ * the caller, so fwq can instantiate every kernel with every timer.
+ *
+ * Licensed under the terms of the GNU Public Licence.  See LICENCE_GPL
+ * for details.
+ */
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include "ftq.h"
+
+/* how long timer_calibrate() spends measuring */
+#define TIMER_CAL_NS   100000000
+/* attempts at reading the tick counter and a clock together */
+#define CLOCK_TRIES    16
+/* a stated frequency further than this from the measurement is ignored */
+#define TIMER_NOMINAL_PPM  1000
+
+struct timer_cal {
+  const char *source;       /* what getticks() reads */
+  int invariant;            /* ticks at a constant rate, even when idle */
+  double nominal_hz;        /* rate the hardware claims, 0 if unknown */
+  double ns_per_tick;
+  double err_ppm;           /* uncertainty of ns_per_tick, ppm */
+};
+
+extern uint64_t clock_pair(clockid_t clk, uint64_t *tick, uint64_t *ns);
+extern void timer_calibrate(struct timer_cal *tc);
+extern void timer_print(FILE *fp, const struct timer_cal *tc);
+
+#define TIMER_INLINE  static inline __attribute__((always_inline))
+
+#if defined(__x86_64__)
+/* bare rdtsc: cheapest, but may move relative to the work around it */
+TIMER_INLINE ticks tsc_plain(void) {
+  return getticks();
+}
+
+/* lfence on both sides: rdtsc waits for earlier instructions to finish,
+   later ones wait for the read */
+TIMER_INLINE ticks tsc_lfence(void) {
+  unsigned a, d;
+
+  __asm__ __volatile__("lfence\n\trdtsc\n\tlfence"
+		       : "=a"(a), "=d"(d) : : "memory");
+  return ((ticks)a) | (((ticks)d) << 32);
+}
+
+/* rdtscp waits for earlier instructions itself; the lfence holds back
+   later ones */
+TIMER_INLINE ticks tsc_rdtscp(void) {
+  unsigned a, d, c;
+
+  __asm__ __volatile__("rdtscp\n\tlfence"
+		       : "=a"(a), "=d"(d), "=c"(c) : : "memory");
+  return ((ticks)a) | (((ticks)d) << 32);
+}
+
+/* fully serialising cpuid before the first read, and after the last
+   (the start/stop pair from Intel's benchmarking white paper) */
+TIMER_INLINE ticks tsc_cpuid_start(void) {
+  unsigned a, d;
+
+  __asm__ __volatile__("cpuid\n\trdtsc"
+		       : "=a"(a), "=d"(d) : "a"(0) : "rbx", "rcx", "memory");
+  return ((ticks)a) | (((ticks)d) << 32);
+}
+
+TIMER_INLINE ticks tsc_cpuid_stop(void) {
+  unsigned a, d;
+
+  __asm__ __volatile__("rdtscp\n\tmov %%eax, %0\n\tmov %%edx, %1\n\t"
+		       "xor %%eax, %%eax\n\tcpuid"
+		       : "=r"(a), "=r"(d) : : "rax", "rbx", "rcx", "rdx",
+		       "memory");
+  return ((ticks)a) | (((ticks)d) << 32);
+}
+#elif defined(__aarch64__)
+/* cntvct_el0 without a barrier: may be read early */
+TIMER_INLINE ticks cnt_plain(void) {
+  ticks ret;
+
+  __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(ret));
+  return ret;
+}
+
+/* isb first, so the read waits for earlier instructions (getticks()) */
+TIMER_INLINE ticks cnt_isb(void) {
+  return getticks();
+}
+#endif
+
+/* CLOCK_MONOTONIC through the vDSO, in ns */
+TIMER_INLINE ticks clock_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ticks)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#if defined(__x86_64__)
+#define TIMERS(Y, a, b)							\
+  Y(a, b, rdtsc, tsc_plain, tsc_plain, 0, "bare rdtsc")			\
+  Y(a, b, lfence, tsc_lfence, tsc_lfence, 0, "lfence; rdtsc; lfence")	\
+  Y(a, b, rdtscp, tsc_rdtscp, tsc_rdtscp, 0, "rdtscp; lfence")		\
+  Y(a, b, cpuid, tsc_cpuid_start, tsc_cpuid_stop, 0,			\
+    "cpuid; rdtsc ... rdtscp; cpuid")					\
+  Y(a, b, clock, clock_now, clock_now, 1, "clock_gettime(CLOCK_MONOTONIC)")
+#define DEFAULT_TIMER  "rdtsc"
+#elif defined(__aarch64__)
+#define TIMERS(Y, a, b)							\
+  Y(a, b, cntvct, cnt_plain, cnt_plain, 0, "bare mrs cntvct_el0")	\
+  Y(a, b, isb, cnt_isb, cnt_isb, 0, "isb; mrs cntvct_el0")		\
+  Y(a, b, clock, clock_now, clock_now, 1, "clock_gettime(CLOCK_MONOTONIC)")
+#define DEFAULT_TIMER  "isb"
+#else
+#define TIMERS(Y, a, b)							\
+  Y(a, b, getticks, getticks, getticks, 0, "getticks() from cycle.h")	\
+  Y(a, b, clock, clock_now, clock_now, 1, "clock_gettime(CLOCK_MONOTONIC)")
+#define DEFAULT_TIMER  "getticks"
+#endif
+
+#define TIMER_ENUM(a, b, name, start, stop, unit_ns, desc)  TIMER_##name,
+enum { TIMERS(TIMER_ENUM, , ) NUM_TIMERS };
+
+struct timer {
+  const char *name;
+  const char *desc;
+  int unit_ns;
+  ticks (*read)(void);      /* stop(), out of line, for use outside loops */
+};
+
+extern const struct timer timers[NUM_TIMERS];
+extern int find_timer(const char *name);
+extern void timer_selftest(FILE *fp, const struct timer_cal *tc,
+			   unsigned long n);
+
+/* tick count to nanoseconds */
+static inline double ticks_to_ns(const struct timer_cal *tc, double t) {
+  return t * tc->ns_per_tick;
+}
+
+#endif /* __TIMER_H__ */
@@ -0,0 +1,300 @@
+/*
+ * trace.c : ftrace markers for slow fwq samples, and a report that
+ * lines them up with a captured kernel trace.
+ *
+ * Licensed under the terms of the GNU Public Licence.  See LICENCE_GPL
+ * for details.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "trace.h"
+#ifdef _WITH_PTHREADS_
+#include "cpus.h"
+#endif
+
+#define MARKER_TAG  "fwq: spike "
+
+#ifdef _WITH_PTHREADS_
+static const char *const marker_paths[] = {
+  "/sys/kernel/tracing/trace_marker",
+  "/sys/kernel/debug/tracing/trace_marker",
+};
+
+/**
+ * trace_open() : open trace_marker and allocate the spike rings.  the
+ * caller fills in numthreads, cpu, cpus and the tick to ns conversion
+ * first.  returns 0, or -1 with errno set.
+ */
+int trace_open(struct trace *t) {
+  int i;
+
+  t->fd = -1;
+  for (i = 0; i < 2 && t->fd < 0; i++)
+    t->fd = open(marker_paths[i], O_WRONLY);
+  if (t->fd < 0)
+    return -1;
+  t->rings = aligned_alloc(64, sizeof(*t->rings) * t->numthreads);
+  if (t->rings == NULL)
+    return -1;
+  memset(t->rings, 0, sizeof(*t->rings) * t->numthreads);
+  t->stop = 0;
+  t->written = 0;
+  return 0;
+}
+
+/* write a marker for every spike queued on thread j's ring */
+static void write_spikes(struct trace *t, int j) {
+  struct trace_ring *r = &t->rings[j];
+  struct trace_spike *s;
+  struct timespec now;
+  unsigned long tail = r->tail;
+  char line[256];
+  int len;
+
+  while (tail != __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) {
+    s = &r->spike[tail % TRACE_RING];
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    len = snprintf(line, sizeof(line), MARKER_TAG "thread %d cpu %u sample "
+		   "%llu start %llu len %llu now %llu\n", j, t->cpus[j],
+		   s->index,
+		   t->ns0 + (unsigned long long)((s->start - t->tick0) *
+						 t->ns_per_tick),
+		   (unsigned long long)(s->len * t->ns_per_tick),
+		   now.tv_sec * 1000000000ULL + now.tv_nsec);
+    __atomic_store_n(&r->tail, ++tail, __ATOMIC_RELEASE);
+    if (write(t->fd, line, len) == len)
+      t->written++;
+  }
+}
+
+/*
+ * helper thread: write out spikes until told to stop.
+ */
+static void *trace_helper(void *arg) {
+  struct trace *t = arg;
+  struct timespec poll = { 0, TRACE_POLL_NS };
+  int j, stop;
+
+  housekeeping_thread(t->cpu, "trace helper");
+
+  do {
+    /* read stop first: every spike queued before it was set is then
+       seen below */
+    stop = __atomic_load_n(&t->stop, __ATOMIC_ACQUIRE);
+    for (j = 0; j < t->numthreads; j++)
+      write_spikes(t, j);
+    if (!stop)
+      nanosleep(&poll, NULL);
+  } while (!stop);
+  return NULL;
+}
+
+/**
+ * trace_start() : start the helper thread.  returns 0 or an errno.
+ */
+int trace_start(struct trace *t) {
+  return pthread_create(&t->helper, NULL, trace_helper, t);
+}
+
+/**
+ * trace_finish() : once the measuring threads are done, write out what
+ * is left, stop the helper and release everything.  warns about any
+ * thread that had spikes dropped.
+ */
+void trace_finish(struct trace *t) {
+  int j;
+
+  __atomic_store_n(&t->stop, 1, __ATOMIC_RELEASE);
+  pthread_join(t->helper, NULL);
+  for (j = 0; j < t->numthreads; j++)
+    if (t->rings[j].dropped)
+      fprintf(stderr, "WARNING: thread %d had %lu spikes too close together "
+	      "to mark.\n", j, t->rings[j].dropped);
+  free(t->rings);
+  close(t->fd);
+}
+#endif /* _WITH_PTHREADS_ */
+
+/* a "seconds.fraction" timestamp as ns.  returns 0, or -1 if p does
+   not start with one. */
+static int parse_ts(const char *p, char **end, long long *ns) {
+  long long sec, frac = 0;
+  int digits = 0;
+
+  sec = strtoll(p, end, 10);
+  if (*end == p || **end != '.')
+    return -1;
+  for (p = *end + 1; *p >= '0' && *p <= '9'; p++, digits++)
+    if (digits < 9)
+      frac = frac * 10 + (*p - '0');
+  if (digits == 0)
+    return -1;
+  for (; digits < 9; digits++)
+    frac *= 10;
+  *end = (char *)p;
+  *ns = sec * 1000000000LL + frac;
+  return 0;
+}
+
+/* the CPU and timestamp of a trace line, "task-pid [cpu] flags ts:".
+   returns 0, or -1 if the line is not an event. */
+static int parse_line(const char *line, unsigned int *cpu, long long *ts) {
+  const char *p = line;
+  char *end;
+
+  if (line[0] == '#')
+    return -1;
+  for (;; p++) {
+    if ((p = strchr(p, '[')) == NULL)
+      return -1;
+    *cpu = strtoul(p + 1, &end, 10);
+    if (end > p + 1 && *end == ']')
+      break;
+  }
+  for (p = end + 1; *p != '\0'; ) {
+    while (*p == ' ')
+      p++;
+    if (parse_ts(p, &end, ts) == 0 && *end == ':')
+      return 0;
+    while (*p != '\0' && *p != ' ')
+      p++;
+  }
+  return -1;
+}
+
+struct mark {
+  int thread;
+  unsigned int cpu;
+  unsigned long long sample;
+  long long start, end;         /* trace clock, ns */
+  int hits;
+};
+
+struct hit {
+  int mark;
+  unsigned long order;
+  char *line;
+};
+
+static int mark_cmp(const void *a, const void *b) {
+  const struct mark *x = a, *y = b;
+
+  return (x->start > y->start) - (x->start < y->start);
+}
+
+static int hit_cmp(const void *a, const void *b) {
+  const struct hit *x = a, *y = b;
+
+  if (x->mark != y->mark)
+    return x->mark - y->mark;
+  return (x->order > y->order) - (x->order < y->order);
+}
+
+/**
+ * trace_report() : read the trace in fname and print each fwq spike
+ * marker found there with the events on its CPU that overlap it.
+ * returns 0, or -1 with errno set if the trace could not be read.
+ */
+int trace_report(FILE *fp, const char *fname) {
+  FILE *in = fopen(fname, "r");
+  char *line = NULL, *p, *end;
+  size_t len = 0;
+  struct mark *marks = NULL, m;
+  struct hit *hits = NULL;
+  void *grown;
+  int nmarks = 0, nhits = 0, explained = 0, ret = -1, i, k;
+  unsigned long order = 0;
+  unsigned long long start, slen, now;
+  long long ts, a, b, maxlen = 0;
+  unsigned int cpu;
+
+  if (in == NULL)
+    return -1;
+
+  /* first pass: the markers, placed on the trace clock */
+  while (getline(&line, &len, in) >= 0) {
+    if ((p = strstr(line, MARKER_TAG)) == NULL ||
+	parse_line(line, &cpu, &ts) < 0 ||
+	sscanf(p, MARKER_TAG "thread %d cpu %u sample %llu start %llu len %llu "
+	       "now %llu", &m.thread, &m.cpu, &m.sample, &start, &slen,
+	       &now) != 6)
+      continue;
+    m.start = start + (ts - (long long)now);
+    m.end = m.start + slen;
+    m.hits = 0;
+    if ((long long)slen > maxlen)
+      maxlen = slen;
+    if ((grown = realloc(marks, sizeof(*marks) * (nmarks + 1))) == NULL)
+      goto out;
+    marks = grown;
+    marks[nmarks++] = m;
+  }
+  qsort(marks, nmarks, sizeof(*marks), mark_cmp);
+
+  /* second pass: every other event that overlaps a spike on its CPU */
+  rewind(in);
+  while (nmarks > 0 && getline(&line, &len, in) >= 0) {
+    if (strstr(line, MARKER_TAG) != NULL || parse_line(line, &cpu, &ts) < 0)
+      continue;
+    a = b = ts;
+    if ((p = strstr(line, " start ")) != NULL &&
+	parse_ts(p + 7, &end, &a) == 0 &&
+	strncmp(end, " duration ", 10) == 0)
+      b = a + strtoll(end + 10, NULL, 10);
+    else
+      a = ts;   /* parse_ts() may have set it */
+
+    /* first spike that could still reach a */
+    for (i = 0, k = nmarks; i < k; ) {
+      int mid = (i + k) / 2;
+
+      if (marks[mid].start < a - maxlen - TRACE_SLACK_NS)
+	i = mid + 1;
+      else
+	k = mid;
+    }
+    for (; i < nmarks && marks[i].start <= b + TRACE_SLACK_NS; i++) {
+      if (marks[i].cpu != cpu || marks[i].end + TRACE_SLACK_NS < a)
+	continue;
+      if ((grown = realloc(hits, sizeof(*hits) * (nhits + 1))) == NULL)
+	goto out;
+      hits = grown;
+      hits[nhits].mark = i;
+      hits[nhits].order = order++;
+      hits[nhits].line = strdup(line);
+      nhits++;
+      marks[i].hits++;
+    }
+  }
+  qsort(hits, nhits, sizeof(*hits), hit_cmp);
+
+  fprintf(fp, "# spikes in %s, with the events on their CPU that overlap "
+	  "them\n", fname);
+  for (i = 0, k = 0; i < nmarks; i++) {
+    fprintf(fp, "# spike: thread %d cpu %u sample %llu at %lld.%06lld, "
+	    "%.1f us, %d events\n", marks[i].thread, marks[i].cpu,
+	    marks[i].sample, marks[i].start / 1000000000LL,
+	    marks[i].start % 1000000000LL / 1000,
+	    (marks[i].end - marks[i].start) / 1e3, marks[i].hits);
+    explained += marks[i].hits > 0;
+    for (; k < nhits && hits[k].mark == i; k++)
+      fprintf(fp, "  %s", hits[k].line ? hits[k].line : "?\n");
+  }
+  fprintf(fp, "# %d spikes, %d with overlapping events\n", nmarks,
+	  explained);
+  ret = 0;
+
+out:
+  for (k = 0; k < nhits; k++)
+    free(hits[k].line);
+  free(hits);
+  free(marks);
+  free(line);
+  fclose(in);
+  return ret;
+}
@@ -0,0 +1,103 @@
+/*
+ * trace.h : ftrace markers for slow fwq samples, and a report that
+ * lines them up with a captured kernel trace.
+ *
+ * With --trace-marker every sample over the outlier limit is queued on
+ * its thread's spike ring: a few stores, no system call.  A helper
+ * thread on the housekeeping CPU empties the rings and writes one line
+ * per spike to the ftrace trace_marker file,
+ *
+ *   fwq: spike thread T cpu C sample S start NS len NS now NS
+ *
+ * start is when the sample began, in CLOCK_MONOTONIC ns converted from
+ * ticks with the run's calibration, len its duration, and now the
+ * CLOCK_MONOTONIC time just before the marker was written.  ftrace
+ * stamps the marker itself with the trace clock, so the difference
+ * between that stamp and now places the spike on the trace clock
+ * whatever clock the trace uses, as long as it counts ns (local,
+ * global, mono, boot; not x86-tsc or counter).
+ *
+ * --trace-report=file reads a trace captured meanwhile (the text of
+ * tracing/trace, e.g. with the osnoise or timerlat tracers, or
+ * irq/sched events, enabled) and lists, for each spike, the events on
+ * the spike's CPU that overlap it.  Events that say when they started
+ * and how long they took ("start S.NS duration D ns", as osnoise's
+ * do) are matched on that interval, others on their timestamp.
+ *
+ * Licensed under the terms of the GNU Public Licence.  See LICENCE_GPL
+ * for details.
+ */
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#ifdef _WITH_PTHREADS_
+#include <pthread.h>
+#endif
+
+/* spikes queued per thread; more than that between two polls are
+   counted and dropped */
+#define TRACE_RING      256
+/* how long the helper sleeps between polls of the rings */
+#define TRACE_POLL_NS   1000000
+/* trace events this close to a spike still count as overlapping it */
+#define TRACE_SLACK_NS  2000
+
+struct trace_spike {
+  unsigned long long index;     /* sample number */
+  unsigned long long start;     /* ticks */
+  unsigned long long len;       /* ticks */
+};
+
+/* one per measuring thread.  head is only written by the measuring
+   thread and tail only by the helper, each on a line of its own. */
+struct trace_ring {
+  struct trace_spike spike[TRACE_RING];
+  unsigned long head;
+  unsigned long dropped;
+  unsigned long tail __attribute__((aligned(64)));
+} __attribute__((aligned(64)));
+
+struct trace {
+  int numthreads;
+  int cpu;                      /* housekeeping CPU, -1 to leave unpinned */
+  const uint32_t *cpus;
+  /* ticks to CLOCK_MONOTONIC: ns = ns0 + (tick - tick0) * ns_per_tick */
+  unsigned long long tick0, ns0;
+  double ns_per_tick;
+  struct trace_ring *rings;
+  int fd;                       /* trace_marker */
+  int stop;
+  unsigned long long written;
+#ifdef _WITH_PTHREADS_
+  pthread_t helper;
+#endif
+};
+
+extern int trace_open(struct trace *t);
+extern int trace_start(struct trace *t);
+extern void trace_finish(struct trace *t);
+extern int trace_report(FILE *fp, const char *fname);
+
+/**
+ * trace_spike() : measuring thread side.  queue a slow sample for the
+ * helper, or count it as dropped if the ring is full.
+ */
+static inline void trace_spike(struct trace_ring *r, unsigned long long index,
+			       unsigned long long start,
+			       unsigned long long len) {
+  struct trace_spike *s;
+
+  if (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= TRACE_RING) {
+    r->dropped++;
+    return;
+  }
+  s = &r->spike[r->head % TRACE_RING];
+  s->index = index;
+  s->start = start;
+  s->len = len;
+  __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+#endif /* __TRACE_H__ */